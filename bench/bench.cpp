@@ -0,0 +1,252 @@
+// Fixed iteration microbenchmarks for the reader, both evaluators and the
+// runtime of compiled programs. Results are printed as JSON, one benchmark
+// per line, so runs of two commits can be compared with diff.
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "common.h"
+#include "eval.h"
+#include "profile.h"
+#include "trt.h"
+#include "value.h"
+#include "vm.h"
+
+namespace {
+
+struct Result {
+  std::string name;
+  size_t iterations;
+  double ns;
+  double allocations;
+  double bytes;
+};
+
+class Suite {
+ public:
+  explicit Suite(std::string f) : filter(std::move(f)) {}
+  // Times iterations calls of op, after one call to warm up.
+  void run(const std::string& name, size_t iterations,
+           const std::function<void()>& op) {
+    if (name.find(filter) == std::string::npos) return;
+    op();
+    auto allocations = profile::allocations();
+    auto bytes = profile::allocated_bytes();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) op();
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double n = iterations;
+    results.push_back({name, iterations, elapsed.count() / n,
+                       (profile::allocations() - allocations) / n,
+                       (profile::allocated_bytes() - bytes) / n});
+  }
+  void print(std::ostream& out) const {
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      auto& result = results[i];
+      char line[256];
+      std::snprintf(line, sizeof(line),
+                    "    {\"name\": \"%s\", \"iterations\": %zu, "
+                    "\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+                    "\"bytes_per_op\": %.1f}",
+                    result.name.c_str(), result.iterations, result.ns,
+                    result.allocations, result.bytes);
+      out << line << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+  }
+
+ private:
+  std::string filter;
+  std::vector<Result> results;
+};
+
+// (quote (0 1 ... n-1))
+std::string number_list(size_t n) {
+  std::string src = "(quote (";
+  for (size_t i = 0; i < n; i++) src += std::to_string(i) + " ";
+  return src + "))";
+}
+
+// (quote ((((...)))))
+std::string nested_list(size_t depth) {
+  return "(quote " + std::string(depth, '(') + std::string(depth, ')') + ")";
+}
+
+// One small def per line.
+std::string script(size_t defs) {
+  std::string src;
+  for (size_t i = 0; i < defs; i++) {
+    auto n = std::to_string(i);
+    src += "(def f" + n + " (lambda (x) (+ x " + n + ")))\n";
+  }
+  return src;
+}
+
+const char* kDefinitions[] = {
+    "(def fib (lambda (n) (if (> 2 n) n (+ (fib (- n 1)) (fib (- n 2))))))",
+    "(def depth (lambda (n) (if (eq? n 0) 0 (+ 1 (depth (- n 1))))))",
+    "(def loop (lambda (n acc) (if (eq? n 0) acc (loop (- n 1) (+ acc 1)))))",
+    "(def sq (lambda (x) (* x x)))"};
+
+struct Program {
+  std::string name;
+  std::string src;
+  size_t iterations;
+};
+
+std::vector<Program> programs() {
+  return {{"arith", "(+ 1 2 (* 3 4) (- 10 5))", 200000},
+          {"fib_10", "(fib 10)", 2000},
+          {"fib_18", "(fib 18)", 20},
+          {"depth_1000", "(depth 1000)", 200},
+          {"loop_10000", "(loop 10000 0)", 50},
+          {"map_1000", "(map sq " + number_list(1000) + ")", 200}};
+}
+
+void bench_reader(Suite& suite) {
+  struct Input {
+    std::string name;
+    std::string src;
+    size_t iterations;
+  };
+  std::vector<Input> inputs = {
+      {"form_small", "(+ 1 2 (* 3 4))", 500000},
+      {"list_100", number_list(100), 50000},
+      {"list_10000", number_list(10000), 500},
+      {"nested_1000", nested_list(1000), 5000},
+      {"script_10", script(10), 20000},
+      {"script_1000", script(1000), 200}};
+  FlatAST ast;
+  for (auto& input : inputs)
+    suite.run("read/" + input.name, input.iterations, [&]() {
+      ast.clear();
+      read_forms(input.src, ast);
+    });
+}
+
+void bench_walker(Suite& suite) {
+  Environment env;
+  FlatAST ast;
+  for (auto definition : kDefinitions) read_forms(definition, ast);
+  for (size_t i = 0; i < ast.size(); i++) {
+    std::unique_ptr<ASTNode> form(ast.root(i).to_node());
+    delete eval_tree(form.get(), env);
+  }
+  for (auto& program : programs()) {
+    ast.clear();
+    read_forms(program.src, ast);
+    std::unique_ptr<ASTNode> form(ast.root(0).to_node());
+    suite.run("eval_tree/" + program.name, program.iterations,
+              [&]() { delete eval_tree(form.get(), env); });
+  }
+
+  for (auto& [name, src, iterations] :
+       std::vector<Program>{{"list_10", number_list(10), 200000},
+                            {"list_10000", number_list(10000), 200},
+                            {"nested_1000", nested_list(1000), 2000}}) {
+    ast.clear();
+    read_forms(src, ast);
+    std::unique_ptr<ASTNode> node(ast.root(0)[1].to_node());
+    suite.run("deepCopy/" + name, iterations,
+              [&]() { delete node->deepCopy(); });
+  }
+}
+
+void bench_vm(Suite& suite) {
+  Globals globals;
+  FlatAST ast;
+  for (auto definition : kDefinitions) read_forms(definition, ast);
+  for (size_t i = 0; i < ast.size(); i++)
+    run_chunk(compile_form(ast.root(i), globals));
+  suite.run("vm/compile/fib", 20000,
+            [&]() { compile_form(ast.root(0), globals); });
+  for (auto& program : programs()) {
+    ast.clear();
+    read_forms(program.src, ast);
+    auto chunk = compile_form(ast.root(0), globals);
+    suite.run("vm/" + program.name, program.iterations,
+              [&]() { run_chunk(chunk); });
+  }
+}
+
+IRNode* integer_node(int64_t value) {
+  auto node = allocNode();
+  node->type = ASTNodeType::Integer;
+  node->value = value;
+  return node;
+}
+
+IRNode* list_node(size_t n) {
+  auto list = allocList();
+  for (size_t i = n; i > 0; i--) listPushFront(list, integer_node(i - 1));
+  auto node = allocNode();
+  node->type = ASTNodeType::List;
+  node->value = (int64_t)list;
+  return node;
+}
+
+IRNode gArgument{ASTNodeType::Symbol, (int64_t)intern("x")};
+
+IRNode* identity_body(IRNode* x) { return x; }
+
+// The nodes the runtime allocates are collected at the safepoint after each
+// operation, so only the ones the benchmarks keep are rooted.
+void bench_runtime(Suite& suite) {
+  auto a = integer_node(20);
+  GCRoot rootA(a);
+  auto b = integer_node(22);
+  GCRoot rootB(b);
+  suite.run("trt/arithmetic/2", 1000000, [&]() {
+    arithmetic('+', 2, a, b);
+    gcSafepoint();
+  });
+  suite.run("trt/arithmetic/8", 500000, [&]() {
+    arithmetic('*', 8, a, b, a, b, a, b, a, b);
+    gcSafepoint();
+  });
+
+  auto identity = createLambda((void*)identity_body, 1, &gArgument);
+  GCRoot rootIdentity(identity);
+  suite.run("trt/executeLambda", 1000000,
+            [&]() { executeLambda(identity, 1, a); });
+
+  for (size_t n : {10, 1000}) {
+    auto list = list_node(n);
+    GCRoot rootList(list);
+    auto iterations = 1000000 / n;
+    suite.run("trt/cons/" + std::to_string(n), iterations, [&]() {
+      cons(integer_node(0), list);
+      gcSafepoint();
+    });
+    suite.run("trt/deepCopy/" + std::to_string(n), iterations, [&]() {
+      deepCopy(list);
+      gcSafepoint();
+    });
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+    std::cerr << "Usage :" << argv[0] << " [filter]\n"
+              << "Runs the benchmarks whose name contains filter and prints "
+                 "the results as JSON"
+              << std::endl;
+    return 1;
+  }
+  profile::count_allocations();
+  Suite suite(argc == 2 ? argv[1] : "");
+  bench_reader(suite);
+  bench_walker(suite);
+  bench_vm(suite);
+  bench_runtime(suite);
+  suite.print(std::cout);
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Runs every script in scripts/test that has a .out file next to it on each
+# engine and compares what it prints with the .out file. A script can list
+# the engines it runs on in a "# engines:" comment, vm -w -j by default, say
+# that it exits with an error with "# fails", start from the image saved
+# after running another script with "# image:", and set environment
+# variables with "# env:".
+# Usage: scripts/test.sh [path to todalu]
+TODALU=`readlink -f ${1:-todalu}`
+SCRIPT_DIR=`dirname -- "$0"`
+TMP_DIR=`mktemp -d`
+trap "rm -rf ${TMP_DIR}" EXIT
+cd ${SCRIPT_DIR}/test || exit
+failed=0
+for expected in *.out; do
+  script=${expected%.out}.tdl
+  engines=`sed -n 's/^# engines: //p' ${script}`
+  image=`sed -n 's/^# image: //p' ${script}`
+  variables=`sed -n 's/^# env: //p' ${script}`
+  grep -q '^# fails$' ${script} && status=1 || status=0
+  for engine in ${engines:-vm -w -j}; do
+    flags=${engine/#vm/}
+    if [ -n "${image}" ]; then
+      rm -f ${TMP_DIR}/image
+      ${TODALU} ${flags} --save-image ${TMP_DIR}/image ${image} \
+        > /dev/null 2>&1
+      flags="${flags} --image ${TMP_DIR}/image"
+    fi
+    { env ${variables} ${TODALU} ${flags} ${script} < /dev/null \
+      > ${TMP_DIR}/out; } 2> /dev/null && code=0 || code=1
+    if [ ${code} -ne ${status} ] || ! diff -u ${expected} ${TMP_DIR}/out; then
+      echo "FAIL ${script} (${engine})"
+      failed=1
+    fi
+  done
+done
+exit ${failed}
@@ -1,73 +1,319 @@
 #include "ast.h"
 
-#include <iostream>
-#include <sstream>
+#include <cctype>
+#include <charconv>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
-bool is_int(const std::string& str) {
-  try {
-    size_t pos;
-    std::stoi(str, &pos);
-    return pos == str.length();
-  } catch (...) {
+
+namespace {
+// Same order as Builtin
+const char* kBuiltinNames[] = {
+    "+",          "-",          "*",          "/",          "eq?",
+    "list?",      "int?",       "bool?",      "dec?",       "string?",
+    ">",          "progn",      "print",      "println",    "quote",
+    "eval",       "exit",       "readstr",    "read",       "car",
+    "cdr",        "cons",       "lambda",     "def",        "if",
+    "array",      "arange",     "array?",     "aref",       "sum",
+    "dot",        "min",        "max",        "prefix-sum", "map",
+    "filter",     "reduce",     "range",      "length",     "reverse",
+    "append",     "sort",       "time",       "memo",       "memo-stats",
+    "pmap",       "pfilter",    "preduce"};
+
+// Shared by every interpreter in the process, which may read forms on
+// different threads. names is a deque so that the names handed out stay put
+// as it grows.
+struct SymbolTable {
+  SymbolTable() {
+    for (auto name : kBuiltinNames) add(name);
+    add("#exception");
+  }
+  uint32_t add(const std::string& name) {
+    auto id = names.size();
+    ids[name] = id;
+    names.push_back(name);
+    return id;
+  }
+  std::shared_mutex mutex;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::deque<std::string> names;
+};
+
+SymbolTable& symbol_table() {
+  static SymbolTable table;
+  return table;
+}
+
+bool is_delimiter(char c) {
+  return std::isspace(static_cast<unsigned char>(c)) || c == '(' || c == ')';
+}
+
+char unescape(char c) {
+  switch (c) {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    default:
+      return c;
+  }
+}
+
+// Integers that don't fit in 64 bits keep their digits in the chars of ast.
+bool read_number(std::string_view token, FlatNode& node, FlatAST& ast) {
+  auto begin = token.data();
+  auto end = begin + token.size();
+  // from_chars doesn't take a leading '+'.
+  if (begin != end && *begin == '+') begin++;
+  auto digits = begin;
+  if (digits != end && *digits == '-' && begin == token.data()) digits++;
+  if (digits == end || !(std::isdigit(*digits) || *digits == '.'))
     return false;
+  int64_t integer;
+  auto result = std::from_chars(begin, end, integer);
+  if (result.ec == std::errc() && result.ptr == end) {
+    node.type = ASTNodeType::Integer;
+    node.integer = integer;
+    return true;
+  }
+  if (result.ec == std::errc::result_out_of_range && result.ptr == end) {
+    node.type = ASTNodeType::Integer;
+    node.first = ast.chars.size();
+    node.size = end - begin;
+    ast.chars.append(begin, end);
+    return true;
+  }
+  double decimal;
+  result = std::from_chars(begin, end, decimal);
+  if (result.ec == std::errc() && result.ptr == end) {
+    node.type = ASTNodeType::Decimal;
+    node.decimal = decimal;
+    return true;
   }
+  return false;
 }
+}  // namespace
 
-bool is_float(const std::string& input) {
-  std::istringstream iss(input);
-  float value;
-  iss >> std::noskipws >> value;
-  return iss.eof() && !iss.fail();
+uint32_t intern(const std::string& symbol) {
+  auto& table = symbol_table();
+  {
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    auto it = table.ids.find(symbol);
+    if (it != table.ids.end()) return it->second;
+  }
+  std::unique_lock<std::shared_mutex> lock(table.mutex);
+  auto it = table.ids.find(symbol);
+  if (it != table.ids.end()) return it->second;
+  return table.add(symbol);
 }
 
-float get_float(const std::string& input) {
-  std::istringstream iss(input);
-  float value;
-  iss >> std::noskipws >> value;
-  return value;
+const std::string& symbol_name(uint32_t id) {
+  auto& table = symbol_table();
+  std::shared_lock<std::shared_mutex> lock(table.mutex);
+  return table.names[id];
 }
 
-std::list<ASTNode*> create_ast(std::list<std::string>& tokens,
-                               bool closing_paren_allow) {
-  std::list<ASTNode*> ret;
-  if (tokens.empty())
-    throw TodaluException("Unexpected EOF while reading input");
+uint32_t FlatAST::add_integer(const BigInt& value) {
+  FlatNode node{ASTNodeType::Integer};
+  if (value.fits_int64()) {
+    node.integer = value.to_int64();
+  } else {
+    auto digits = value.to_string();
+    node.first = chars.size();
+    node.size = digits.size();
+    chars += digits;
+  }
+  return add(node);
+}
 
-  while (tokens.size()) {
-    std::string t = tokens.front();
-    tokens.pop_front();
-    ASTNode* node;
-    if (t == "(") {
-      node = new ListNode(create_ast(tokens, true));
-    } else if (t == ")") {
-      if (not closing_paren_allow) throw TodaluException("Unexpected ')'");
-      return ret;
-    } else if (t.starts_with("\"")) {
-      std::string str = t;
-      while (!t.ends_with("\"")) {
-        if (!tokens.size()) throw TodaluException("Unmatched '\"'");
-        t = tokens.front();
-        tokens.pop_front();
-        str += " ";
-        str += t;
+void FlatAST::close_list(uint32_t list, std::vector<uint32_t>& pending,
+                         size_t mark) {
+  nodes[list].first = children.size();
+  nodes[list].size = pending.size() - mark;
+  children.insert(children.end(), pending.begin() + mark, pending.end());
+  pending.resize(mark);
+}
+
+uint32_t FlatAST::add_copy(NodeRef node) {
+  auto copy = node.node();
+  switch (node.type()) {
+    case ASTNodeType::List: {
+      // The children of the children go after the range of this list's.
+      copy.first = children.size();
+      children.resize(copy.first + copy.size);
+      auto index = add(copy);
+      for (size_t i = 0; i < node.size(); i++) {
+        auto child = add_copy(node[i]);
+        children[copy.first + i] = child;
       }
-      node = new StringNode(str.substr(1, str.length() - 2));
-    } else if (is_int(t)) {
-      node = new IntegerNode(std::stoi(t));
-    } else if (is_float(t)) {
-      node = new DecimalNode(get_float(t));
+      return index;
+    }
+    case ASTNodeType::Integer:
+    case ASTNodeType::String:
+      if (copy.size) {
+        copy.first = chars.size();
+        chars += node.string();
+      }
+      break;
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      copy.first = objects.size();
+      objects.push_back(node.object());
+      break;
+    default:
+      break;
+  }
+  return add(copy);
+}
+
+NodeRef FlatAST::assign(NodeRef node) {
+  // A form read on its own is all of its FlatAST.
+  if (node.ast->roots.size() == 1 && node.ast->roots[0] == node.index) {
+    *this = *node.ast;
+  } else {
+    clear();
+    size_t size = 1;
+    for (std::vector<NodeRef> lists{node}; !lists.empty();) {
+      auto list = lists.back();
+      lists.pop_back();
+      size += list.size();
+      for (size_t i = 0; i < list.size(); i++)
+        if (list[i].type() == ASTNodeType::List) lists.push_back(list[i]);
+    }
+    nodes.reserve(size);
+    children.reserve(size);
+    roots.push_back(add_copy(node));
+  }
+  return root(0);
+}
+
+void read_forms(std::string_view src, FlatAST& ast) {
+  // Nodes read so far that have no parent yet, and for each open list its
+  // node and where its children start in pending. What is left at the end are
+  // the roots.
+  auto& pending = ast.roots;
+  std::vector<std::pair<uint32_t, size_t>> open;
+  bool read_any = false;
+  bool last_open = false;
+  size_t i = 0;
+  while (true) {
+    while (i < src.size() && std::isspace(static_cast<unsigned char>(src[i])))
+      i++;
+    if (i == src.size()) break;
+    read_any = true;
+    last_open = false;
+    FlatNode node{ASTNodeType::Symbol};
+    if (src[i] == '(') {
+      i++;
+      last_open = true;
+      node.type = ASTNodeType::List;
+      open.push_back({ast.add(node), pending.size()});
+      continue;
+    } else if (src[i] == ')') {
+      i++;
+      if (open.empty()) throw TodaluException("Unexpected ')'");
+      auto [list, mark] = open.back();
+      open.pop_back();
+      ast.close_list(list, pending, mark);
+      pending.push_back(list);
+      continue;
+    } else if (src[i] == '"') {
+      i++;
+      node.type = ASTNodeType::String;
+      node.first = ast.chars.size();
+      while (true) {
+        auto end = src.find_first_of("\\\"", i);
+        if (end == std::string_view::npos)
+          throw TodaluException("Unmatched '\"'");
+        ast.chars.append(src, i, end - i);
+        i = end + 1;
+        if (src[end] == '"') break;
+        if (i == src.size()) throw TodaluException("Unmatched '\"'");
+        ast.chars += unescape(src[i++]);
+      }
+      node.size = ast.chars.size() - node.first;
     } else {
-      // Handle bool in granthalaya, symbol for now
-      node = new SymbolNode(t);
+      auto start = i;
+      while (i < src.size() && !is_delimiter(src[i])) i++;
+      auto token = src.substr(start, i - start);
+      if (!read_number(token, node, ast))
+        node.id = intern(std::string(token));
+    }
+    pending.push_back(ast.add(node));
+  }
+  if (!read_any || last_open)
+    throw TodaluException("Unexpected EOF while reading input");
+  if (open.size()) throw TodaluException("Unmatched '('");
+}
+
+std::string NodeRef::getRepr() const {
+  switch (type()) {
+    case ASTNodeType::Bool:
+      return boolean() ? "#true" : "#false";
+    case ASTNodeType::Integer:
+      return is_bigint() ? std::string(string()) : std::to_string(integer());
+    case ASTNodeType::Decimal:
+      return std::to_string(decimal());
+    case ASTNodeType::String:
+      return "\"" + std::string(string()) + "\"";
+    case ASTNodeType::Symbol:
+      return symbol();
+    case ASTNodeType::List: {
+      std::string lr = "( ";
+      for (size_t i = 0; i < size(); i++) {
+        lr += (*this)[i].getRepr();
+        lr += " ";
+      }
+      lr += ")";
+      return lr;
     }
-    ret.push_back(node);
+    case ASTNodeType::Lambda:
+      return std::string("<lambda=") + std::to_string((uint64_t)object()) +
+             ">";
+    case ASTNodeType::Array:
+      return "<array>";
   }
-  if (closing_paren_allow) throw TodaluException("Unmatched '('");
-  return ret;
+  return "";
 }
 
-void free_ast(std::list<ASTNode*>& list) {
-  for (auto node : list) delete node;
+ASTNode* NodeRef::to_node() const {
+  switch (type()) {
+    case ASTNodeType::Bool:
+      return new BoolNode(boolean());
+    case ASTNodeType::Integer:
+      if (is_bigint()) return new IntegerNode(bigint());
+      return new IntegerNode(integer());
+    case ASTNodeType::Decimal:
+      return new DecimalNode(decimal());
+    case ASTNodeType::String:
+      return new StringNode(std::string(string()));
+    case ASTNodeType::Symbol:
+      return new SymbolNode(symbol(), id());
+    case ASTNodeType::List: {
+      std::list<ASTNode*> children;
+      for (size_t i = 0; i < size(); i++)
+        children.push_back((*this)[i].to_node());
+      return new ListNode(children);
+    }
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      break;
+  }
+  throw std::runtime_error("Can't convert node to a tree");
+}
+
+std::string array_repr(const NumArray& array) {
+  std::string repr = "[ ";
+  for (size_t i = 0; i < array.size(); i++) {
+    repr += array.decimal ? std::to_string(array.decimals[i])
+                          : std::to_string(array.ints[i]);
+    repr += " ";
+  }
+  repr += "]";
+  return repr;
 }
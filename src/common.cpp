@@ -1,25 +1,133 @@
 #include "common.h"
 
-#include <list>
-#include <regex>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
 #include <string>
+#include <vector>
 
 #include "granthalaya.h"
 
+namespace {
+// Bytes read at a time from scripts that can't be mapped.
+constexpr size_t kChunkSize = 1 << 16;
+}  // namespace
+
 void Inpiler::load_granthalaya() {
-  std::string str((char*)granthalaya_tdl, granthalaya_tdl_len);
-  std::istringstream is(str);
-  std::string line;
-  std::string wholeline = "";
-  while (std::getline(is, line)) {
-    wholeline += line;
-    if (is_balanced(wholeline)) {
-      handle_line(wholeline);
-      wholeline = "";
+  FormReader reader;
+  auto emit = [this](const std::string& form) { handle_line(form); };
+  reader.feed({(char*)granthalaya_tdl, granthalaya_tdl_len}, emit);
+  if (!reader.finish(emit))
+    throw std::runtime_error("Please check that the input is wellformed");
+}
+
+bool Inpiler::load_file(const std::string& path) {
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct File {
+    ~File() { close(fd); }
+    int fd;
+  } file{fd};
+  FormReader reader;
+  auto emit = [this](const std::string& form) { handle_line(form); };
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data != MAP_FAILED) {
+    struct Mapping {
+      ~Mapping() { munmap(data, size); }
+      void* data;
+      size_t size;
+    } mapping{data, (size_t)st.st_size};
+    madvise(data, mapping.size, MADV_SEQUENTIAL);
+    reader.feed({static_cast<const char*>(data), mapping.size}, emit);
+  } else {
+    std::vector<char> chunk(kChunkSize);
+    while (true) {
+      auto size = read(fd, chunk.data(), chunk.size());
+      if (size == 0) break;
+      if (size < 0) {
+        if (errno == EINTR) continue;
+        throw TodaluException("Couldn't read " + path);
+      }
+      reader.feed({chunk.data(), (size_t)size}, emit);
+    }
+  }
+  if (!reader.finish(emit))
+    throw std::runtime_error("Please check that the input is wellformed");
+  return true;
+}
+
+void FormReader::feed(std::string_view text, const Emit& emit) {
+  for (auto c : text) {
+    if (in_comment) {
+      if (c == '\n') {
+        in_comment = false;
+        line_start = true;
+      }
+      continue;
+    }
+    if (in_string) {
+      form += c;
+      if (escaped) {
+        escaped = false;
+      } else if (c == '\\') {
+        escaped = true;
+      } else if (c == '"') {
+        in_string = false;
+        if (depth == 0) complete(emit);
+      }
+      continue;
+    }
+    bool blank = std::isspace(static_cast<unsigned char>(c));
+    if (in_atom && (blank || c == '(' || c == ')')) complete(emit);
+    if (c == '\n') {
+      line_start = true;
+    } else if (!blank) {
+      if (line_start && c == '#') {
+        in_comment = true;
+        continue;
+      }
+      line_start = false;
+    }
+    if (blank) {
+      // Kept inside lists, where they separate tokens.
+      if (depth) form += c;
+      continue;
+    }
+    form += c;
+    if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      // A ')' that closes nothing goes on as a form of its own, so that the
+      // engine reports it.
+      if (depth == 0 || --depth == 0) complete(emit);
+    } else if (c == '"') {
+      in_string = true;
+    } else if (depth == 0) {
+      in_atom = true;
     }
   }
 }
 
+bool FormReader::finish(const Emit& emit) {
+  if (in_atom) complete(emit);
+  bool finished = form.empty();
+  *this = FormReader();
+  return finished;
+}
+
+void FormReader::complete(const Emit& emit) {
+  in_atom = false;
+  emit(form);
+  form.clear();
+}
+
 bool is_comment(std::string& line) {
   for (auto c : line) {
     if (std::isspace(c)) continue;
@@ -28,16 +136,3 @@ bool is_comment(std::string& line) {
   }
   return true;
 }
-
-std::list<std::string> tokenizer(std::string& str) {
-  str = std::regex_replace(str, std::regex("\n"), " ");
-  str = std::regex_replace(str, std::regex("\\("), " ( ");
-  str = std::regex_replace(str, std::regex("\\)"), " ) ");
-  std::list<std::string> tokens;
-  std::stringstream ss(str);
-  std::string token;
-  while (ss >> token) {
-    tokens.push_back(token);
-  }
-  return tokens;
-}
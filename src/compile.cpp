@@ -1,64 +1,145 @@
 #include "compile.h"
 
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Linker/Linker.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
 
 #include <map>
 
 #include "ast.h"
 #include "common.h"
+#include "trt.h"
 
 typedef union _as {
   int64_t integer;
   double decimal;
 } as;
 
-static std::map<std::string, int64_t> gSymbolMap;
-
-llvm::LLVMContext context;
 using namespace llvm;
 
-Compiler::Compiler(std::string s) : mfilename(s) {
+Compiler::Compiler(std::string s, bool jit, unsigned level)
+    : mfilename(s),
+      mjit(jit),
+      mlevel(level),
+      pcontext(std::make_unique<LLVMContext>()),
+      context(*pcontext) {
   pmodule = new Module(mfilename, context);
   pbuilder = new IRBuilder<>(context);
-  SMDiagnostic error;
-  originalModule = parseIRFile("trt.ll", error, context);
-  if (!originalModule) {
-    error.print("llvm-ir-example", errs());
-    exit(1);
+  if (!mjit) {
+    SMDiagnostic error;
+    originalModule = parseIRFile("trt.ll", error, context);
+    if (!originalModule) {
+      error.print("llvm-ir-example", errs());
+      exit(1);
+    }
   }
   irnode = StructType::create(context, "IRNode");
   irnode->setBody(pbuilder->getInt8Ty(), pbuilder->getInt64Ty());
+  lambdaStruct = StructType::create(context, "LambdaStruct");
+  lambdaStruct->setBody(pbuilder->getInt8PtrTy(), pbuilder->getInt8PtrTy(),
+                        pbuilder->getInt32Ty(), pbuilder->getInt8PtrTy());
   FunctionType* mainFunType = FunctionType::get(pbuilder->getInt32Ty(), false);
   pfun = Function::Create(mainFunType, Function::ExternalLinkage, "main",
                           *pmodule);
+  mainFun = pfun;
   BasicBlock* mainEntry = BasicBlock::Create(context, "entry", pfun);
   pbuilder->SetInsertPoint(mainEntry);
 }
 
-int64_t convert_sym(SymbolNode* node, bool create = false) {
-  static int64_t gNextValue = 0;
-  if (gSymbolMap.find(node->symbol) == gSymbolMap.end()) {
+namespace {
+
+// What the optimizer may assume about a runtime function it only sees the
+// declaration of. The ones marked nounwind are noexcept in trt.cpp.
+struct RuntimeFunction {
+  std::vector<Attribute::AttrKind> attributes;
+  // The returned node is newly allocated, so nothing else points to it.
+  bool fresh = false;
+};
+
+const std::vector<Attribute::AttrKind> kAllocates = {
+    Attribute::NoUnwind, Attribute::WillReturn, Attribute::InaccessibleMemOnly};
+
+const std::map<std::string, RuntimeFunction> kRuntimeFunctions = {
+    {"_Z9allocNodev", {kAllocates, true}},
+    {"_Z9allocListv", {kAllocates, true}},
+    {"_Z13listPushFrontPcP7_IRNode",
+     {{Attribute::NoUnwind, Attribute::WillReturn,
+       Attribute::InaccessibleMemOrArgMemOnly}}},
+    {"_Z7is_typeP7_IRNodej",
+     {{Attribute::NoUnwind, Attribute::WillReturn,
+       Attribute::InaccessibleMemOrArgMemOnly}}},
+    {"_Z7boxBoolb", {kAllocates}},
+    {"_Z10boxIntegerl", {kAllocates}},
+    {"_Z17evaluateConditionP7_IRNode",
+     {{Attribute::NoUnwind, Attribute::WillReturn, Attribute::ReadOnly}}},
+    // Throws for undefined symbols.
+    {"_Z8retrieveP7_IRNode", {{Attribute::ReadOnly}}},
+    {"_Z10startTimerv",
+     {{Attribute::NoUnwind, Attribute::WillReturn,
+       Attribute::InaccessibleMemOnly}}},
+    {"_Z4quitP7_IRNode", {{Attribute::NoReturn}}},
+    {"_Z14throwExceptionv", {{Attribute::NoReturn}}},
+    {"_Z11gcSafepointv", {{Attribute::NoUnwind}}},
+    {"_Z9isBoundToP7_IRNodePvi",
+     {{Attribute::NoUnwind, Attribute::WillReturn, Attribute::ReadOnly}}},
+    // Functions returning booleans or integers may return shared nodes, and
+    // car the element itself, so only the others return fresh nodes.
+    {"_Z12createLambdaPviz", {{}, true}},
+    {"_Z10bigIntegerPKc", {{}, true}},
+    {"_Z3cdrP7_IRNode", {{}, true}},
+    {"_Z4consP7_IRNodeS0_", {{}, true}},
+    {"_Z6arangeP7_IRNodeS0_", {{}, true}},
+    {"_Z9prefixSumP7_IRNode", {{}, true}},
+    {"_Z7mapListP7_IRNodeS0_", {{}, true}},
+    {"_Z10filterListP7_IRNodeS0_", {{}, true}},
+    {"_Z9rangeListP7_IRNodeS0_", {{}, true}},
+    {"_Z11reverseListP7_IRNode", {{}, true}},
+    {"_Z11appendListsjz", {{}, true}},
+    {"_Z8sortListP7_IRNodeS0_", {{}, true}},
+    {"_Z7memoizeP7_IRNodeS0_", {{}, true}},
+    {"_Z9memoStatsP7_IRNode", {{}, true}}};
+
+}  // namespace
+
+// Declaration of the runtime function name in the module, defined by trt.ll
+// or, with the jit, by this process. Every runtime call goes through here, so
+// the declarations carry the attributes in kRuntimeFunctions.
+Function* Compiler::runtime_function(const std::string& name,
+                                     FunctionType* type) {
+  auto fun =
+      cast<Function>(pmodule->getOrInsertFunction(name, type).getCallee());
+  auto it = kRuntimeFunctions.find(name);
+  if (it == kRuntimeFunctions.end() || !fun->isDeclaration()) return fun;
+  for (auto kind : it->second.attributes) fun->addFnAttr(kind);
+  if (it->second.fresh) fun->addRetAttr(Attribute::NoAlias);
+  return fun;
+}
+
+int64_t Compiler::convert_sym(NodeRef node, bool create) {
+  auto& symbol = node.symbol();
+  if (msymbolIds.find(symbol) == msymbolIds.end()) {
     if (create)
-      gSymbolMap[node->symbol] = gNextValue++;
+      msymbolIds[symbol] = msymbolIds.size();
     else
-      throw std::runtime_error("Symbol definition doesn't exist : " +
-                               node->symbol);
+      throw std::runtime_error("Symbol definition doesn't exist : " + symbol);
   }
 
-  return gSymbolMap[node->symbol];
+  return msymbolIds[symbol];
 }
 
 Value* Compiler::generate_irnode(uint32_t type, Value* value) {
   FunctionType* operationType =
       FunctionType::get(PointerType::get(irnode, 0), false);
-  Function* operation = Function::Create(
-      operationType, Function::ExternalLinkage, "_Z9allocNodev");
+  Function* operation = runtime_function("_Z9allocNodev", operationType);
   Value* nodeobj = pbuilder->CreateCall(operation);
   Value* typeidx[] = {pbuilder->getInt32(0), pbuilder->getInt32(0)};
   Value* fieldtype =
@@ -79,8 +160,22 @@ Value* Compiler::generate_irnode(uint32_t type, int64_t value) {
   return generate_irnode(type, valueV);
 }
 
-Value* Compiler::generate_string(StringNode* node) {
-  Constant* strConstant = ConstantDataArray::getString(context, node->value);
+// Symbol nodes are never written by the runtime, so every use of a symbol
+// shares one constant node. Repeated lookups of a symbol then pass the same
+// pointer to retrieve, which lets the optimizer merge them.
+Value* Compiler::generate_symbol(int64_t id) {
+  auto& global = msymbols[id];
+  if (!global)
+    global = new GlobalVariable(
+        *pmodule, irnode, true, GlobalValue::PrivateLinkage,
+        ConstantStruct::get(irnode, {pbuilder->getInt8(ASTNodeType::Symbol),
+                                     pbuilder->getInt64(id)}),
+        "symbol");
+  return global;
+}
+
+Value* Compiler::generate_string(NodeRef node) {
+  Constant* strConstant = ConstantDataArray::getString(context, node.string());
   GlobalVariable* strGlobal =
       new GlobalVariable(*pmodule, strConstant->getType(), true,
                          GlobalValue::PrivateLinkage, strConstant);
@@ -90,11 +185,49 @@ Value* Compiler::generate_string(StringNode* node) {
   return generate_irnode(ASTNodeType::String, strPtr);
 }
 
-Value* Compiler::generate_lambda(LambdaNode* node) {
-  // Lambda body as a function
-  FunctionType* funType = FunctionType::get(PointerType::get(irnode, 0), false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
+namespace {
+
+// Whether node defines symbol, or refers to it from a nested lambda. Such
+// parameters are bound in the environment of the runtime while the lambda
+// runs, instead of being used directly.
+bool needs_binding(NodeRef node, const std::string& symbol,
+                   bool nested = false) {
+  if (node.type() == ASTNodeType::Symbol)
+    return nested && node.symbol() == symbol;
+  if (node.type() != ASTNodeType::List || !node.size()) return false;
+  if (node.front().type() == ASTNodeType::Symbol) {
+    auto& fun = node.front().symbol();
+    if (fun == "lambda") nested = true;
+    if (fun == "def" && node.size() > 1 &&
+        node[1].type() == ASTNodeType::Symbol && node[1].symbol() == symbol)
+      return true;
+  }
+  for (size_t i = 0; i < node.size(); i++)
+    if (needs_binding(node[i], symbol, nested)) return true;
+  return false;
+}
+
+}  // namespace
+
+// Lambda bodies are functions taking the arguments as nodes. name is the
+// symbol the lambda is being defined as, which lets calls to it be direct.
+Value* Compiler::generate_lambda(NodeRef arglist, NodeRef body,
+                                 const std::string& name) {
+  if (arglist.type() != ASTNodeType::List)
+    throw std::runtime_error("Lambda's arlist needs to be of type list");
+  for (size_t i = 0; i < arglist.size(); i++) {
+    if (arglist[i].type() != ASTNodeType::Symbol)
+      throw std::runtime_error("lambda argument list has non-symbol");
+  }
+  std::vector<Type*> params(arglist.size(), PointerType::get(irnode, 0));
+  FunctionType* funType =
+      FunctionType::get(PointerType::get(irnode, 0), params, false);
+  Function* fun = Function::Create(funType, Function::InternalLinkage,
                                    "lambdaFunction", *pmodule);
+  if (!name.empty()) {
+    mlambdas[name] = fun;
+    specialize(arglist, body, fun);
+  }
   // NOTE: We need to generate the args to create symbols before we generate
   // lambda body. Else the body will try to retrieve values for symbols and fail
   // because the convert_sym function only allows retrieving a value that has
@@ -104,15 +237,12 @@ Value* Compiler::generate_lambda(LambdaNode* node) {
   std::vector<Value*> operands;
   operands.push_back(
       ConstantExpr::getBitCast(fun, Type::getInt8PtrTy(context)));
-  if (node->arglist->type() != ASTNodeType::List)
-    throw std::runtime_error("Lambda's arlist needs to be of type list");
-  auto arglist = dynamic_cast<ListNode*>(node->arglist)->list;
   // Second argument is number of var_args
   operands.push_back(pbuilder->getInt32(arglist.size()));
   // Rest of the arguments are the symbols
-  for (auto it = arglist.begin(); it != arglist.end(); it++) {
-    auto symInt = convert_sym(dynamic_cast<SymbolNode*>(*it), true);
-    operands.push_back(generate_irnode(ASTNodeType::Symbol, symInt));
+  for (size_t i = 0; i < arglist.size(); i++) {
+    auto symInt = convert_sym(arglist[i], true);
+    operands.push_back(generate_symbol(symInt));
   }
 
   // Create lambda body
@@ -120,75 +250,398 @@ Value* Compiler::generate_lambda(LambdaNode* node) {
   auto saveBlock = pbuilder->GetInsertBlock();
   auto saveIt = pbuilder->GetInsertPoint();
   auto parentFun = pfun;
+  auto parentParams = std::move(mparams);
+  mparams.clear();
   pbuilder->SetInsertPoint(entryBB);
   pfun = fun;
-  pbuilder->CreateRet(generate_code(node->body));
+  generate_safepoint();
+  auto retried = generate_specialized_call(fun);
+  std::vector<Value*> bound;
+  for (size_t i = 0; i < arglist.size(); i++) {
+    auto& symbol = arglist[i].symbol();
+    if (needs_binding(body, symbol)) {
+      bound.push_back(operands[i + 2]);
+      generate_define(bound.back(), fun->getArg(i));
+    } else {
+      mparams[symbol] = fun->getArg(i);
+    }
+  }
+  auto result = generate_code(body);
+  for (auto symbol : bound)
+    generate_runtime_call("_Z8undefineP7_IRNode", {symbol});
+  if (retried) {
+    auto retrying = mspecialized.at(fun).retrying;
+    pbuilder->CreateStore(
+        pbuilder->CreateAnd(
+            pbuilder->CreateLoad(pbuilder->getInt1Ty(), retrying),
+            pbuilder->CreateNot(retried)),
+        retrying);
+  }
+  pbuilder->CreateRet(result);
+  add_shadow_frame(fun);
   pfun = parentFun;
+  mparams = std::move(parentParams);
   pbuilder->SetInsertPoint(saveBlock, saveIt);
 
   // Invoke createLambda to create the lambda node
   FunctionType* fun2Type = FunctionType::get(
       PointerType::get(irnode, 0),
       {Type::getInt8PtrTy(context), pbuilder->getInt32Ty()}, true);
-  Function* fun2 = Function::Create(fun2Type, Function::ExternalLinkage,
-                                    "_Z12createLambdaPviz");
+  Function* fun2 = runtime_function("_Z12createLambdaPviz", fun2Type);
   auto ret = pbuilder->CreateCall(fun2, operands);
   return ret;
 }
 
-Value* Compiler::generate_irnode(ASTNode* node) {
+namespace {
+
+// Specializations expand calls to themselves in place, like C compilers do
+// with recursive functions. Three levels cut the calls of fib by 8.
+const unsigned kInlineDepth = 3;
+const size_t kInlineBudget = 512;
+
+size_t count_nodes(NodeRef node) {
+  size_t count = 1;
+  if (node.type() == ASTNodeType::List)
+    for (size_t i = 0; i < node.size(); i++) count += count_nodes(node[i]);
+  return count;
+}
+
+}  // namespace
+
+// Type of node in the body of lambda, with the parameters taken to be
+// integers, or Unknown if lambda can't be specialized. Adds the lambdas node
+// calls to the callees of the specialization.
+StaticType Compiler::infer_pure(NodeRef node, PureLambda& lambda) {
+  switch (node.type()) {
+    case ASTNodeType::Bool:
+      return StaticType::Bool;
+    case ASTNodeType::Integer:
+      return node.is_bigint() ? StaticType::Unknown : StaticType::Integer;
+    case ASTNodeType::Symbol:
+      return lambda.params.count(node.symbol()) ? StaticType::Integer
+                                                : StaticType::Unknown;
+    case ASTNodeType::List:
+      break;
+    default:
+      return StaticType::Unknown;
+  }
+  if (!node.size() || node.front().type() != ASTNodeType::Symbol)
+    return StaticType::Unknown;
+  auto head = node.front();
+  auto& fun = head.symbol();
+  std::vector<StaticType> types;
+  bool integers = true;
+  for (size_t i = 1; i < node.size(); i++) {
+    types.push_back(infer_pure(node[i], lambda));
+    if (types.back() == StaticType::Unknown) return StaticType::Unknown;
+    integers &= types.back() == StaticType::Integer;
+  }
+  if (fun == "+" || fun == "-" || fun == "*" || fun == "/")
+    return types.size() >= 2 && integers ? StaticType::Integer
+                                         : StaticType::Unknown;
+  if (fun == ">")
+    return types.size() == 2 && integers ? StaticType::Bool
+                                         : StaticType::Unknown;
+  if (fun == "eq?")
+    return types.size() == 2 ? StaticType::Bool : StaticType::Unknown;
+  if (fun == "if")
+    return types.size() == 3 && types[1] == types[2] ? types[1]
+                                                     : StaticType::Unknown;
+  if (fun == "progn")
+    return types.empty() ? StaticType::Unknown : types.back();
+  if (is_builtin(head.id()) || fun == "exception!" ||
+      lambda.params.count(fun) || !integers)
+    return StaticType::Unknown;
+  auto it = mlambdas.find(fun);
+  if (it == mlambdas.end() || it->second->arg_size() != types.size())
+    return StaticType::Unknown;
+  auto& specialization = lambda.specialization;
+  // A symbol is only ever checked against one function.
+  auto add_callee = [&](const std::string& symbol, Function* callee) {
+    auto added = specialization.callees.insert({symbol, callee});
+    return added.first->second == callee;
+  };
+  if (it->second == lambda.generic)
+    return add_callee(fun, it->second) ? specialization.result
+                                       : StaticType::Unknown;
+  auto callee = mspecialized.find(it->second);
+  if (callee == mspecialized.end() || !add_callee(fun, it->second))
+    return StaticType::Unknown;
+  for (auto& [symbol, function] : callee->second.callees)
+    if (!add_callee(symbol, function)) return StaticType::Unknown;
+  return callee->second.result;
+}
+
+// Compiles the specialization of the lambda whose function is generic, if it
+// has one. It calls itself directly, so its result type is assumed to be an
+// integer, and then a boolean, until the body agrees.
+void Compiler::specialize(NodeRef arglist, NodeRef body, Function* generic) {
+  PureLambda lambda{generic};
+  for (size_t i = 0; i < arglist.size(); i++)
+    lambda.params[arglist[i].symbol()] = nullptr;
+  if (lambda.params.size() != arglist.size()) return;
+  auto& specialization = lambda.specialization;
+  for (auto result : {StaticType::Integer, StaticType::Bool}) {
+    specialization = Specialization();
+    specialization.result = result;
+    if (infer_pure(body, lambda) == result) break;
+    specialization.result = StaticType::Unknown;
+  }
+  if (specialization.result == StaticType::Unknown) return;
+  lambda.arglist = &arglist;
+  lambda.body = &body;
+  lambda.size = count_nodes(body);
+  lambda.depth = kInlineDepth;
+  lambda.budget = kInlineBudget;
+
+  auto valueType = specialization.result == StaticType::Integer
+                       ? pbuilder->getInt64Ty()
+                       : pbuilder->getInt1Ty();
+  auto resultType =
+      StructType::get(context, {valueType, pbuilder->getInt1Ty()});
+  std::vector<Type*> params(arglist.size(), pbuilder->getInt64Ty());
+  auto fun = Function::Create(FunctionType::get(resultType, params, false),
+                              Function::InternalLinkage,
+                              generic->getName() + ".int", *pmodule);
+  fun->addFnAttr(Attribute::NoUnwind);
+  specialization.fun = fun;
+  specialization.retrying = new GlobalVariable(
+      *pmodule, pbuilder->getInt1Ty(), false, GlobalValue::InternalLinkage,
+      pbuilder->getFalse(), generic->getName() + ".retrying");
+  for (size_t i = 0; i < arglist.size(); i++)
+    lambda.params[arglist[i].symbol()] = fun->getArg(i);
+
+  auto saveBlock = pbuilder->GetInsertBlock();
+  auto saveIt = pbuilder->GetInsertPoint();
+  auto parentFun = pfun;
+  pfun = fun;
+  auto entryBB = BasicBlock::Create(context, "entry", fun);
+  lambda.failed = BasicBlock::Create(context, "failed", fun);
+  pbuilder->SetInsertPoint(lambda.failed);
+  pbuilder->CreateRet(ConstantStruct::get(
+      resultType, {UndefValue::get(valueType), pbuilder->getTrue()}));
+  pbuilder->SetInsertPoint(entryBB);
+  auto result = generate_pure(body, lambda);
+  pbuilder->CreateRet(pbuilder->CreateInsertValue(
+      ConstantStruct::get(resultType,
+                          {UndefValue::get(valueType), pbuilder->getFalse()}),
+      result, 0));
+  pfun = parentFun;
+  pbuilder->SetInsertPoint(saveBlock, saveIt);
+  mspecialized[generic] = specialization;
+}
+
+// Computes node, which infer_pure typed, in the specialization of lambda.
+// Overflow, division by zero and failed calls return through lambda.failed.
+Value* Compiler::generate_pure(NodeRef node, PureLambda& lambda) {
+  switch (node.type()) {
+    case ASTNodeType::Bool:
+      return pbuilder->getInt1(node.boolean());
+    case ASTNodeType::Integer:
+      return pbuilder->getInt64(node.integer());
+    case ASTNodeType::Symbol:
+      return lambda.params.at(node.symbol());
+    default:
+      break;
+  }
+  auto fail_if = [&](Value* failed) {
+    auto okBB = BasicBlock::Create(context, "", pfun);
+    pbuilder->CreateCondBr(failed, lambda.failed, okBB,
+                           MDBuilder(context).createBranchWeights(1, 1000));
+    pbuilder->SetInsertPoint(okBB);
+  };
+  auto& fun = node.front().symbol();
+  if (fun == "if") {
+    auto condition = generate_pure(node[1], lambda);
+    if (condition->getType() != pbuilder->getInt1Ty())
+      condition = pbuilder->CreateICmpNE(condition, pbuilder->getInt64(0));
+    auto ifBB = BasicBlock::Create(context, "", pfun);
+    auto elseBB = BasicBlock::Create(context, "", pfun);
+    auto mergeBB = BasicBlock::Create(context, "", pfun);
+    pbuilder->CreateCondBr(condition, ifBB, elseBB);
+    pbuilder->SetInsertPoint(ifBB);
+    auto ifret = generate_pure(node[2], lambda);
+    auto ifendBB = pbuilder->GetInsertBlock();
+    pbuilder->CreateBr(mergeBB);
+    pbuilder->SetInsertPoint(elseBB);
+    auto elseret = generate_pure(node[3], lambda);
+    auto elseendBB = pbuilder->GetInsertBlock();
+    pbuilder->CreateBr(mergeBB);
+    pbuilder->SetInsertPoint(mergeBB);
+    auto phinode = pbuilder->CreatePHI(ifret->getType(), 2);
+    phinode->addIncoming(ifret, ifendBB);
+    phinode->addIncoming(elseret, elseendBB);
+    return phinode;
+  }
+  std::vector<Value*> values;
+  for (size_t i = 1; i < node.size(); i++)
+    values.push_back(generate_pure(node[i], lambda));
+  if (fun == "progn") return values.back();
+  if (fun == "+" || fun == "-" || fun == "*" || fun == "/") {
+    Value* failed;
+    auto result = generate_checked(fun[0], values, failed);
+    fail_if(failed);
+    return result;
+  }
+  if (fun == ">") return pbuilder->CreateICmpSGT(values[0], values[1]);
+  if (fun == "eq?") {
+    if (values[0]->getType() != values[1]->getType())
+      return pbuilder->getFalse();
+    return pbuilder->CreateICmpEQ(values[0], values[1]);
+  }
+  auto generic = mlambdas.at(fun);
+  if (generic == lambda.generic && lambda.depth &&
+      lambda.budget >= lambda.size) {
+    lambda.budget -= lambda.size;
+    auto params = lambda.params;
+    for (size_t i = 0; i < values.size(); i++)
+      lambda.params[(*lambda.arglist)[i].symbol()] = values[i];
+    lambda.depth--;
+    auto result = generate_pure(*lambda.body, lambda);
+    lambda.depth++;
+    lambda.params = std::move(params);
+    return result;
+  }
+  auto callee = generic == lambda.generic ? lambda.specialization.fun
+                                          : mspecialized.at(generic).fun;
+  auto result = pbuilder->CreateCall(callee, values);
+  fail_if(pbuilder->CreateExtractValue(result, 1));
+  return pbuilder->CreateExtractValue(result, 0);
+}
+
+// Starts the function of a lambda with a call to its specialization, if it
+// has one, when the arguments are integers and the lambdas it calls are still
+// bound to the functions it was compiled against. Its result is boxed and
+// returned unless it failed, and then the generic body runs instead. Returns
+// an i1 that is true in the generic body if it failed, or null without a
+// specialization.
+//
+// The generic body recomputes what the specialization did before it failed,
+// so calls to the lambda made while it runs don't try the specialization
+// again. A factorial that overflows 1000 levels deep would otherwise redo
+// the levels below each of them, and take time quadratic in the depth.
+Value* Compiler::generate_specialized_call(Function* generic) {
+  auto it = mspecialized.find(generic);
+  if (it == mspecialized.end()) return nullptr;
+  auto& specialization = it->second;
+  auto nodeType = PointerType::get(irnode, 0);
+  auto genericBB = BasicBlock::Create(context);
+  auto typesBB = BasicBlock::Create(context, "", pfun);
+  pbuilder->CreateCondBr(
+      pbuilder->CreateLoad(pbuilder->getInt1Ty(), specialization.retrying),
+      genericBB, typesBB);
+
+  pbuilder->SetInsertPoint(typesBB);
+  Value* integers = pbuilder->getTrue();
+  for (auto& arg : generic->args()) {
+    auto type = pbuilder->CreateLoad(pbuilder->getInt8Ty(),
+                                     pbuilder->CreateStructGEP(irnode, &arg, 0));
+    integers = pbuilder->CreateAnd(
+        integers,
+        pbuilder->CreateICmpEQ(type, pbuilder->getInt8(ASTNodeType::Integer)));
+  }
+  auto boundBB = BasicBlock::Create(context, "", pfun);
+  pbuilder->CreateCondBr(integers, boundBB, genericBB);
+
+  pbuilder->SetInsertPoint(boundBB);
+  FunctionType* boundType = FunctionType::get(
+      pbuilder->getInt1Ty(),
+      {nodeType, pbuilder->getInt8PtrTy(), pbuilder->getInt32Ty()}, false);
+  auto isBoundTo = runtime_function("_Z9isBoundToP7_IRNodePvi", boundType);
+  Value* bound = pbuilder->getTrue();
+  for (auto& [symbol, callee] : specialization.callees)
+    bound = pbuilder->CreateAnd(
+        bound, pbuilder->CreateCall(
+                   isBoundTo,
+                   {generate_symbol(msymbolIds.at(symbol)),
+                    ConstantExpr::getBitCast(callee, pbuilder->getInt8PtrTy()),
+                    pbuilder->getInt32(callee->arg_size())}));
+  auto callBB = BasicBlock::Create(context, "", pfun);
+  pbuilder->CreateCondBr(bound, callBB, genericBB);
+
+  pbuilder->SetInsertPoint(callBB);
+  std::vector<Value*> args;
+  for (auto& arg : generic->args())
+    args.push_back(
+        pbuilder->CreateLoad(pbuilder->getInt64Ty(),
+                             pbuilder->CreateStructGEP(irnode, &arg, 1)));
+  auto result = pbuilder->CreateCall(specialization.fun, args);
+  auto okBB = BasicBlock::Create(context, "", pfun);
+  auto failedBB = BasicBlock::Create(context, "", pfun);
+  pbuilder->CreateCondBr(pbuilder->CreateExtractValue(result, 1), failedBB,
+                         okBB, MDBuilder(context).createBranchWeights(1, 1000));
+  pbuilder->SetInsertPoint(okBB);
+  pbuilder->CreateRet(box(
+      {pbuilder->CreateExtractValue(result, 0), specialization.result}));
+
+  pbuilder->SetInsertPoint(failedBB);
+  pbuilder->CreateStore(pbuilder->getTrue(), specialization.retrying);
+  pbuilder->CreateBr(genericBB);
+
+  pfun->getBasicBlockList().push_back(genericBB);
+  pbuilder->SetInsertPoint(genericBB);
+  auto retried = pbuilder->CreatePHI(pbuilder->getInt1Ty(), 4);
+  for (auto block : predecessors(genericBB))
+    retried->addIncoming(pbuilder->getInt1(block == failedBB), block);
+  return retried;
+}
+
+Value* Compiler::generate_irnode(NodeRef node) {
   as xformer;
   Value* nodeobj;
-  switch (node->type()) {
+  switch (node.type()) {
     case ASTNodeType::Bool:
-      nodeobj =
-          generate_irnode((uint32_t)node->type(),
-                          (dynamic_cast<BoolNode*>(node)->getBool() ? 1 : 0));
+      nodeobj = box({pbuilder->getInt1(node.boolean()), StaticType::Bool});
       break;
-    case ASTNodeType::Integer:
-      nodeobj = generate_irnode((uint32_t)node->type(),
-                                dynamic_cast<IntegerNode*>(node)->value);
+    case ASTNodeType::Integer: {
+      if (!node.is_bigint()) {
+        nodeobj =
+            box({pbuilder->getInt64(node.integer()), StaticType::Integer});
+        break;
+      }
+      FunctionType* funType =
+          FunctionType::get(PointerType::get(irnode, 0),
+                            {pbuilder->getInt8PtrTy()}, false);
+      nodeobj = pbuilder->CreateCall(
+          runtime_function("_Z10bigIntegerPKc", funType),
+          pbuilder->CreateGlobalStringPtr(std::string(node.string())));
       break;
+    }
     case ASTNodeType::Decimal:
-      xformer.decimal = dynamic_cast<DecimalNode*>(node)->value;
-      nodeobj = generate_irnode((uint32_t)node->type(), xformer.integer);
+      xformer.decimal = node.decimal();
+      nodeobj = generate_irnode((uint32_t)node.type(), xformer.integer);
       break;
     case ASTNodeType::Symbol: {
-      auto symInt = convert_sym(dynamic_cast<SymbolNode*>(node));
-      nodeobj = generate_irnode((uint32_t)node->type(), symInt);
+      auto param = mparams.find(node.symbol());
+      if (param != mparams.end()) return param->second;
+      nodeobj = generate_symbol(convert_sym(node));
       FunctionType* operationType = FunctionType::get(
           PointerType::get(irnode, 0), {PointerType::get(irnode, 0)}, false);
-      Function* operation = Function::Create(
-          operationType, Function::ExternalLinkage, "_Z8retrieveP7_IRNode");
+      Function* operation =
+          runtime_function("_Z8retrieveP7_IRNode", operationType);
       return pbuilder->CreateCall(operation, {nodeobj});
     }
     case ASTNodeType::List: {
-      auto listnode = dynamic_cast<ListNode*>(node);
       std::vector<Value*> values;
-      for (auto it = listnode->list.begin(); it != listnode->list.end(); it++) {
-        values.push_back(generate_irnode(*it));
-      }
+      for (size_t i = 0; i < node.size(); i++)
+        values.push_back(generate_irnode(node[i]));
       FunctionType* operationType =
           FunctionType::get(pbuilder->getInt8PtrTy(), false);
-      Function* operation = Function::Create(
-          operationType, Function::ExternalLinkage, "_Z9allocListv");
+      Function* operation = runtime_function("_Z9allocListv", operationType);
       Value* plist = pbuilder->CreateCall(operation);
       Value* ret = generate_irnode(ASTNodeType::List, plist);
-      for (auto it = values.begin(); it != values.end(); it++) {
+      for (auto it = values.rbegin(); it != values.rend(); it++) {
         FunctionType* operationType = FunctionType::get(
             pbuilder->getVoidTy(),
             {pbuilder->getInt8PtrTy(), PointerType::get(irnode, 0)}, false);
         Function* operation =
-            Function::Create(operationType, Function::ExternalLinkage,
-                             "_Z12listPushBackPcP7_IRNode");
+            runtime_function("_Z13listPushFrontPcP7_IRNode", operationType);
         pbuilder->CreateCall(operation, {plist, *it});
       }
       return ret;
     }
-    case ASTNodeType::Lambda:
-      return generate_lambda(dynamic_cast<LambdaNode*>(node));
     case ASTNodeType::String: {
-      return generate_string(dynamic_cast<StringNode*>(node));
+      return generate_string(node);
     }
 
     default:
@@ -197,89 +650,174 @@ Value* Compiler::generate_irnode(ASTNode* node) {
   return nodeobj;
 }
 
-Value* Compiler::generate_print(ASTNode* node, char end) {
+Value* Compiler::generate_print(NodeRef node, char end) {
   Value* operand = generate_code(node);
   FunctionType* operationType = FunctionType::get(
       pbuilder->getVoidTy(),
       {PointerType::get(irnode, 0), pbuilder->getInt8Ty()}, false);
-  Function* operation = Function::Create(
-      operationType, Function::ExternalLinkage, "_Z9printNodeP7_IRNodec");
+  Function* operation =
+      runtime_function("_Z9printNodeP7_IRNodec", operationType);
   pbuilder->CreateCall(operation, {operand, pbuilder->getInt8(end)});
   return operand;
 }
 
-Value* Compiler::generate_arithmetic(char opchar, ListNode* listnode) {
-  auto it = std::next(listnode->list.begin());  // skip func name
-  auto itend = listnode->list.end();
-  std::vector<Value*> operands;
-  operands.push_back(pbuilder->getInt8(opchar));
-  operands.push_back(pbuilder->getInt32(listnode->list.size() - 1));
-  while (it != itend) {
-    operands.push_back(generate_code(*it));
-    it++;
+// Operands that aren't known to be integers are checked for it at run time,
+// and integers are folded with overflow checks. The runtime handles the rest,
+// and the folds that overflow or divide by zero. The result stays unboxed
+// when the fold succeeds, until it is boxed where it escapes.
+Compiler::Operand Compiler::generate_arithmetic(char opchar,
+                                                NodeRef listnode) {
+  std::vector<Operand> operands;
+  // skip func name
+  for (size_t i = 1; i < listnode.size(); i++)
+    operands.push_back(generate_operand(listnode[i]));
+
+  auto runtime = [&](std::vector<Value*>& nodes) -> Value* {
+    std::vector<Value*> args = {pbuilder->getInt8(opchar),
+                                pbuilder->getInt32(nodes.size())};
+    args.insert(args.end(), nodes.begin(), nodes.end());
+    FunctionType* operationType = FunctionType::get(
+        PointerType::get(irnode, 0),
+        {pbuilder->getInt8Ty(), pbuilder->getInt32Ty()}, true);
+    Function* operation = runtime_function("_Z10arithmeticcjz", operationType);
+    return pbuilder->CreateCall(operation, args);
+  };
+  auto boxed = [&]() {
+    std::vector<Value*> nodes;
+    for (auto& operand : operands) nodes.push_back(box(operand));
+    return nodes;
+  };
+  if (operands.size() < 2) {
+    auto nodes = boxed();
+    return {runtime(nodes), StaticType::Unknown};
   }
+  // The value, integer and node of the result, packed so that the emitters
+  // of generate_guarded return a single value.
+  auto nodeType = PointerType::get(irnode, 0);
+  auto packedType = StructType::get(
+      context, {pbuilder->getInt64Ty(), pbuilder->getInt1Ty(), nodeType});
+  auto pack = [&](Value* value, Value* integer, Value* node) {
+    Value* packed = UndefValue::get(packedType);
+    packed = pbuilder->CreateInsertValue(packed, value, 0);
+    packed = pbuilder->CreateInsertValue(packed, integer, 1);
+    return pbuilder->CreateInsertValue(packed, node, 2);
+  };
+  auto slow = [&](std::vector<Value*>& nodes) -> Value* {
+    return pack(pbuilder->getInt64(0), pbuilder->getFalse(), runtime(nodes));
+  };
+  auto fast = [&](std::vector<Value*>& values) -> Value* {
+    Value* failed;
+    auto result = generate_checked(opchar, values, failed);
+    auto okBB = BasicBlock::Create(context);
+    auto failedBB = BasicBlock::Create(context);
+    auto mergeBB = BasicBlock::Create(context);
+    pbuilder->CreateCondBr(failed, failedBB, okBB,
+                           MDBuilder(context).createBranchWeights(1, 1000));
 
-  FunctionType* operationType =
-      FunctionType::get(PointerType::get(irnode, 0),
-                        {pbuilder->getInt8Ty(), pbuilder->getInt32Ty()}, true);
-  Function* operation = Function::Create(
-      operationType, Function::ExternalLinkage, "_Z10arithmeticcjz");
-  return pbuilder->CreateCall(operation, operands);
+    pfun->getBasicBlockList().push_back(okBB);
+    pbuilder->SetInsertPoint(okBB);
+    auto okret = pack(result, pbuilder->getTrue(),
+                      ConstantPointerNull::get(nodeType));
+    pbuilder->CreateBr(mergeBB);
+
+    pfun->getBasicBlockList().push_back(failedBB);
+    pbuilder->SetInsertPoint(failedBB);
+    auto nodes = boxed();
+    auto failedret = slow(nodes);
+    auto failedendBB = pbuilder->GetInsertBlock();
+    pbuilder->CreateBr(mergeBB);
+
+    pfun->getBasicBlockList().push_back(mergeBB);
+    pbuilder->SetInsertPoint(mergeBB);
+    auto phinode = pbuilder->CreatePHI(packedType, 2);
+    phinode->addIncoming(okret, okBB);
+    phinode->addIncoming(failedret, failedendBB);
+    return phinode;
+  };
+  auto packed = generate_guarded(operands, fast, slow);
+  return {pbuilder->CreateExtractValue(packed, 0), StaticType::Integer,
+          pbuilder->CreateExtractValue(packed, 1),
+          pbuilder->CreateExtractValue(packed, 2)};
+}
+
+Value* Compiler::generate_define(NodeRef symnode, NodeRef valuenode) {
+  auto symoperand = generate_symbol(convert_sym(symnode, true));
+  Value* valueoperand;
+  if (valuenode.type() == ASTNodeType::List && valuenode.size() == 3 &&
+      valuenode.front().type() == ASTNodeType::Symbol &&
+      valuenode.front().symbol() == "lambda")
+    valueoperand =
+        generate_lambda(valuenode[1], valuenode.back(), symnode.symbol());
+  else
+    valueoperand = generate_code(valuenode);
+  return generate_define(symoperand, valueoperand);
 }
 
-Value* Compiler::generate_define(SymbolNode* symnode, ASTNode* valuenode) {
-  auto symoperand =
-      generate_irnode(symnode->type(), convert_sym(symnode, true));
-  auto valueoperand = generate_code(valuenode);
+Value* Compiler::generate_define(Value* symoperand, Value* valueoperand) {
   FunctionType* funType =
       FunctionType::get(PointerType::get(irnode, 0),
                         {PointerType::get(irnode, 0),
                          PointerType::get(irnode, 0), pbuilder->getInt1Ty()},
                         false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z6defineP7_IRNodeS0_b");
+  Function* fun = runtime_function("_Z6defineP7_IRNodeS0_b", funType);
   return pbuilder->CreateCall(
       fun, {symoperand, valueoperand, pbuilder->getIntN(1, 0)});
 }
 
-Value* Compiler::generate_isequal(ASTNode* oprnd1, ASTNode* oprnd2) {
-  auto irnode1 = generate_code(oprnd1);
-  auto irnode2 = generate_code(oprnd2);
-  FunctionType* funType = FunctionType::get(
-      PointerType::get(irnode, 0),
-      {PointerType::get(irnode, 0), PointerType::get(irnode, 0)}, false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z8is_equalP7_IRNodeS0_");
-  return pbuilder->CreateCall(fun, {irnode1, irnode2});
+// (> x y) or (eq? x y), as an i1 if it is the condition of an if and as a
+// node otherwise.
+Value* Compiler::generate_comparison(const std::string& fun, NodeRef oprnd1,
+                                     NodeRef oprnd2, bool condition) {
+  auto fast = [&](std::vector<Value*>& values) -> Value* {
+    Value* result = fun == ">"
+                        ? pbuilder->CreateICmpSGT(values[0], values[1])
+                        : pbuilder->CreateICmpEQ(values[0], values[1]);
+    return condition ? result : box({result, StaticType::Bool});
+  };
+  auto slow = [&](std::vector<Value*>& nodes) {
+    auto result = generate_runtime_call(
+        fun == ">" ? "_Z10is_greaterP7_IRNodeS0_" : "_Z8is_equalP7_IRNodeS0_",
+        nodes);
+    return condition ? generate_truth(result) : result;
+  };
+  return generate_guarded({generate_operand(oprnd1), generate_operand(oprnd2)},
+                          fast, slow);
 }
 
-Value* Compiler::generate_istype(ASTNode* node, uint32_t type) {
+Value* Compiler::generate_istype(NodeRef node, uint32_t type) {
   auto nodearg = generate_code(node);
   Value* typearg = ConstantInt::get(Type::getInt32Ty(context), type);
   FunctionType* funType = FunctionType::get(
       PointerType::get(irnode, 0),
       {PointerType::get(irnode, 0), pbuilder->getInt32Ty()}, false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z7is_typeP7_IRNodej");
+  Function* fun = runtime_function("_Z7is_typeP7_IRNodej", funType);
   return pbuilder->CreateCall(fun, {nodearg, typearg});
 }
 
-Value* Compiler::generate_exit(ASTNode* node) {
+Value* Compiler::generate_exit(NodeRef node) {
   auto nodearg = generate_code(node);
   FunctionType* funType = FunctionType::get(
       pbuilder->getVoidTy(), {PointerType::get(irnode, 0)}, false);
-  Function* fun =
-      Function::Create(funType, Function::ExternalLinkage, "_Z4quitP7_IRNode");
+  Function* fun = runtime_function("_Z4quitP7_IRNode", funType);
   return pbuilder->CreateCall(fun, {nodearg});
 }
 
-Value* Compiler::generate_if(ASTNode* cond, ASTNode* ifbdy, ASTNode* elsebdy) {
-  // Read condition
+Value* Compiler::generate_truth(Value* node) {
   FunctionType* funType = FunctionType::get(
       pbuilder->getInt1Ty(), {PointerType::get(irnode, 0)}, false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z17evaluateConditionP7_IRNode");
-  auto condbool = pbuilder->CreateCall(fun, {generate_code(cond)});
+  Function* fun = runtime_function("_Z17evaluateConditionP7_IRNode", funType);
+  return pbuilder->CreateCall(fun, {node});
+}
+
+// Both bodies are unboxed if type is known.
+Value* Compiler::generate_if(NodeRef cond, NodeRef ifbdy, NodeRef elsebdy,
+                             StaticType type) {
+  auto generate_body = [&](NodeRef body) {
+    return type == StaticType::Unknown ? generate_code(body)
+                                       : generate_unboxed(body, type);
+  };
+  // Read condition
+  auto condbool = generate_condition(cond);
 
   // Generate basic blocks
   auto ifBB = BasicBlock::Create(context);
@@ -290,213 +828,714 @@ Value* Compiler::generate_if(ASTNode* cond, ASTNode* ifbdy, ASTNode* elsebdy) {
   pbuilder->CreateCondBr(condbool, ifBB, elseBB);
   pfun->getBasicBlockList().push_back(ifBB);
   pbuilder->SetInsertPoint(ifBB);
-  auto ifret = generate_code(ifbdy);
+  auto ifret = generate_body(ifbdy);
   auto ifendBB = pbuilder->GetInsertBlock();
   pbuilder->CreateBr(mergeBB);
 
   // else body
   pfun->getBasicBlockList().push_back(elseBB);
   pbuilder->SetInsertPoint(elseBB);
-  auto elseret = generate_code(elsebdy);
+  auto elseret = generate_body(elsebdy);
   auto elseendBB = pbuilder->GetInsertBlock();
   pbuilder->CreateBr(mergeBB);
 
   // Merge
   pfun->getBasicBlockList().push_back(mergeBB);
   pbuilder->SetInsertPoint(mergeBB);
-  auto phinode = pbuilder->CreatePHI(PointerType::get(irnode, 0), 2);
+  auto phinode = pbuilder->CreatePHI(ifret->getType(), 2);
   phinode->addIncoming(ifret, ifendBB);
   phinode->addIncoming(elseret, elseendBB);
   return phinode;
 }
 
-Value* Compiler::generate_greater(ASTNode* node1, ASTNode* node2) {
-  auto oprnd1 = generate_code(node1);
-  auto oprnd2 = generate_code(node2);
-  FunctionType* funType = FunctionType::get(
-      PointerType::get(irnode, 0),
-      {PointerType::get(irnode, 0), PointerType::get(irnode, 0)}, false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z10is_greaterP7_IRNodeS0_");
-  return pbuilder->CreateCall(fun, {oprnd1, oprnd2});
-}
-
-Value* Compiler::generate_car(ASTNode* node) {
+Value* Compiler::generate_car(NodeRef node) {
   auto oprnd1 = generate_code(node);
   FunctionType* funType = FunctionType::get(
       PointerType::get(irnode, 0), {PointerType::get(irnode, 0)}, false);
-  Function* fun =
-      Function::Create(funType, Function::ExternalLinkage, "_Z3carP7_IRNode");
+  Function* fun = runtime_function("_Z3carP7_IRNode", funType);
   return pbuilder->CreateCall(fun, {oprnd1});
 }
 
-Value* Compiler::generate_lambda_call(ListNode* listnode) {
-  if (!listnode->list.size())
+// Lambdas taking as many arguments as given are called through their
+// function pointer, or directly if it is the lambda last defined as the
+// symbol called. executeLambda reports anything else.
+Value* Compiler::generate_lambda_call(NodeRef listnode) {
+  if (!listnode.size())
     throw std::runtime_error("Error. Can't evaluate ()");
+  auto head = listnode.front();
+  size_t argc = listnode.size() - 1;
+  Function* known = nullptr;
+  if (head.type() == ASTNodeType::Symbol && !mparams.count(head.symbol())) {
+    auto it = mlambdas.find(head.symbol());
+    if (it != mlambdas.end() && it->second->arg_size() == argc)
+      known = it->second;
+  }
+  auto callee = generate_code(head);
+  std::vector<Value*> args;
+  for (size_t i = 1; i < listnode.size(); i++)
+    args.push_back(generate_code(listnode[i]));
+
+  auto lambdaBB = BasicBlock::Create(context);
+  auto callBB = BasicBlock::Create(context);
+  auto slowBB = BasicBlock::Create(context);
+  auto mergeBB = BasicBlock::Create(context);
+  std::vector<std::pair<Value*, BasicBlock*>> results;
+  auto field = pbuilder->CreateStructGEP(irnode, callee, 0);
+  auto type = pbuilder->CreateLoad(pbuilder->getInt8Ty(), field);
+  pbuilder->CreateCondBr(
+      pbuilder->CreateICmpEQ(type, pbuilder->getInt8(ASTNodeType::Lambda)),
+      lambdaBB, slowBB);
+
+  pfun->getBasicBlockList().push_back(lambdaBB);
+  pbuilder->SetInsertPoint(lambdaBB);
+  auto value = pbuilder->CreateLoad(
+      pbuilder->getInt64Ty(), pbuilder->CreateStructGEP(irnode, callee, 1));
+  auto pls =
+      pbuilder->CreateIntToPtr(value, PointerType::get(lambdaStruct, 0));
+  field = pbuilder->CreateStructGEP(lambdaStruct, pls, 1);
+  auto fun = pbuilder->CreateLoad(pbuilder->getInt8PtrTy(), field);
+  auto count = pbuilder->CreateLoad(
+      pbuilder->getInt32Ty(), pbuilder->CreateStructGEP(lambdaStruct, pls, 2));
+  pbuilder->CreateCondBr(
+      pbuilder->CreateICmpEQ(count, pbuilder->getInt32(argc)), callBB, slowBB);
+
+  pfun->getBasicBlockList().push_back(callBB);
+  pbuilder->SetInsertPoint(callBB);
+  if (known) {
+    auto directBB = BasicBlock::Create(context);
+    auto indirectBB = BasicBlock::Create(context);
+    pbuilder->CreateCondBr(
+        pbuilder->CreateICmpEQ(
+            fun, ConstantExpr::getBitCast(known, pbuilder->getInt8PtrTy())),
+        directBB, indirectBB);
+    pfun->getBasicBlockList().push_back(directBB);
+    pbuilder->SetInsertPoint(directBB);
+    results.push_back({pbuilder->CreateCall(known, args), directBB});
+    pbuilder->CreateBr(mergeBB);
+    pfun->getBasicBlockList().push_back(indirectBB);
+    pbuilder->SetInsertPoint(indirectBB);
+  }
+  std::vector<Type*> params(argc, PointerType::get(irnode, 0));
+  FunctionType* funType =
+      FunctionType::get(PointerType::get(irnode, 0), params, false);
+  auto pointer = pbuilder->CreateBitCast(fun, PointerType::get(funType, 0));
+  results.push_back({pbuilder->CreateCall(funType, pointer, args),
+                     pbuilder->GetInsertBlock()});
+  pbuilder->CreateBr(mergeBB);
+
+  pfun->getBasicBlockList().push_back(slowBB);
+  pbuilder->SetInsertPoint(slowBB);
   FunctionType* operationType = FunctionType::get(
       PointerType::get(irnode, 0),
       {PointerType::get(irnode, 0), pbuilder->getInt32Ty()}, true);
-  Function* operation = Function::Create(
-      operationType, Function::ExternalLinkage, "_Z13executeLambdaP7_IRNodeiz");
-  std::vector<Value*> operands;
-  operands.push_back(generate_code(listnode->list.front()));
-  operands.push_back(pbuilder->getInt32(listnode->list.size() - 1));
-  for (auto it = std::next(listnode->list.begin()); it != listnode->list.end();
-       it++) {
-    operands.push_back(generate_code(*it));
-  }
-  return pbuilder->CreateCall(operation, operands);
+  Function* operation =
+      runtime_function("_Z13executeLambdaP7_IRNodeiz", operationType);
+  std::vector<Value*> operands = {callee, pbuilder->getInt32(argc)};
+  operands.insert(operands.end(), args.begin(), args.end());
+  results.push_back({pbuilder->CreateCall(operation, operands), slowBB});
+  pbuilder->CreateBr(mergeBB);
+
+  pfun->getBasicBlockList().push_back(mergeBB);
+  pbuilder->SetInsertPoint(mergeBB);
+  auto phinode =
+      pbuilder->CreatePHI(PointerType::get(irnode, 0), results.size());
+  for (auto& [result, block] : results) phinode->addIncoming(result, block);
+  return phinode;
 }
 
-Value* Compiler::generate_cdr(ASTNode* node) {
+Value* Compiler::generate_cdr(NodeRef node) {
   auto oprnd1 = generate_code(node);
   FunctionType* funType = FunctionType::get(
       PointerType::get(irnode, 0), {PointerType::get(irnode, 0)}, false);
-  Function* fun =
-      Function::Create(funType, Function::ExternalLinkage, "_Z3cdrP7_IRNode");
+  Function* fun = runtime_function("_Z3cdrP7_IRNode", funType);
   return pbuilder->CreateCall(fun, {oprnd1});
 }
 
-Value* Compiler::generate_cons(ASTNode* node, ASTNode* listnode) {
+Value* Compiler::generate_cons(NodeRef node, NodeRef listnode) {
   auto oprnd1 = generate_code(node);
   auto oprnd2 = generate_code(listnode);
   FunctionType* funType = FunctionType::get(
       PointerType::get(irnode, 0),
       {PointerType::get(irnode, 0), PointerType::get(irnode, 0)}, false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z4consP7_IRNodeS0_");
+  Function* fun = runtime_function("_Z4consP7_IRNodeS0_", funType);
   return pbuilder->CreateCall(fun, {oprnd1, oprnd2});
 }
 
 Value* Compiler::generate_exception() {
   FunctionType* funType = FunctionType::get(PointerType::get(irnode, 0), false);
-  Function* fun = Function::Create(funType, Function::ExternalLinkage,
-                                   "_Z14throwExceptionv");
+  Function* fun = runtime_function("_Z14throwExceptionv", funType);
   return pbuilder->CreateCall(fun);
 }
 
-Value* Compiler::generate_code(ASTNode* node) {
-  switch (node->type()) {
+// Calls a runtime function that takes the evaluated arguments of listnode.
+Value* Compiler::generate_runtime_call(const std::string& fname,
+                                       NodeRef listnode) {
+  std::vector<Value*> operands;
+  for (size_t i = 1; i < listnode.size(); i++)
+    operands.push_back(generate_code(listnode[i]));
+  return generate_runtime_call(fname, operands);
+}
+
+Value* Compiler::generate_runtime_call(const std::string& fname,
+                                       std::vector<Value*> operands) {
+  std::vector<Type*> types(operands.size(), PointerType::get(irnode, 0));
+  FunctionType* funType =
+      FunctionType::get(PointerType::get(irnode, 0), types, false);
+  Function* fun = runtime_function(fname, funType);
+  return pbuilder->CreateCall(fun, operands);
+}
+
+Value* Compiler::generate_append(NodeRef listnode) {
+  std::vector<Value*> operands;
+  operands.push_back(pbuilder->getInt32(listnode.size() - 1));
+  for (size_t i = 1; i < listnode.size(); i++)
+    operands.push_back(generate_code(listnode[i]));
+  FunctionType* funType = FunctionType::get(PointerType::get(irnode, 0),
+                                            {pbuilder->getInt32Ty()}, true);
+  Function* fun = runtime_function("_Z11appendListsjz", funType);
+  return pbuilder->CreateCall(fun, operands);
+}
+
+// Calls a runtime function taking two arguments where the second is optional,
+// like the comparator of sort. The runtime gets null without it.
+Value* Compiler::generate_optional_call(const std::string& fname,
+                                        NodeRef listnode) {
+  auto first = generate_code(listnode[1]);
+  Value* second = ConstantPointerNull::get(PointerType::get(irnode, 0));
+  if (listnode.size() == 3) second = generate_code(listnode[2]);
+  return generate_runtime_call(fname, {first, second});
+}
+
+// The runtime prints the time spent evaluating node.
+Value* Compiler::generate_time(NodeRef node) {
+  FunctionType* startType =
+      FunctionType::get(pbuilder->getInt64Ty(), {}, false);
+  Function* startFun = runtime_function("_Z10startTimerv", startType);
+  auto start = pbuilder->CreateCall(startFun, {});
+  auto value = generate_code(node);
+  FunctionType* stopType = FunctionType::get(
+      PointerType::get(irnode, 0),
+      {pbuilder->getInt64Ty(), PointerType::get(irnode, 0)}, false);
+  Function* stopFun = runtime_function("_Z9stopTimerlP7_IRNode", stopType);
+  return pbuilder->CreateCall(stopFun, {start, value});
+}
+
+Value* Compiler::generate_reduce(NodeRef node, char op) {
+  auto oprnd1 = generate_code(node);
+  FunctionType* funType = FunctionType::get(
+      PointerType::get(irnode, 0),
+      {PointerType::get(irnode, 0), pbuilder->getInt8Ty()}, false);
+  Function* fun = runtime_function("_Z11arrayReduceP7_IRNodec", funType);
+  return pbuilder->CreateCall(fun, {oprnd1, pbuilder->getInt8(op)});
+}
+
+namespace {
+
+bool is_numeric(StaticType type) {
+  return type == StaticType::Integer || type == StaticType::Decimal;
+}
+
+// Literals have their own type, and so do arithmetic on decimals,
+// comparisons, if and progn when the types of their operands are known.
+// Arithmetic on integers may overflow into a big integer, which the runtime
+// allocates, so it is Unknown, as are symbols, which could be bound to
+// anything.
+StaticType infer(NodeRef node) {
+  switch (node.type()) {
+    case ASTNodeType::Bool:
+      return StaticType::Bool;
+    case ASTNodeType::Integer:
+      return node.is_bigint() ? StaticType::Unknown : StaticType::Integer;
+    case ASTNodeType::Decimal:
+      return StaticType::Decimal;
+    case ASTNodeType::List:
+      break;
+    default:
+      return StaticType::Unknown;
+  }
+  if (!node.size() || node.front().type() != ASTNodeType::Symbol)
+    return StaticType::Unknown;
+  auto& fun = node.front().symbol();
+  if ((fun == "+" || fun == "-" || fun == "*" || fun == "/") &&
+      node.size() >= 3) {
+    auto type = StaticType::Unknown;
+    for (size_t i = 1; i < node.size(); i++) {
+      auto operand = infer(node[i]);
+      if (!is_numeric(operand)) return StaticType::Unknown;
+      if (operand == StaticType::Decimal) type = operand;
+    }
+    return type;
+  }
+  if (fun == ">" && node.size() == 3)
+    return is_numeric(infer(node[1])) && is_numeric(infer(node[2]))
+               ? StaticType::Bool
+               : StaticType::Unknown;
+  if (fun == "eq?" && node.size() == 3)
+    return infer(node[1]) != StaticType::Unknown &&
+                   infer(node[2]) != StaticType::Unknown
+               ? StaticType::Bool
+               : StaticType::Unknown;
+  if (fun == "if" && node.size() == 4) {
+    auto type = infer(node[2]);
+    return type == infer(node[3]) ? type : StaticType::Unknown;
+  }
+  if (fun == "progn" && node.size() >= 2) return infer(node.back());
+  return StaticType::Unknown;
+}
+
+}  // namespace
+
+Compiler::Operand Compiler::generate_operand(NodeRef node) {
+  auto type = infer(node);
+  if (type == StaticType::Unknown && node.type() == ASTNodeType::List &&
+      node.size() && node.front().type() == ASTNodeType::Symbol) {
+    auto& fun = node.front().symbol();
+    if (fun == "+" || fun == "-" || fun == "*" || fun == "/")
+      return generate_arithmetic(fun[0], node);
+  }
+  if (type == StaticType::Unknown) return {generate_code(node), type};
+  return {generate_unboxed(node, type), type};
+}
+
+// The node the runtime expects for operand.
+Value* Compiler::box(const Operand& operand) {
+  auto value = operand.value;
+  if (operand.integer) {
+    auto startBB = pbuilder->GetInsertBlock();
+    auto integerBB = BasicBlock::Create(context);
+    auto mergeBB = BasicBlock::Create(context);
+    pbuilder->CreateCondBr(operand.integer, integerBB, mergeBB);
+    pfun->getBasicBlockList().push_back(integerBB);
+    pbuilder->SetInsertPoint(integerBB);
+    auto boxed = box({value, StaticType::Integer});
+    pbuilder->CreateBr(mergeBB);
+    pfun->getBasicBlockList().push_back(mergeBB);
+    pbuilder->SetInsertPoint(mergeBB);
+    auto phinode = pbuilder->CreatePHI(PointerType::get(irnode, 0), 2);
+    phinode->addIncoming(boxed, integerBB);
+    phinode->addIncoming(operand.node, startBB);
+    return phinode;
+  }
+  switch (operand.type) {
+    case StaticType::Unknown:
+      return value;
+    case StaticType::Bool: {
+      FunctionType* funType = FunctionType::get(
+          PointerType::get(irnode, 0), {pbuilder->getInt1Ty()}, false);
+      auto call =
+          pbuilder->CreateCall(runtime_function("_Z7boxBoolb", funType), value);
+      call->addParamAttr(0, Attribute::ZExt);
+      return call;
+    }
+    case StaticType::Integer: {
+      FunctionType* funType = FunctionType::get(
+          PointerType::get(irnode, 0), {pbuilder->getInt64Ty()}, false);
+      return pbuilder->CreateCall(runtime_function("_Z10boxIntegerl", funType),
+                                  value);
+    }
+    case StaticType::Decimal:
+      return generate_irnode(
+          ASTNodeType::Decimal,
+          pbuilder->CreateBitCast(value, pbuilder->getInt64Ty()));
+  }
+  return value;
+}
+
+// Folds op over values in double, converting the integers among them.
+Value* Compiler::generate_native(char op, std::vector<Value*> values) {
+  for (auto& value : values)
+    if (value->getType()->isIntegerTy())
+      value = pbuilder->CreateSIToFP(value, pbuilder->getDoubleTy());
+  auto result = values[0];
+  for (size_t i = 1; i < values.size(); i++) {
+    switch (op) {
+      case '+':
+        result = pbuilder->CreateFAdd(result, values[i]);
+        break;
+      case '-':
+        result = pbuilder->CreateFSub(result, values[i]);
+        break;
+      case '*':
+        result = pbuilder->CreateFMul(result, values[i]);
+        break;
+      case '/':
+        result = pbuilder->CreateFDiv(result, values[i]);
+        break;
+    }
+  }
+  return result;
+}
+
+// Folds op over the i64 values, truncating division towards zero. failed is
+// set to an i1 that is true if a step overflowed or divided by zero, and then
+// the result is meaningless.
+Value* Compiler::generate_checked(char op, const std::vector<Value*>& values,
+                                  Value*& failed) {
+  failed = pbuilder->getFalse();
+  auto result = values[0];
+  for (size_t i = 1; i < values.size(); i++) {
+    auto y = values[i];
+    if (op == '/') {
+      auto bad = pbuilder->CreateOr(
+          pbuilder->CreateICmpEQ(y, pbuilder->getInt64(0)),
+          pbuilder->CreateAnd(
+              pbuilder->CreateICmpEQ(result, pbuilder->getInt64(INT64_MIN)),
+              pbuilder->CreateICmpEQ(y, pbuilder->getInt64(-1))));
+      failed = pbuilder->CreateOr(failed, bad);
+      result = pbuilder->CreateSDiv(
+          result, pbuilder->CreateSelect(bad, pbuilder->getInt64(1), y));
+      continue;
+    }
+    auto id = op == '+'   ? Intrinsic::sadd_with_overflow
+              : op == '-' ? Intrinsic::ssub_with_overflow
+                          : Intrinsic::smul_with_overflow;
+    auto pair = pbuilder->CreateBinaryIntrinsic(id, result, y);
+    result = pbuilder->CreateExtractValue(pair, 0);
+    failed = pbuilder->CreateOr(failed, pbuilder->CreateExtractValue(pair, 1));
+  }
+  return result;
+}
+
+// Computes node, whose static type is type, as an i1, i64 or double.
+Value* Compiler::generate_unboxed(NodeRef node, StaticType type) {
+  switch (node.type()) {
+    case ASTNodeType::Bool:
+      return pbuilder->getInt1(node.boolean());
+    case ASTNodeType::Integer:
+      return pbuilder->getInt64(node.integer());
+    case ASTNodeType::Decimal:
+      return ConstantFP::get(pbuilder->getDoubleTy(), node.decimal());
+    default:
+      break;
+  }
+  auto& fun = node.front().symbol();
+  if (fun == "if") return generate_if(node[1], node[2], node[3], type);
+  if (fun == "progn") {
+    for (size_t i = 1; i + 1 < node.size(); i++) generate_code(node[i]);
+    return generate_unboxed(node.back(), type);
+  }
+  std::vector<Operand> operands;
+  for (size_t i = 1; i < node.size(); i++)
+    operands.push_back(generate_operand(node[i]));
+  auto as_double = [&](const Operand& operand) {
+    if (operand.type == StaticType::Decimal) return operand.value;
+    return pbuilder->CreateSIToFP(operand.value, pbuilder->getDoubleTy());
+  };
+  auto& x = operands.front();
+  auto& y = operands.back();
+  if (fun == ">") {
+    if (x.type == StaticType::Integer && y.type == StaticType::Integer)
+      return pbuilder->CreateICmpSGT(x.value, y.value);
+    return pbuilder->CreateFCmpOGT(as_double(x), as_double(y));
+  }
+  if (fun == "eq?") {
+    if (x.type != y.type &&
+        (x.type == StaticType::Bool || y.type == StaticType::Bool))
+      return pbuilder->getFalse();
+    // Integers compare against decimals as doubles, and the runtime compares
+    // the bits of decimals.
+    if (x.type != y.type)
+      return pbuilder->CreateFCmpOEQ(as_double(x), as_double(y));
+    if (x.type == StaticType::Decimal)
+      return pbuilder->CreateICmpEQ(
+          pbuilder->CreateBitCast(x.value, pbuilder->getInt64Ty()),
+          pbuilder->CreateBitCast(y.value, pbuilder->getInt64Ty()));
+    return pbuilder->CreateICmpEQ(x.value, y.value);
+  }
+  std::vector<Value*> values;
+  for (auto& operand : operands) values.push_back(operand.value);
+  return generate_native(fun[0], values);
+}
+
+// Calls fast with the unboxed operands if they are all integers, checking
+// the type of the ones that aren't known to be at run time, and slow with
+// them boxed otherwise. Both return values of the same type.
+Value* Compiler::generate_guarded(std::vector<Operand> operands,
+                                  const Emitter& fast, const Emitter& slow) {
+  std::vector<Value*> values;
+  Value* check = nullptr;
+  for (auto& operand : operands) {
+    if (operand.integer)
+      check = check ? pbuilder->CreateAnd(check, operand.integer)
+                    : operand.integer;
+    if (operand.type == StaticType::Integer) continue;
+    if (operand.type != StaticType::Unknown) {
+      for (auto& operand : operands) values.push_back(box(operand));
+      return slow(values);
+    }
+    auto field = pbuilder->CreateStructGEP(irnode, operand.value, 0);
+    auto type = pbuilder->CreateLoad(pbuilder->getInt8Ty(), field);
+    auto integer =
+        pbuilder->CreateICmpEQ(type, pbuilder->getInt8(ASTNodeType::Integer));
+    check = check ? pbuilder->CreateAnd(check, integer) : integer;
+  }
+  if (!check) {
+    for (auto& operand : operands) values.push_back(operand.value);
+    return fast(values);
+  }
+
+  auto fastBB = BasicBlock::Create(context);
+  auto slowBB = BasicBlock::Create(context);
+  auto mergeBB = BasicBlock::Create(context);
+  pbuilder->CreateCondBr(check, fastBB, slowBB);
+
+  pfun->getBasicBlockList().push_back(fastBB);
+  pbuilder->SetInsertPoint(fastBB);
+  for (auto& operand : operands)
+    values.push_back(operand.type == StaticType::Integer
+                         ? operand.value
+                         : pbuilder->CreateLoad(
+                               pbuilder->getInt64Ty(),
+                               pbuilder->CreateStructGEP(irnode, operand.value,
+                                                         1)));
+  auto fastret = fast(values);
+  auto fastendBB = pbuilder->GetInsertBlock();
+  pbuilder->CreateBr(mergeBB);
+
+  pfun->getBasicBlockList().push_back(slowBB);
+  pbuilder->SetInsertPoint(slowBB);
+  values.clear();
+  for (auto& operand : operands) values.push_back(box(operand));
+  auto slowret = slow(values);
+  auto slowendBB = pbuilder->GetInsertBlock();
+  pbuilder->CreateBr(mergeBB);
+
+  pfun->getBasicBlockList().push_back(mergeBB);
+  pbuilder->SetInsertPoint(mergeBB);
+  auto phinode = pbuilder->CreatePHI(fastret->getType(), 2);
+  phinode->addIncoming(fastret, fastendBB);
+  phinode->addIncoming(slowret, slowendBB);
+  return phinode;
+}
+
+// An i1 that is true if node evaluates to a true value.
+Value* Compiler::generate_condition(NodeRef node) {
+  auto type = infer(node);
+  if (type == StaticType::Bool) return generate_unboxed(node, type);
+  if (node.type() == ASTNodeType::List && node.size() == 3 &&
+      node.front().type() == ASTNodeType::Symbol) {
+    auto& fun = node.front().symbol();
+    if (fun == ">" || fun == "eq?")
+      return generate_comparison(fun, node[1], node[2], true);
+  }
+  return generate_truth(generate_code(node));
+}
+
+Value* Compiler::generate_code(NodeRef node) {
+  switch (node.type()) {
     case ASTNodeType::List: {
-      auto listnode = dynamic_cast<ListNode*>(node);
+      auto type = infer(node);
+      if (type != StaticType::Unknown)
+        return box({generate_unboxed(node, type), type});
+      auto listnode = node;
       // TODO Currently we assume +. Handle all cases
-      if (listnode->list.front()->type() == ASTNodeType::Symbol) {
-        auto fun = dynamic_cast<SymbolNode*>(listnode->list.front())->symbol;
+      if (listnode.size() && listnode.front().type() == ASTNodeType::Symbol) {
+        auto& fun = listnode.front().symbol();
         if (fun == "+" || fun == "-" || fun == "*" || fun == "/")
-          return generate_arithmetic(fun[0], listnode);
+          return box(generate_arithmetic(fun[0], listnode));
         if (fun == "println" || fun == "print") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("print expects one argument");
           char end = (fun == "print" ? 0 : '\n');
-          return generate_print(listnode->list.back(), end);
+          return generate_print(listnode.back(), end);
         }
         if (fun == "def") {
-          auto symnode = *std::next(listnode->list.begin());
-          if (symnode->type() != ASTNodeType::Symbol)
+          auto symnode = listnode[1];
+          if (symnode.type() != ASTNodeType::Symbol)
             throw std::runtime_error(
                 "def needs the first argument to be symbol");
-          if (listnode->list.size() != 3)
+          if (listnode.size() != 3)
             throw std::runtime_error("def takes 2 arguments");
-          return generate_define(dynamic_cast<SymbolNode*>(symnode),
-                                 listnode->list.back());
+          return generate_define(symnode, listnode.back());
         }
         if (fun == "eq?") {
-          if (listnode->list.size() != 3)
+          if (listnode.size() != 3)
             throw std::runtime_error("eq? takes 2 arguments");
-          return generate_isequal(*(std::next(listnode->list.begin())),
-                                  listnode->list.back());
+          return generate_comparison(fun, listnode[1], listnode.back(),
+                                     false);
         }
         if (fun == "list?") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("list? takes 1 arguments");
-          return generate_istype(listnode->list.back(), ASTNodeType::List);
+          return generate_istype(listnode.back(), ASTNodeType::List);
         }
         if (fun == "int?") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("int? takes 1 arguments");
-          return generate_istype(listnode->list.back(), ASTNodeType::Integer);
+          return generate_istype(listnode.back(), ASTNodeType::Integer);
         }
         if (fun == "dec?") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("dec? takes 1 arguments");
-          return generate_istype(listnode->list.back(), ASTNodeType::Decimal);
+          return generate_istype(listnode.back(), ASTNodeType::Decimal);
         }
         if (fun == "bool?") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("int? takes 1 arguments");
-          return generate_istype(listnode->list.back(), ASTNodeType::Bool);
+          return generate_istype(listnode.back(), ASTNodeType::Bool);
         }
         if (fun == "string?") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("int? takes 1 arguments");
-          return generate_istype(listnode->list.back(), ASTNodeType::String);
+          return generate_istype(listnode.back(), ASTNodeType::String);
         }
         if (fun == ">") {
-          if (listnode->list.size() != 3)
+          if (listnode.size() != 3)
             throw std::runtime_error("> takes 2 arguments");
-          return generate_greater(*std::next(listnode->list.begin()),
-                                  listnode->list.back());
+          return generate_comparison(fun, listnode[1], listnode.back(),
+                                     false);
         }
         if (fun == "progn") {
-          if (listnode->list.size() < 2)
+          if (listnode.size() < 2)
             throw std::runtime_error("progn takes atleast 1 argument");
-          auto it = std::next(listnode->list.begin());
-          auto itend = listnode->list.end();
           Value* ret;
-          while (it != itend) ret = generate_code(*(it++));
+          for (size_t i = 1; i < listnode.size(); i++)
+            ret = generate_code(listnode[i]);
           return ret;
         }
         if (fun == "exit") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("Exit expects 1 argument");
-          return generate_exit(listnode->list.back());
+          return generate_exit(listnode.back());
         }
         if (fun == "if") {
-          if (listnode->list.size() != 4)
+          if (listnode.size() != 4)
             throw std::runtime_error("if expects 3 arguments");
-          auto condition = *std::next(listnode->list.begin());
-          auto ifbody = *std::next(std::next(listnode->list.begin()));
-          auto elsebody = listnode->list.back();
+          auto condition = listnode[1];
+          auto ifbody = listnode[2];
+          auto elsebody = listnode.back();
           return generate_if(condition, ifbody, elsebody);
         }
         if (fun == "quote") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("quote expects 2 arguments");
-          return generate_irnode(listnode->list.back());
+          return generate_irnode(listnode.back());
         }
         if (fun == "car") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("car expects 1 argument");
-          return generate_car(listnode->list.back());
+          return generate_car(listnode.back());
         }
         if (fun == "cdr") {
-          if (listnode->list.size() != 2)
+          if (listnode.size() != 2)
             throw std::runtime_error("cdr expects 1 argument");
-          return generate_cdr(listnode->list.back());
+          return generate_cdr(listnode.back());
         }
         if (fun == "cons") {
-          if (listnode->list.size() != 3)
+          if (listnode.size() != 3)
             throw std::runtime_error("cons expects 2 arguments");
-          auto oprnd1 = *std::next(listnode->list.begin());
-          auto oprnd2 = listnode->list.back();
+          auto oprnd1 = listnode[1];
+          auto oprnd2 = listnode.back();
           return generate_cons(oprnd1, oprnd2);
         }
         if (fun == "lambda") {
-          if (listnode->list.size() != 3)
+          if (listnode.size() != 3)
             throw std::runtime_error("lambda expects an arg list and a body");
-          auto arglist = *std::next(listnode->list.begin());
-          auto body = listnode->list.back();
-
-          if (arglist->type() != ASTNodeType::List)
-            throw std::runtime_error("arglist should be a list");
-          auto l = dynamic_cast<ListNode*>(arglist)->list.begin();
-          while (l != dynamic_cast<ListNode*>(arglist)->list.end()) {
-            if ((*l)->type() != ASTNodeType::Symbol)
-              throw std::runtime_error("lambda argument list has non-symbol");
-            l++;
-          }
-          LambdaNode tmp(arglist, body);
-          return generate_irnode(&tmp);
+          return generate_lambda(listnode[1], listnode.back());
+        }
+        if (fun == "array?") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("array? takes 1 arguments");
+          return generate_istype(listnode.back(), ASTNodeType::Array);
+        }
+        if (fun == "array") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("array expects 1 argument");
+          return generate_runtime_call("_Z9makeArrayP7_IRNode", listnode);
+        }
+        if (fun == "prefix-sum") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("prefix-sum expects 1 argument");
+          return generate_runtime_call("_Z9prefixSumP7_IRNode", listnode);
+        }
+        if (fun == "arange") {
+          if (listnode.size() != 3)
+            throw std::runtime_error("arange expects 2 arguments");
+          return generate_runtime_call("_Z6arangeP7_IRNodeS0_", listnode);
+        }
+        if (fun == "aref") {
+          if (listnode.size() != 3)
+            throw std::runtime_error("aref expects 2 arguments");
+          return generate_runtime_call("_Z4arefP7_IRNodeS0_", listnode);
+        }
+        if (fun == "dot") {
+          if (listnode.size() != 3)
+            throw std::runtime_error("dot expects 2 arguments");
+          return generate_runtime_call("_Z3dotP7_IRNodeS0_", listnode);
+        }
+        if (fun == "sum" || fun == "min" || fun == "max") {
+          if (listnode.size() != 2)
+            throw std::runtime_error(fun + " expects 1 argument");
+          return generate_reduce(listnode.back(),
+                                 fun == "sum"   ? 's'
+                                 : fun == "min" ? '<'
+                                                : '>');
+        }
+        if (fun == "map" || fun == "filter" || fun == "range") {
+          if (listnode.size() != 3)
+            throw std::runtime_error(fun + " expects 2 arguments");
+          return generate_runtime_call(fun == "map" ? "_Z7mapListP7_IRNodeS0_"
+                                       : fun == "filter"
+                                           ? "_Z10filterListP7_IRNodeS0_"
+                                           : "_Z9rangeListP7_IRNodeS0_",
+                                       listnode);
+        }
+        if (fun == "reduce") {
+          if (listnode.size() != 4)
+            throw std::runtime_error("reduce expects 3 arguments");
+          return generate_runtime_call("_Z10reduceListP7_IRNodeS0_S0_",
+                                       listnode);
+        }
+        // The runtime and its collector are single threaded, so these run
+        // in order like map, filter and reduce do.
+        if (fun == "pmap" || fun == "pfilter") {
+          if (listnode.size() != 3)
+            throw std::runtime_error(fun + " expects 2 arguments");
+          return generate_runtime_call(fun == "pmap"
+                                           ? "_Z7mapListP7_IRNodeS0_"
+                                           : "_Z10filterListP7_IRNodeS0_",
+                                       listnode);
+        }
+        if (fun == "preduce") {
+          if (listnode.size() != 4)
+            throw std::runtime_error("preduce expects 3 arguments");
+          return generate_runtime_call("_Z10reduceListP7_IRNodeS0_S0_",
+                                       listnode);
+        }
+        if (fun == "length") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("length expects 1 argument");
+          return generate_runtime_call("_Z10listLengthP7_IRNode", listnode);
+        }
+        if (fun == "reverse") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("reverse expects 1 argument");
+          return generate_runtime_call("_Z11reverseListP7_IRNode", listnode);
+        }
+        if (fun == "append") {
+          if (listnode.size() < 2)
+            throw std::runtime_error("append expects atleast 1 argument");
+          return generate_append(listnode);
+        }
+        if (fun == "sort") {
+          if (listnode.size() != 2 && listnode.size() != 3)
+            throw std::runtime_error("sort expects 1 or 2 arguments");
+          return generate_optional_call("_Z8sortListP7_IRNodeS0_", listnode);
+        }
+        if (fun == "time") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("time expects 1 argument");
+          return generate_time(listnode.back());
+        }
+        if (fun == "memo") {
+          if (listnode.size() != 2 && listnode.size() != 3)
+            throw std::runtime_error("memo expects 1 or 2 arguments");
+          return generate_optional_call("_Z7memoizeP7_IRNodeS0_", listnode);
+        }
+        if (fun == "memo-stats") {
+          if (listnode.size() != 2)
+            throw std::runtime_error("memo-stats expects 1 argument");
+          return generate_runtime_call("_Z9memoStatsP7_IRNode", listnode);
         }
         if (fun == "exception!") {
           return generate_exception();
@@ -519,24 +1558,183 @@ Value* Compiler::generate_code(ASTNode* node) {
 std::string Compiler::handle_line(std::string line) {
   std::string success = "";
   if (is_comment(line)) return success;
-  auto tokens = tokenizer(line);
-  auto ast = create_ast(tokens);
+  form.clear();
+  read_forms(line, form);
 
-  if (ast.size() == 0) return success;
-  if (ast.size() != 1)
+  if (form.size() == 0) return success;
+  if (form.size() != 1)
     throw TodaluException("Contains more than one node at the base");
 
-  mret = generate_code(ast.front());
+  mret = generate_code(form.root(0));
+  generate_safepoint();
 
   return success;
 }
 
+void Compiler::generate_safepoint() {
+  FunctionType* funType = FunctionType::get(pbuilder->getVoidTy(), false);
+  pbuilder->CreateCall(runtime_function("_Z11gcSafepointv", funType));
+}
+
+// Gives fun a frame on the shadow stack, with a slot for every node it takes
+// or computes so that the collector finds them. The safepoints in main end
+// top level forms, and clear the slots of the form before them.
+void Compiler::add_shadow_frame(Function* fun) {
+  auto nodeType = PointerType::get(irnode, 0);
+  auto safepoint = pmodule->getFunction("_Z11gcSafepointv");
+  std::vector<Value*> nodes;
+  std::vector<std::pair<Instruction*, size_t>> forms;
+  for (auto& arg : fun->args()) nodes.push_back(&arg);
+  for (auto& block : *fun)
+    for (auto& inst : block) {
+      if (inst.getType() == nodeType &&
+          (isa<CallInst>(inst) || isa<PHINode>(inst)))
+        nodes.push_back(&inst);
+      auto call = dyn_cast<CallInst>(&inst);
+      if (fun == mainFun && call && call->getCalledFunction() == safepoint)
+        forms.push_back({call, nodes.size()});
+    }
+  if (nodes.empty()) return;
+
+  auto slotsType = ArrayType::get(nodeType, nodes.size());
+  auto frameType = StructType::get(
+      context, {pbuilder->getInt8PtrTy(), pbuilder->getInt64Ty(), slotsType});
+  auto stack =
+      pmodule->getOrInsertGlobal("gShadowStack", pbuilder->getInt8PtrTy());
+  auto& entry = fun->getEntryBlock();
+  IRBuilder<> builder(&entry, entry.begin());
+  auto frame = builder.CreateAlloca(frameType);
+  builder.CreateMemSet(builder.CreateStructGEP(frameType, frame, 2),
+                       builder.getInt8(0),
+                       nodes.size() * sizeof(void*), MaybeAlign());
+  builder.CreateStore(builder.getInt64(nodes.size()),
+                      builder.CreateStructGEP(frameType, frame, 1));
+  builder.CreateStore(builder.CreateLoad(builder.getInt8PtrTy(), stack),
+                      builder.CreateStructGEP(frameType, frame, 0));
+  builder.CreateStore(builder.CreateBitCast(frame, builder.getInt8PtrTy()),
+                      stack);
+
+  auto store = [&](IRBuilder<>& builder, Value* value, size_t i) {
+    builder.CreateStore(
+        value, builder.CreateInBoundsGEP(frameType, frame,
+                                         {builder.getInt32(0),
+                                          builder.getInt32(2),
+                                          builder.getInt64(i)}));
+  };
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto inst = dyn_cast<Instruction>(nodes[i]);
+    if (!inst) {
+      store(builder, nodes[i], i);
+      continue;
+    }
+    IRBuilder<> after(inst->getParent(),
+                      isa<PHINode>(inst)
+                          ? inst->getParent()->getFirstInsertionPt()
+                          : std::next(inst->getIterator()));
+    store(after, inst, i);
+  }
+  size_t first = 0;
+  for (auto& [call, end] : forms) {
+    IRBuilder<> before(call);
+    for (; first < end; first++)
+      store(before, ConstantPointerNull::get(nodeType), first);
+  }
+  for (auto& block : *fun)
+    if (auto ret = dyn_cast<ReturnInst>(block.getTerminator())) {
+      IRBuilder<> before(ret);
+      auto next = before.CreateLoad(
+          before.getInt8PtrTy(), before.CreateStructGEP(frameType, frame, 0));
+      before.CreateStore(next, stack);
+    }
+}
+
+// Runs the default pipeline of the new pass manager for mlevel. machine, if
+// not null, describes the target for the cost models.
+void Compiler::optimize(TargetMachine* machine) {
+  if (!mlevel) return;
+  LoopAnalysisManager loops;
+  FunctionAnalysisManager functions;
+  CGSCCAnalysisManager sccs;
+  ModuleAnalysisManager modules;
+  PassBuilder builder(machine);
+  builder.registerModuleAnalyses(modules);
+  builder.registerCGSCCAnalyses(sccs);
+  builder.registerFunctionAnalyses(functions);
+  builder.registerLoopAnalyses(loops);
+  builder.crossRegisterProxies(loops, functions, sccs, modules);
+  const OptimizationLevel levels[] = {
+      OptimizationLevel::O0, OptimizationLevel::O1, OptimizationLevel::O2,
+      OptimizationLevel::O3};
+  builder.buildPerModuleDefaultPipeline(levels[std::min(mlevel, 3u)])
+      .run(*pmodule, modules);
+}
+
+// The runtime functions are resolved to the ones in this executable, which
+// exports them.
+void Compiler::run_jit() {
+  auto check = [](Error error) {
+    if (error) {
+      errs() << "Error running the program : " << toString(std::move(error))
+             << "\n";
+      exit(1);
+    }
+  };
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  auto machineBuilder = orc::JITTargetMachineBuilder::detectHost();
+  if (!machineBuilder) check(machineBuilder.takeError());
+  auto machine = machineBuilder->createTargetMachine();
+  if (!machine) check(machine.takeError());
+  auto jit = orc::LLJITBuilder()
+                 .setJITTargetMachineBuilder(std::move(*machineBuilder))
+                 .create();
+  if (!jit) check(jit.takeError());
+  auto process = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*jit)->getDataLayout().getGlobalPrefix());
+  if (!process) check(process.takeError());
+  (*jit)->getMainJITDylib().addGenerator(std::move(*process));
+
+  pmodule->setDataLayout((*jit)->getDataLayout());
+  pmodule->setTargetTriple((*machine)->getTargetTriple().str());
+  if (verifyModule(*pmodule, &errs())) {
+    errs() << "Error verifying module";
+    exit(1);
+  }
+  optimize(machine->get());
+  check((*jit)->addIRModule(
+      orc::ThreadSafeModule(std::unique_ptr<Module>(pmodule),
+                            orc::ThreadSafeContext(std::move(pcontext)))));
+  // The program runs in a runtime of its own, so gShadowStack is bound to its
+  // frames instead of the ones of the process.
+  Runtime runtime;
+  check((*jit)->getMainJITDylib().define(orc::absoluteSymbols(
+      {{(*jit)->mangleAndIntern("gShadowStack"),
+        JITEvaluatedSymbol::fromPointer(runtime.shadowStack())}})));
+  auto main = (*jit)->lookup("main");
+  if (!main) check(main.takeError());
+  Runtime::Scope scope(runtime);
+  reinterpret_cast<int (*)()>(main->getAddress())();
+}
+
 Compiler::~Compiler() {
   pbuilder->CreateRet(pbuilder->getInt32(0));
+  add_shadow_frame(mainFun);
+  if (mjit) {
+    run_jit();
+    return;
+  }
   if (Linker::linkModules(*pmodule, std::move(originalModule))) {
     errs() << "Error linking modules";
     exit(1);
   }
+  // trt.ll built without optimization keeps the runtime out of reach of the
+  // inliner.
+  if (mlevel)
+    for (auto& fun : *pmodule) {
+      fun.removeFnAttr(Attribute::OptimizeNone);
+      fun.removeFnAttr(Attribute::NoInline);
+    }
   // verifyModule(*pmodule, &outs());
+  optimize(nullptr);
   pmodule->print(outs(), nullptr);
 }
@@ -1,347 +1,985 @@
 #include "eval.h"
 
+#include <algorithm>
 #include <iostream>
-#include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "ast.h"
 #include "common.h"
+#include "pool.h"
+#include "profile.h"
 
-std::map<std::string, std::list<ASTNode*>> gEnv;
-
-void operate_on_node(ASTNode* node, char op, float& acc, bool& is_all_int) {
-  auto operation = [](float a, float b, char op) {
-    switch (op) {
-      case '+':
-        return a + b;
-      case '-':
-        return a - b;
-      case '*':
-        return a * b;
-      case '/':
-        return a / b;
-      default:
-        throw std::runtime_error("Invalid operation");
+Environment::~Environment() {
+  for (auto& stack : bindings)
+    for (auto node : stack) delete node;
+}
+
+ASTNode* Environment::lookup(uint32_t id) const {
+  for (auto env = this; env; env = env->parent)
+    if (id < env->bindings.size() && !env->bindings[id].empty())
+      return env->bindings[id].front();
+  return nullptr;
+}
+
+std::list<ASTNode*>& Environment::bindings_of(uint32_t id) {
+  if (id >= bindings.size()) bindings.resize(id + 1);
+  return bindings[id];
+}
+
+namespace {
+
+// Lambda calls in tail position reuse the eval_tree invocation of their
+// caller. The frame owns the lambda being run and the arguments bound so far,
+// which are unbound when the invocation returns.
+struct TailFrame {
+  explicit TailFrame(Environment& e) : env(e) {}
+  ~TailFrame() {
+    if (profiled) profile::leave();
+    for (auto id : bound) {
+      auto& bindings = env.bindings_of(id);
+      delete bindings.front();
+      bindings.pop_front();
     }
-  };
-  std::unique_ptr<ASTNode> operand(eval_tree(node));
-  switch (operand->type()) {
-    case ASTNodeType::Integer:
-      acc =
-          operation(acc, dynamic_cast<IntegerNode*>(operand.get())->value, op);
+  }
+  // A parameter that is already bound by this frame is shadowed by the new
+  // binding, so that is replaced instead of growing the binding stack.
+  // Parameters the callee doesn't rebind stay visible until the frame ends.
+  void bind(const std::vector<uint32_t>& ids, std::vector<ASTNode*>& values) {
+    auto rebound = bound;
+    for (size_t i = 0; i < ids.size(); i++) {
+      auto& bindings = env.bindings_of(ids[i]);
+      auto it = std::find(rebound.begin(), rebound.end(), ids[i]);
+      if (it == rebound.end()) {
+        bindings.push_front(values[i]);
+        bound.push_back(ids[i]);
+      } else {
+        delete bindings.front();
+        bindings.front() = values[i];
+        rebound.erase(it);
+      }
+    }
+  }
+  Environment& env;
+  std::unique_ptr<ASTNode> lambda;
+  std::vector<uint32_t> bound;
+  // Whether the profiler counts the lambda as a call in progress.
+  bool profiled = false;
+};
+
+std::vector<uint32_t> parameters_of(LambdaNode* lambda) {
+  if (lambda->arglist->type() == ASTNodeType::Symbol)
+    return {dynamic_cast<SymbolNode*>(lambda->arglist)->id};
+  std::vector<uint32_t> ids;
+  for (auto name : dynamic_cast<ListNode*>(lambda->arglist)->list)
+    ids.push_back(dynamic_cast<SymbolNode*>(name)->id);
+  return ids;
+}
+
+// The lambdas of the tree walker are nothing but their source, so that is
+// what keys them.
+void add_to_key(const ASTNode* node, MemoKey& key) {
+  switch (node->type()) {
+    case ASTNodeType::Bool:
+      key.tag('b');
+      key.integer(node->getBool());
       break;
+    case ASTNodeType::Integer: {
+      auto integer = static_cast<const IntegerNode*>(node);
+      if (integer->big) {
+        key.tag('I');
+        key.text(integer->big->to_string());
+      } else {
+        key.tag('i');
+        key.integer(integer->value);
+      }
+      break;
+    }
     case ASTNodeType::Decimal:
-      acc =
-          operation(acc, dynamic_cast<DecimalNode*>(operand.get())->value, op);
-      is_all_int = false;
+      key.tag('d');
+      key.decimal(static_cast<const DecimalNode*>(node)->value);
+      break;
+    case ASTNodeType::Symbol:
+      key.tag('y');
+      key.integer(static_cast<const SymbolNode*>(node)->id);
       break;
+    case ASTNodeType::String:
+      key.tag('s');
+      key.text(static_cast<const StringNode*>(node)->value);
+      break;
+    case ASTNodeType::List:
+      key.tag('(');
+      for (auto child : static_cast<const ListNode*>(node)->list)
+        add_to_key(child, key);
+      key.tag(')');
+      break;
+    case ASTNodeType::Lambda: {
+      auto lambda = static_cast<const LambdaNode*>(node);
+      key.tag('f');
+      add_to_key(lambda->arglist, key);
+      add_to_key(lambda->body, key);
+      break;
+    }
+    case ASTNodeType::Array:
+      key.tag('a');
+      key.array(*static_cast<const ArrayNode*>(node)->array);
+      break;
+  }
+}
+
+// Calls fn with args, which the call takes ownership of. A lambda from memo
+// only runs on a miss in its cache.
+ASTNode* apply_lambda(ASTNode* fn, std::vector<ASTNode*> args,
+                      Environment& env) {
+  if (fn->type() != ASTNodeType::Lambda) {
+    for (auto arg : args) delete arg;
+    throw TodaluException(std::string("Invalid function : ") + fn->getRepr());
+  }
+  auto lambda = dynamic_cast<LambdaNode*>(fn);
+  auto params = parameters_of(lambda);
+  if (params.size() != args.size()) {
+    for (auto arg : args) delete arg;
+    throw TodaluException("lambda argument count mismatch");
+  }
+  auto memo = lambda->memo;
+  MemoKey key;
+  if (memo) {
+    for (auto arg : args) add_to_key(arg, key);
+    ASTNode* result = nullptr;
+    if (memo->find(key.bytes, [&result](const std::unique_ptr<ASTNode>& hit) {
+          result = hit->deepCopy();
+        })) {
+      for (auto arg : args) delete arg;
+      return result;
+    }
+  }
+  TailFrame frame(env);
+  frame.bind(params, args);
+  if (gProfiling) {
+    profile::enter(lambda->name);
+    frame.profiled = true;
+  }
+  auto result = eval_tree(lambda->body, env);
+  if (memo)
+    memo->insert(key.bytes, std::unique_ptr<ASTNode>(result->deepCopy()));
+  return result;
+}
+
+// Evaluates the arguments of a call before any of them is bound.
+std::vector<ASTNode*> evaluate_arguments(ListNode* listnode, Environment& env) {
+  std::vector<ASTNode*> values;
+  try {
+    for (auto it = std::next(listnode->list.begin());
+         it != listnode->list.end(); it++)
+      values.push_back(eval_tree(*it, env));
+  } catch (...) {
+    for (auto value : values) delete value;
+    throw;
+  }
+  return values;
+}
+
+void check(const char* error, const std::string& fun = "") {
+  if (!error) return;
+  if (fun.empty()) throw TodaluException(error);
+  throw TodaluException(fun + " " + error);
+}
+
+// Integers too wide for int64 can't be array elements.
+bool to_operand(ASTNode* node, Operand& operand) {
+  switch (node->type()) {
+    case ASTNodeType::Integer:
+      operand.scalar.integer = static_cast<IntegerNode*>(node)->value;
+      return !static_cast<IntegerNode*>(node)->big;
+    case ASTNodeType::Decimal:
+      operand.scalar.decimal = true;
+      operand.scalar.real = static_cast<DecimalNode*>(node)->value;
+      return true;
+    case ASTNodeType::Array:
+      operand.array = static_cast<ArrayNode*>(node)->array.get();
+      return true;
     default:
+      return false;
+  }
+}
+
+ASTNode* from_number(const Number& number) {
+  if (number.decimal) return new DecimalNode(number.real);
+  return new IntegerNode(number.integer);
+}
+
+ASTNode* new_array(NumArray array) {
+  return new ArrayNode(std::make_shared<const NumArray>(std::move(array)));
+}
+
+const NumArray& as_array(ASTNode* node, const std::string& fun) {
+  if (node->type() != ASTNodeType::Array)
+    throw TodaluException(fun + " expects argument of type array");
+  return *static_cast<ArrayNode*>(node)->array;
+}
+
+bool is_number(ASTNode* node) {
+  return node->type() == ASTNodeType::Integer ||
+         node->type() == ASTNodeType::Decimal;
+}
+
+double as_double(ASTNode* node) {
+  if (node->type() == ASTNodeType::Decimal)
+    return static_cast<DecimalNode*>(node)->value;
+  auto integer = static_cast<IntegerNode*>(node);
+  return integer->big ? integer->big->to_double() : (double)integer->value;
+}
+
+// Integers are folded exactly, in int64 until that overflows, and scalars
+// with a decimal among them in double. Once an operand is an array, the
+// operation is applied element-wise in int64 or double.
+ASTNode* eval_arithmetic(ListNode* listnode, char op, Environment& env) {
+  if (listnode->list.size() < 3)
+    throw TodaluException("Needs atleast 2 operands");
+  std::vector<std::unique_ptr<ASTNode>> values;
+  bool has_array = false;
+  bool has_decimal = false;
+  for (auto it = std::next(listnode->list.begin()); it != listnode->list.end();
+       it++) {
+    values.emplace_back(eval_tree(*it, env));
+    auto type = values.back()->type();
+    if (type != ASTNodeType::Integer && type != ASTNodeType::Decimal &&
+        type != ASTNodeType::Array)
       throw TodaluException("Unsuitable operand to operator : " +
-                            operand->getRepr());
+                            values.back()->getRepr());
+    has_array |= type == ASTNodeType::Array;
+    has_decimal |= type == ASTNodeType::Decimal;
+  }
+  if (has_array) {
+    std::vector<Operand> operands(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+      if (!to_operand(values[i].get(), operands[i]))
+        throw TodaluException("Unsuitable operand to operator : " +
+                              values[i]->getRepr());
+    NumArray result;
+    check(numarray::fold(op, operands, result));
+    return new_array(std::move(result));
+  }
+  if (has_decimal) {
+    auto operation = [](double a, double b, char op) {
+      switch (op) {
+        case '+':
+          return a + b;
+        case '-':
+          return a - b;
+        case '*':
+          return a * b;
+        case '/':
+          return a / b;
+        default:
+          throw std::runtime_error("Invalid operation");
+      }
+    };
+    double acc = as_double(values[0].get());
+    for (size_t i = 1; i < values.size(); i++)
+      acc = operation(acc, as_double(values[i].get()), op);
+    return new DecimalNode(acc);
   }
+  auto first = static_cast<IntegerNode*>(values[0].get());
+  auto fold = first->big ? IntegerFold(*first->big) : IntegerFold(first->value);
+  for (size_t i = 1; i < values.size(); i++) {
+    auto integer = static_cast<IntegerNode*>(values[i].get());
+    check(integer->big ? fold.apply(op, *integer->big)
+                       : fold.apply(op, integer->value));
+  }
+  if (fold.fits()) return new IntegerNode(fold.integer());
+  return new IntegerNode(fold.result());
 }
 
-void bind_arguments(LambdaNode* lambda, ListNode* listnode) {
-  if (lambda->arglist->type() == ASTNodeType::Symbol) {
-    auto arg = eval_tree(listnode->list.back());  // there is only 1 arg
-    gEnv[lambda->arglist->getRepr()].push_front(arg);
-  } else if (lambda->arglist->type() == ASTNodeType::List) {
-    std::list<ASTNode*> argvalues;
-    auto itarg =
-        std::next(listnode->list.begin());  // 1st node in list is lambda
-    while (itarg != listnode->list.end()) {
-      argvalues.push_back(eval_tree(*itarg));
-      itarg++;
-    }
-    auto itname = dynamic_cast<ListNode*>(lambda->arglist)->list.begin();
-    auto itnameend = dynamic_cast<ListNode*>(lambda->arglist)->list.end();
-    auto itvalue = argvalues.begin();
-    while (itname != itnameend) {
-      gEnv[(*itname)->getRepr()].push_front(*itvalue);
-      itname++;
-      itvalue++;
-    }
+int compare_integers(ASTNode* oprnd1, ASTNode* oprnd2) {
+  auto x = static_cast<IntegerNode*>(oprnd1);
+  auto y = static_cast<IntegerNode*>(oprnd2);
+  if (!x->big && !y->big) return (x->value > y->value) - (x->value < y->value);
+  return compare(x->bigint(), y->bigint());
+}
+
+// Integers compare against decimals as doubles, as sort orders them.
+bool compare_scalars(ASTNode* oprnd1, ASTNode* oprnd2, char op) {
+  if (oprnd1->type() == ASTNodeType::Integer &&
+      oprnd2->type() == ASTNodeType::Integer) {
+    auto order = compare_integers(oprnd1, oprnd2);
+    return op == '=' ? order == 0 : order > 0;
   }
+  if (!is_number(oprnd1) || !is_number(oprnd2)) return false;
+  auto x = as_double(oprnd1);
+  auto y = as_double(oprnd2);
+  return op == '=' ? x == y : x > y;
 }
 
-void unbind_arguments(LambdaNode* lambda) {
-  if (lambda->arglist->type() == ASTNodeType::Symbol) {
-    delete gEnv[lambda->arglist->getRepr()].front();
-    gEnv[lambda->arglist->getRepr()].pop_front();
-    if (gEnv[lambda->arglist->getRepr()].size() == 0) {
-      gEnv.erase(lambda->arglist->getRepr());
-    }
-  } else if (lambda->arglist->type() == ASTNodeType::List) {
-    auto it = dynamic_cast<ListNode*>(lambda->arglist)->list.begin();
-    auto itend = dynamic_cast<ListNode*>(lambda->arglist)->list.end();
-    while (it != itend) {
-      delete gEnv[(*it)->getRepr()].front();
-      gEnv[(*it)->getRepr()].pop_front();
-      if (gEnv[(*it)->getRepr()].size() == 0) gEnv.erase((*it)->getRepr());
-      it++;
+// eq? and > compare arrays element-wise.
+ASTNode* eval_compare_arrays(ASTNode* oprnd1, ASTNode* oprnd2, char op) {
+  Operand x, y;
+  if (!to_operand(oprnd1, x) || !to_operand(oprnd2, y))
+    return new BoolNode(false);
+  NumArray result;
+  check(numarray::elementwise(op, x, y, result));
+  return new_array(std::move(result));
+}
+
+ASTNode* eval_add(ListNode* listnode, Environment& env) {
+  return eval_arithmetic(listnode, '+', env);
+}
+
+ASTNode* eval_subtract(ListNode* listnode, Environment& env) {
+  return eval_arithmetic(listnode, '-', env);
+}
+
+ASTNode* eval_multiply(ListNode* listnode, Environment& env) {
+  return eval_arithmetic(listnode, '*', env);
+}
+
+ASTNode* eval_divide(ListNode* listnode, Environment& env) {
+  return eval_arithmetic(listnode, '/', env);
+}
+
+ASTNode* eval_equal(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("eq? expects two arguments");
+
+  std::unique_ptr<ASTNode> oprnd1(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> oprnd2(eval_tree(listnode->list.back(), env));
+  if (oprnd1->type() == ASTNodeType::Array ||
+      oprnd2->type() == ASTNodeType::Array)
+    return eval_compare_arrays(oprnd1.get(), oprnd2.get(), '=');
+  return new BoolNode(compare_scalars(oprnd1.get(), oprnd2.get(), '='));
+}
+
+ASTNode* eval_is_type(ListNode* listnode, ASTNodeType type,
+                      const char* message, Environment& env) {
+  if (listnode->list.size() != 2) throw TodaluException(message);
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  return new BoolNode(oprnd->type() == type);
+}
+
+ASTNode* eval_is_list(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::List,
+                      "list? expects one argument", env);
+}
+
+ASTNode* eval_is_int(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::Integer,
+                      "int? expects one argument", env);
+}
+
+ASTNode* eval_is_bool(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::Bool,
+                      "bool? expects one argument", env);
+}
+
+ASTNode* eval_is_decimal(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::Decimal,
+                      "dec? expects one argument", env);
+}
+
+ASTNode* eval_is_string(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::String,
+                      "string? expects one argument", env);
+}
+
+ASTNode* eval_greater(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("> expects two arguments");
+
+  std::unique_ptr<ASTNode> oprnd1(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> oprnd2(eval_tree(listnode->list.back(), env));
+  if (oprnd1->type() == ASTNodeType::Array ||
+      oprnd2->type() == ASTNodeType::Array)
+    return eval_compare_arrays(oprnd1.get(), oprnd2.get(), '>');
+  return new BoolNode(compare_scalars(oprnd1.get(), oprnd2.get(), '>'));
+}
+
+// eval_tree evaluates if and progn itself so that their tail forms don't
+// recurse. These are only used through kBuiltins by other callers.
+ASTNode* eval_progn(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() < 2)
+    throw TodaluException("progn expects atleast one element");
+  auto it = std::next(listnode->list.begin());
+  ASTNode* ret = nullptr;
+  while (it != listnode->list.end()) {
+    if (ret) delete ret;
+    ret = eval_tree(*it, env);
+    it++;
+  }
+  return ret;
+}
+
+ASTNode* eval_print_operand(ListNode* listnode, bool newline,
+                            Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("print expects one argument");
+  auto oprnd = eval_tree(listnode->list.back(), env);
+  if (oprnd->type() == ASTNodeType::String) {
+    std::cout << dynamic_cast<StringNode*>(oprnd)->value;
+  } else {
+    std::cout << oprnd->getRepr();
+  }
+  if (newline) std::cout << "\n";
+  return oprnd;
+}
+
+ASTNode* eval_print(ListNode* listnode, Environment& env) {
+  return eval_print_operand(listnode, false, env);
+}
+
+ASTNode* eval_println(ListNode* listnode, Environment& env) {
+  return eval_print_operand(listnode, true, env);
+}
+
+ASTNode* eval_quote(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("quote expects one argument");
+  return listnode->list.back()->deepCopy();
+}
+
+ASTNode* eval_eval(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("eval expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  return eval_tree(oprnd.get(), env);  // actually evaluates
+}
+
+ASTNode* eval_exit(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2 &&
+      listnode->list.back()->type() == ASTNodeType::Integer)
+    throw TodaluException("exit takes one argument of type integer");
+  exit(dynamic_cast<IntegerNode*>(listnode->list.back())->value);
+}
+
+ASTNode* eval_readstr(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 1)
+    throw TodaluException("read doesn't take arguments");
+  std::string s;
+  std::getline(std::cin, s);
+  return new StringNode(s);
+}
+
+ASTNode* eval_read(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 1)
+    throw TodaluException("read doesn't take arguments");
+  std::string s;
+  std::getline(std::cin, s);
+  FlatAST form;
+  read_forms(s, form);
+  if (form.size() != 1)
+    throw TodaluException("Contains more than one node at the base");
+  return form.root(0).to_node();
+}
+
+ASTNode* eval_car(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("car expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  if (oprnd->type() != ASTNodeType::List)
+    throw TodaluException("car expects argument of type list");
+  if (!dynamic_cast<ListNode*>(oprnd.get())->list.size())
+    throw TodaluException("car expects a non-empty list");
+  return dynamic_cast<ListNode*>(oprnd.get())->list.front()->deepCopy();
+}
+
+ASTNode* eval_cdr(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("cdr expects one argument");
+
+  auto oprnd = eval_tree(listnode->list.back(), env);
+  if (oprnd->type() != ASTNodeType::List)
+    throw TodaluException("cdr expects argument of type list");
+  if (!dynamic_cast<ListNode*>(oprnd)->list.size())
+    throw TodaluException("cdr expects a non-empty list");
+
+  delete dynamic_cast<ListNode*>(oprnd)->list.front();
+  dynamic_cast<ListNode*>(oprnd)->list.pop_front();
+  return oprnd;
+}
+
+ASTNode* eval_cons(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("cons expects two arguments");
+  auto oprnd1 = eval_tree(*(std::next(listnode->list.begin())), env);
+  auto oprnd2 = eval_tree(listnode->list.back(), env);
+  if (oprnd2->type() != ASTNodeType::List)
+    throw TodaluException("cons expects second argument of type list");
+
+  dynamic_cast<ListNode*>(oprnd2)->list.push_front(oprnd1);
+  return oprnd2;
+}
+
+ASTNode* eval_lambda(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("lambda syntax incorrect");
+  auto arglist = *std::next(listnode->list.begin());
+  auto body = listnode->list.back();
+
+  if (arglist->type() == ASTNodeType::List) {
+    auto l = dynamic_cast<ListNode*>(arglist)->list.begin();
+    while (l != dynamic_cast<ListNode*>(arglist)->list.end()) {
+      if ((*l)->type() != ASTNodeType::Symbol)
+        throw TodaluException("lambda argument list has non-symbol");
+      l++;
     }
+  } else if (arglist->type() != ASTNodeType::Symbol) {
+    throw TodaluException("lambda argument has non-symbol");
   }
+
+  return new LambdaNode(arglist->deepCopy(), body->deepCopy());
 }
 
-ASTNode* eval_tree(ASTNode* node) {
-  try {
-    if (node->type() == ASTNodeType::List) {
-      auto listnode = dynamic_cast<ListNode*>(node);
-      if (listnode->list.size() == 0)
-        throw TodaluException("Can't evaluate ()");
-      if (listnode->list.front()->type() == ASTNodeType::Symbol) {
-        auto fun = dynamic_cast<SymbolNode*>(listnode->list.front())->symbol;
-
-        if (fun == "+" || fun == "-" || fun == "*" || fun == "/") {
-          auto it = listnode->list.begin();
-          it++;
-          if (listnode->list.size() < 3)
-            throw TodaluException("Needs atleast 2 operands");
-          float acc = (fun[0] == '*') ? 1 : 0;
-          bool is_all_int = true;
-          if (fun == "-" || fun == "/") {
-            operate_on_node(*it, '+', acc, is_all_int);
-            it++;
-          }
-          while (it != listnode->list.end()) {
-            operate_on_node(*it, fun[0], acc, is_all_int);
-            it++;
-          }
-          if (is_all_int) return new IntegerNode(acc);
-          return new DecimalNode(acc);
-        }
+ASTNode* eval_def(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("def expects two arguments");
+  // Nothing would see the bindings of a pool worker once it's done.
+  if (env.in_worker()) throw TodaluException("def can't be used in parallel");
+  auto sym = *(std::next(listnode->list.begin()));
+  if (sym->type() == ASTNodeType::List) sym = eval_tree(sym, env);
+  if (sym->type() != ASTNodeType::Symbol)
+    throw TodaluException(
+        std::string("def expects first argument to be symbol. Found ") +
+        sym->getRepr());
+  auto value = eval_tree(listnode->list.back(), env);
+  auto id = dynamic_cast<SymbolNode*>(sym)->id;
+  if (value->type() == ASTNodeType::Lambda) {
+    auto lambda = dynamic_cast<LambdaNode*>(value);
+    if (lambda->name == kAnonymousLambda) lambda->name = id;
+  }
+  env.bindings_of(id).push_front(value);
+  return value->deepCopy();
+}
 
-        if (fun == "eq?") {
-          if (listnode->list.size() != 3)
-            throw TodaluException("eq? expects two arguments");
-
-          std::unique_ptr<ASTNode> oprnd1(
-              eval_tree(*(std::next(listnode->list.begin()))));
-          std::unique_ptr<ASTNode> oprnd2(eval_tree(listnode->list.back()));
-
-          bool res = false;
-          if (oprnd1->type() == oprnd2->type() &&
-              ((oprnd1->type() == ASTNodeType::Integer &&
-                (dynamic_cast<IntegerNode*>(oprnd1.get())->value ==
-                 dynamic_cast<IntegerNode*>(oprnd2.get())->value)) ||
-               (oprnd1->type() == ASTNodeType::Decimal &&
-                (dynamic_cast<DecimalNode*>(oprnd1.get())->value ==
-                 dynamic_cast<DecimalNode*>(oprnd2.get())->value))))
-            res = true;
-
-          return new BoolNode(res);
-        }
+ASTNode* eval_if(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 4)
+    throw TodaluException("if expects cond,body and else parts");
+  std::unique_ptr<ASTNode> predicate(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  auto body = *(std::next(std::next(listnode->list.begin())));
+  if (predicate->getBool() == false) {
+    body = listnode->list.back();
+  }
+  return eval_tree(body, env);
+}
 
-        if (fun == "list?") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("list? expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return new BoolNode(oprnd->type() == ASTNodeType::List);
-        }
+ASTNode* eval_make_array(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("array expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  if (oprnd->type() == ASTNodeType::Array) return oprnd.release();
+  if (oprnd->type() != ASTNodeType::List)
+    throw TodaluException("array expects a list of numbers");
+  std::vector<Number> numbers;
+  for (auto node : dynamic_cast<ListNode*>(oprnd.get())->list) {
+    Operand operand;
+    if (!to_operand(node, operand) || operand.array)
+      throw TodaluException("array expects a list of numbers");
+    numbers.push_back(operand.scalar);
+  }
+  return new_array(numarray::from_numbers(numbers));
+}
 
-        if (fun == "int?") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("int? expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return new BoolNode(oprnd->type() == ASTNodeType::Integer);
-        }
+ASTNode* eval_arange(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("arange expects two arguments");
+  std::unique_ptr<ASTNode> start(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> end(eval_tree(listnode->list.back(), env));
+  Operand x, y;
+  if (!to_operand(start.get(), x) || !to_operand(end.get(), y) || x.array ||
+      y.array)
+    throw TodaluException("arange expects numeric arguments");
+  return new_array(numarray::arange(x.scalar, y.scalar));
+}
 
-        if (fun == "bool?") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("bool? expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return new BoolNode(oprnd->type() == ASTNodeType::Bool);
-        }
+ASTNode* eval_is_array(ListNode* listnode, Environment& env) {
+  return eval_is_type(listnode, ASTNodeType::Array,
+                      "array? expects one argument", env);
+}
 
-        if (fun == "dec?") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("dec? expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return new BoolNode(oprnd->type() == ASTNodeType::Decimal);
-        }
+ASTNode* eval_aref(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("aref expects two arguments");
+  std::unique_ptr<ASTNode> array(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> index(eval_tree(listnode->list.back(), env));
+  if (array->type() != ASTNodeType::Array ||
+      index->type() != ASTNodeType::Integer)
+    throw TodaluException("aref expects an array and an integer index");
+  auto position = static_cast<IntegerNode*>(index.get());
+  Number element;
+  check(numarray::at(*static_cast<ArrayNode*>(array.get())->array,
+                     position->big ? -1 : position->value, element));
+  return from_number(element);
+}
 
-        if (fun == "string?") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("string? expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return new BoolNode(oprnd->type() == ASTNodeType::String);
-        }
+ASTNode* eval_reduce(ListNode* listnode, char op, const std::string& fun,
+                     Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException(fun + " expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  Number result;
+  check(numarray::reduce(op, as_array(oprnd.get(), fun), result), fun);
+  return from_number(result);
+}
 
-        if (fun == ">") {
-          if (listnode->list.size() != 3)
-            throw TodaluException("> expects two arguments");
-
-          std::unique_ptr<ASTNode> oprnd1(
-              eval_tree(*(std::next(listnode->list.begin()))));
-          std::unique_ptr<ASTNode> oprnd2(eval_tree(listnode->list.back()));
-
-          bool res = false;
-          if (oprnd1->type() == oprnd2->type() &&
-              ((oprnd1->type() == ASTNodeType::Integer &&
-                (dynamic_cast<IntegerNode*>(oprnd1.get())->value >
-                 dynamic_cast<IntegerNode*>(oprnd2.get())->value)) ||
-               (oprnd1->type() == ASTNodeType::Decimal &&
-                (dynamic_cast<DecimalNode*>(oprnd1.get())->value >
-                 dynamic_cast<DecimalNode*>(oprnd2.get())->value))))
-            res = true;
-
-          return new BoolNode(res);
-        }
+ASTNode* eval_sum(ListNode* listnode, Environment& env) {
+  return eval_reduce(listnode, 's', "sum", env);
+}
 
-        if (fun == "progn") {
-          if (listnode->list.size() < 2)
-            throw TodaluException("progn expects atleast one element");
-          auto it = std::next(listnode->list.begin());
-          ASTNode* ret = nullptr;
-          while (it != listnode->list.end()) {
-            if (ret) delete ret;
-            ret = eval_tree(*it);
-            it++;
-          }
-          return ret;
-        }
+ASTNode* eval_min(ListNode* listnode, Environment& env) {
+  return eval_reduce(listnode, '<', "min", env);
+}
 
-        if (fun == "print" || fun == "println") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("print expects one argument");
-          auto oprnd = eval_tree(listnode->list.back());
-          if (oprnd->type() == ASTNodeType::String) {
-            std::cout << dynamic_cast<StringNode*>(oprnd)->value;
-          } else {
-            std::cout << oprnd->getRepr();
-          }
-          if (fun == "println") std::cout << "\n";
-          return oprnd;
-        }
+ASTNode* eval_max(ListNode* listnode, Environment& env) {
+  return eval_reduce(listnode, '>', "max", env);
+}
 
-        if (fun == "quote") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("quote expects one argument");
-          return listnode->list.back()->deepCopy();
-        }
+ASTNode* eval_dot(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("dot expects two arguments");
+  std::unique_ptr<ASTNode> oprnd1(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> oprnd2(eval_tree(listnode->list.back(), env));
+  Number result;
+  check(numarray::dot(as_array(oprnd1.get(), "dot"),
+                      as_array(oprnd2.get(), "dot"), result));
+  return from_number(result);
+}
 
-        if (fun == "eval") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("eval expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          return eval_tree(oprnd.get());  // actually evaluates
-        }
+ASTNode* eval_prefix_sum(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("prefix-sum expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  NumArray result;
+  check(numarray::prefix_sum(as_array(oprnd.get(), "prefix-sum"), result));
+  return new_array(std::move(result));
+}
 
-        if (fun == "exit") {
-          if (listnode->list.size() != 2 &&
-              listnode->list.back()->type() == ASTNodeType::Integer)
-            throw TodaluException("exit takes one argument of type integer");
-          exit(dynamic_cast<IntegerNode*>(listnode->list.back())->value);
-        }
+ListNode* as_list(ASTNode* node, const std::string& fun) {
+  if (node->type() != ASTNodeType::List)
+    throw TodaluException(fun + " expects argument of type list");
+  return dynamic_cast<ListNode*>(node);
+}
 
-        if (fun == "readstr") {
-          if (listnode->list.size() != 1)
-            throw TodaluException("read doesn't take arguments");
-          std::string s;
-          std::getline(std::cin, s);
-          return new StringNode(s);
-        }
+// Evaluates the function and list arguments of map, filter and sort.
+std::pair<std::unique_ptr<ASTNode>, std::unique_ptr<ASTNode>> eval_fn_and_list(
+    ListNode* listnode, const std::string& fun, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException(fun + " expects two arguments");
+  std::unique_ptr<ASTNode> fn(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> list(eval_tree(listnode->list.back(), env));
+  as_list(list.get(), fun);
+  return {std::move(fn), std::move(list)};
+}
 
-        if (fun == "read") {
-          if (listnode->list.size() != 1)
-            throw TodaluException("read doesn't take arguments");
-          std::string s;
-          std::getline(std::cin, s);
-          auto tokens = tokenizer(s);
-          auto ast = create_ast(tokens);
-          if (ast.size() != 1)
-            throw TodaluException("Contains more than one node at the base");
-          return ast.front();
-        }
+ASTNode* eval_map(ListNode* listnode, Environment& env) {
+  auto [fn, in] = eval_fn_and_list(listnode, "map", env);
+  auto result = std::make_unique<ListNode>(std::list<ASTNode*>());
+  for (auto node : dynamic_cast<ListNode*>(in.get())->list)
+    result->list.push_back(apply_lambda(fn.get(), {node->deepCopy()}, env));
+  return result.release();
+}
 
-        if (fun == "car") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("car expects one argument");
-          std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back()));
-          if (oprnd->type() != ASTNodeType::List)
-            throw TodaluException("car expects argument of type list");
-          if (!dynamic_cast<ListNode*>(oprnd.get())->list.size())
-            throw TodaluException("car expects a non-empty list");
-          return dynamic_cast<ListNode*>(oprnd.get())->list.front()->deepCopy();
-        }
+ASTNode* eval_filter(ListNode* listnode, Environment& env) {
+  auto [fn, in] = eval_fn_and_list(listnode, "filter", env);
+  auto& list = dynamic_cast<ListNode*>(in.get())->list;
+  for (auto it = list.begin(); it != list.end();) {
+    std::unique_ptr<ASTNode> keep(
+        apply_lambda(fn.get(), {(*it)->deepCopy()}, env));
+    if (keep->getBool()) {
+      it++;
+    } else {
+      delete *it;
+      it = list.erase(it);
+    }
+  }
+  return in.release();
+}
 
-        if (fun == "cdr") {
-          if (listnode->list.size() != 2)
-            throw TodaluException("cdr expects one argument");
+// Left fold, (fn (fn init x0) x1) and so on.
+ASTNode* eval_reduce(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 4)
+    throw TodaluException(
+        "reduce expects a function, an initial value and a list");
+  auto it = std::next(listnode->list.begin());
+  std::unique_ptr<ASTNode> fn(eval_tree(*it++, env));
+  std::unique_ptr<ASTNode> acc(eval_tree(*it++, env));
+  std::unique_ptr<ASTNode> in(eval_tree(*it, env));
+  for (auto node : as_list(in.get(), "reduce")->list)
+    acc.reset(apply_lambda(fn.get(), {acc.release(), node->deepCopy()}, env));
+  return acc.release();
+}
 
-          auto oprnd = eval_tree(listnode->list.back());
-          if (oprnd->type() != ASTNodeType::List)
-            throw TodaluException("cdr expects argument of type list");
-          if (!dynamic_cast<ListNode*>(oprnd)->list.size())
-            throw TodaluException("cdr expects a non-empty list");
+// Integers from start up to but excluding end, or decimals if either is one.
+ASTNode* eval_range(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 3)
+    throw TodaluException("range expects two arguments");
+  std::unique_ptr<ASTNode> start(
+      eval_tree(*(std::next(listnode->list.begin())), env));
+  std::unique_ptr<ASTNode> end(eval_tree(listnode->list.back(), env));
+  Operand x, y;
+  if (!to_operand(start.get(), x) || !to_operand(end.get(), y) || x.array ||
+      y.array)
+    throw TodaluException("range expects numeric arguments");
+  auto result = std::make_unique<ListNode>(std::list<ASTNode*>());
+  if (x.scalar.decimal || y.scalar.decimal) {
+    for (double i = x.scalar.as_double(); i < y.scalar.as_double(); i++)
+      result->list.push_back(new DecimalNode(i));
+  } else {
+    for (auto i = x.scalar.integer; i < y.scalar.integer; i++)
+      result->list.push_back(new IntegerNode(i));
+  }
+  return result.release();
+}
 
-          delete dynamic_cast<ListNode*>(oprnd)->list.front();
-          dynamic_cast<ListNode*>(oprnd)->list.pop_front();
-          return oprnd;
-        }
+ASTNode* eval_length(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("length expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  if (oprnd->type() == ASTNodeType::Array)
+    return new IntegerNode(
+        dynamic_cast<ArrayNode*>(oprnd.get())->array->size());
+  return new IntegerNode(as_list(oprnd.get(), "length")->list.size());
+}
 
-        if (fun == "cons") {
-          if (listnode->list.size() != 3)
-            throw TodaluException("cons expects two arguments");
-          auto oprnd1 = eval_tree(*(std::next(listnode->list.begin())));
-          auto oprnd2 = eval_tree(listnode->list.back());
-          if (oprnd2->type() != ASTNodeType::List)
-            throw TodaluException("cons expects second argument of type list");
+ASTNode* eval_reverse(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("reverse expects one argument");
+  std::unique_ptr<ASTNode> oprnd(eval_tree(listnode->list.back(), env));
+  as_list(oprnd.get(), "reverse")->list.reverse();
+  return oprnd.release();
+}
 
-          dynamic_cast<ListNode*>(oprnd2)->list.push_front(oprnd1);
-          return oprnd2;
-        }
+ASTNode* eval_append(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() < 2)
+    throw TodaluException("append expects atleast one list");
+  auto result = std::make_unique<ListNode>(std::list<ASTNode*>());
+  for (auto it = std::next(listnode->list.begin()); it != listnode->list.end();
+       it++) {
+    std::unique_ptr<ASTNode> oprnd(eval_tree(*it, env));
+    result->list.splice(result->list.end(),
+                        as_list(oprnd.get(), "append")->list);
+  }
+  return result.release();
+}
 
-        if (fun == "lambda") {
-          if (listnode->list.size() != 3)
-            throw TodaluException("lambda syntax incorrect");
-          auto arglist = *std::next(listnode->list.begin());
-          auto body = listnode->list.back();
-
-          if (arglist->type() == ASTNodeType::List) {
-            auto l = dynamic_cast<ListNode*>(arglist)->list.begin();
-            while (l != dynamic_cast<ListNode*>(arglist)->list.end()) {
-              if ((*l)->type() != ASTNodeType::Symbol)
-                throw TodaluException("lambda argument list has non-symbol");
-              l++;
-            }
-          } else if (arglist->type() != ASTNodeType::Symbol) {
-            throw TodaluException("lambda argument has non-symbol");
-          }
-
-          return new LambdaNode(arglist->deepCopy(), body->deepCopy());
-        }
+// Without a comparator, numbers and strings sort in ascending order.
+// Integers compare exactly, and against decimals as doubles.
+bool less_than(ASTNode* x, ASTNode* y) {
+  if (x->type() == ASTNodeType::Integer && y->type() == ASTNodeType::Integer)
+    return compare_integers(x, y) < 0;
+  if (is_number(x) && is_number(y)) return as_double(x) < as_double(y);
+  if (x->type() == ASTNodeType::String && y->type() == ASTNodeType::String)
+    return dynamic_cast<StringNode*>(x)->value <
+           dynamic_cast<StringNode*>(y)->value;
+  throw TodaluException("sort can't compare " + x->getRepr() + " and " +
+                        y->getRepr());
+}
 
-        if (fun == "def") {
-          if (listnode->list.size() != 3)
-            throw TodaluException("def expects two arguments");
-          auto sym = *(std::next(listnode->list.begin()));
-          if (sym->type() == ASTNodeType::List) sym = eval_tree(sym);
-          if (sym->type() != ASTNodeType::Symbol)
-            throw TodaluException(
-                std::string("def expects first argument to be symbol. Found ") +
-                sym->getRepr());
-          auto value = eval_tree(listnode->list.back());
-          gEnv[sym->getRepr()].push_front(value);
-          return value->deepCopy();
-        }
+// (sort list) or (sort list fn), where (fn x y) is true if x goes before y.
+// The sort is stable.
+ASTNode* eval_sort(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2 && listnode->list.size() != 3)
+    throw TodaluException("sort expects a list and an optional comparator");
+  auto it = std::next(listnode->list.begin());
+  std::unique_ptr<ASTNode> in(eval_tree(*it++, env));
+  std::unique_ptr<ASTNode> fn;
+  if (it != listnode->list.end()) fn.reset(eval_tree(*it, env));
+  auto& list = as_list(in.get(), "sort")->list;
+  std::vector<ASTNode*> nodes(list.begin(), list.end());
+  if (fn) {
+    std::stable_sort(nodes.begin(), nodes.end(),
+                     [&fn, &env](ASTNode* x, ASTNode* y) {
+                       std::unique_ptr<ASTNode> before(apply_lambda(
+                           fn.get(), {x->deepCopy(), y->deepCopy()}, env));
+                       return before->getBool();
+                     });
+  } else {
+    std::stable_sort(nodes.begin(), nodes.end(), less_than);
+  }
+  list.assign(nodes.begin(), nodes.end());
+  return in.release();
+}
+
+// Prints how long evaluating the argument took.
+ASTNode* eval_time(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("time expects one argument");
+  profile::Timer timer;
+  auto value = eval_tree(listnode->list.back(), env);
+  timer.report();
+  return value;
+}
+
+// (memo fn capacity) is a copy of fn that caches its results, keeping up to
+// capacity of them.
+ASTNode* eval_memo(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2 && listnode->list.size() != 3)
+    throw TodaluException("memo expects a lambda and an optional capacity");
+  std::unique_ptr<ASTNode> fn(
+      eval_tree(*std::next(listnode->list.begin()), env));
+  if (fn->type() != ASTNodeType::Lambda)
+    throw TodaluException("memo expects a lambda");
+  auto capacity = kMemoCapacity;
+  if (listnode->list.size() == 3) {
+    std::unique_ptr<ASTNode> size(eval_tree(listnode->list.back(), env));
+    auto integer = dynamic_cast<IntegerNode*>(size.get());
+    if (!integer || integer->big || integer->value < 0)
+      throw TodaluException("memo expects a non-negative capacity");
+    capacity = integer->value;
+  }
+  auto lambda = dynamic_cast<LambdaNode*>(fn.release());
+  lambda->memo =
+      std::make_shared<MemoTable<std::unique_ptr<ASTNode>>>(capacity);
+  return lambda;
+}
+
+// ( hits misses size capacity ) of the cache of a lambda from memo.
+ASTNode* eval_memo_stats(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 2)
+    throw TodaluException("memo-stats expects one argument");
+  std::unique_ptr<ASTNode> fn(eval_tree(listnode->list.back(), env));
+  auto lambda = dynamic_cast<LambdaNode*>(fn.get());
+  if (!lambda || !lambda->memo)
+    throw TodaluException("memo-stats expects a memoized lambda");
+  auto stats = lambda->memo->stats();
+  return new ListNode(
+      {new IntegerNode(stats.hits), new IntegerNode(stats.misses),
+       new IntegerNode(stats.size), new IntegerNode(stats.capacity)});
+}
+
+// Results of fn on copies of the elements of list, in order. The calls are
+// spread over the pool, and bind their arguments in an env of their own on
+// top of env.
+std::vector<std::unique_ptr<ASTNode>> apply_parallel(ASTNode* fn,
+                                                     ListNode* list,
+                                                     Environment& env) {
+  std::vector<ASTNode*> elements(list->list.begin(), list->list.end());
+  std::vector<std::unique_ptr<ASTNode>> results(elements.size());
+  pool::parallel_for(elements.size(), [&](size_t begin, size_t end) {
+    Environment worker(&env);
+    for (auto i = begin; i < end; i++)
+      results[i].reset(apply_lambda(fn, {elements[i]->deepCopy()}, worker));
+  });
+  return results;
+}
+
+ASTNode* eval_pmap(ListNode* listnode, Environment& env) {
+  auto [fn, in] = eval_fn_and_list(listnode, "pmap", env);
+  auto results = apply_parallel(fn.get(), as_list(in.get(), "pmap"), env);
+  auto result = std::make_unique<ListNode>(std::list<ASTNode*>());
+  for (auto& node : results) result->list.push_back(node.release());
+  return result.release();
+}
+
+ASTNode* eval_pfilter(ListNode* listnode, Environment& env) {
+  auto [fn, in] = eval_fn_and_list(listnode, "pfilter", env);
+  auto& list = as_list(in.get(), "pfilter")->list;
+  auto keep = apply_parallel(fn.get(), as_list(in.get(), "pfilter"), env);
+  size_t i = 0;
+  for (auto it = list.begin(); it != list.end(); i++) {
+    if (keep[i]->getBool()) {
+      it++;
+    } else {
+      delete *it;
+      it = list.erase(it);
+    }
+  }
+  return in.release();
+}
+
+// reduce for an associative fn. The ranges of the list the pool hands out are
+// folded starting from their first element, and those results are folded
+// into init in order.
+ASTNode* eval_preduce(ListNode* listnode, Environment& env) {
+  if (listnode->list.size() != 4)
+    throw TodaluException(
+        "preduce expects a function, an initial value and a list");
+  auto it = std::next(listnode->list.begin());
+  std::unique_ptr<ASTNode> fn(eval_tree(*it++, env));
+  std::unique_ptr<ASTNode> acc(eval_tree(*it++, env));
+  std::unique_ptr<ASTNode> in(eval_tree(*it, env));
+  auto& list = as_list(in.get(), "preduce")->list;
+  std::vector<ASTNode*> elements(list.begin(), list.end());
+  // Indexed by the start of the range.
+  std::vector<std::unique_ptr<ASTNode>> folds(elements.size());
+  pool::parallel_for(elements.size(), [&](size_t begin, size_t end) {
+    Environment worker(&env);
+    std::unique_ptr<ASTNode> fold(elements[begin]->deepCopy());
+    for (auto i = begin + 1; i < end; i++)
+      fold.reset(apply_lambda(
+          fn.get(), {fold.release(), elements[i]->deepCopy()}, worker));
+    folds[begin] = std::move(fold);
+  });
+  for (auto& fold : folds)
+    if (fold)
+      acc.reset(apply_lambda(fn.get(), {acc.release(), fold.release()}, env));
+  return acc.release();
+}
+
+// Indexed by Builtin
+ASTNode* (*const kBuiltins[])(ListNode*, Environment&) = {
+    eval_add,        eval_subtract,   eval_multiply,   eval_divide,
+    eval_equal,      eval_is_list,    eval_is_int,     eval_is_bool,
+    eval_is_decimal, eval_is_string,  eval_greater,    eval_progn,
+    eval_print,      eval_println,    eval_quote,      eval_eval,
+    eval_exit,       eval_readstr,    eval_read,       eval_car,
+    eval_cdr,        eval_cons,       eval_lambda,     eval_def,
+    eval_if,         eval_make_array, eval_arange,     eval_is_array,
+    eval_aref,       eval_sum,        eval_dot,        eval_min,
+    eval_max,        eval_prefix_sum, eval_map,        eval_filter,
+    eval_reduce,     eval_range,      eval_length,     eval_reverse,
+    eval_append,     eval_sort,       eval_time,       eval_memo,
+    eval_memo_stats, eval_pmap,       eval_pfilter,    eval_preduce};
+static_assert(sizeof(kBuiltins) / sizeof(kBuiltins[0]) ==
+                  static_cast<size_t>(Builtin::Count),
+              "kBuiltins must cover every Builtin");
 
-        if (fun == "if") {
+}  // namespace
+
+// The branches of an if, the last form of a progn and lambda bodies are tail
+// positions, which are evaluated by looping instead of recursing.
+ASTNode* eval_tree(ASTNode* node, Environment& env) {
+  auto root = node;
+  TailFrame frame(env);
+  try {
+    while (node->type() == ASTNodeType::List) {
+      auto listnode = dynamic_cast<ListNode*>(node);
+      if (listnode->list.size() == 0)
+        throw TodaluException("Can't evaluate ()");
+      if (listnode->list.front()->type() == ASTNodeType::Symbol) {
+        auto id = dynamic_cast<SymbolNode*>(listnode->list.front())->id;
+        if (id == static_cast<uint32_t>(Builtin::If)) {
           if (listnode->list.size() != 4)
             throw TodaluException("if expects cond,body and else parts");
           std::unique_ptr<ASTNode> predicate(
-              eval_tree(*(std::next(listnode->list.begin()))));
-          auto body = *(std::next(std::next(listnode->list.begin())));
-          if (predicate->getBool() == false) {
-            body = listnode->list.back();
-          }
-          return eval_tree(body);
+              eval_tree(*(std::next(listnode->list.begin())), env));
+          node = predicate->getBool()
+                     ? *(std::next(std::next(listnode->list.begin())))
+                     : listnode->list.back();
+          continue;
+        }
+        if (id == static_cast<uint32_t>(Builtin::Progn)) {
+          if (listnode->list.size() < 2)
+            throw TodaluException("progn expects atleast one element");
+          for (auto it = std::next(listnode->list.begin());
+               it != std::prev(listnode->list.end()); it++)
+            delete eval_tree(*it, env);
+          node = listnode->list.back();
+          continue;
+        }
+        if (is_builtin(id)) {
+          profile::Scope scope(id);
+          return kBuiltins[id](listnode, env);
         }
       }
       // Treat this as lambda and try to execute
       std::unique_ptr<ASTNode> lambda_candidate(
-          eval_tree(listnode->list.front()));
+          eval_tree(listnode->list.front(), env));
       if (lambda_candidate->type() != ASTNodeType::Lambda)
         throw TodaluException(std::string("Invalid function : ") +
                               lambda_candidate->getRepr());
@@ -356,39 +994,35 @@ ASTNode* eval_tree(ASTNode* node) {
         throw TodaluException("lambda argument count mismatch");
       }
 
-      bind_arguments(lambda, listnode);
-      ASTNode* result = nullptr;
-      try {
-        result = eval_tree(lambda->body);
-      } catch (...) {
-        unbind_arguments(lambda);
-        throw;
+      auto values = evaluate_arguments(listnode, env);
+      // The cache needs the result, so memoized calls aren't tail calls.
+      if (lambda->memo) return apply_lambda(lambda, std::move(values), env);
+      frame.bind(parameters_of(lambda), values);
+      // listnode may belong to the body of the lambda being replaced.
+      frame.lambda = std::move(lambda_candidate);
+      if (gProfiling) {
+        if (frame.profiled) profile::leave();
+        profile::enter(lambda->name);
+        frame.profiled = true;
       }
-      unbind_arguments(lambda);
-      return result;
-    } else if (node->type() == ASTNodeType::Symbol) {
-      if (node->getRepr() == "#exception") {
+      node = lambda->body;
+    }
+    if (node->type() == ASTNodeType::Symbol) {
+      auto id = dynamic_cast<SymbolNode*>(node)->id;
+      if (id == kExceptionSymbol) {
         throw TodaluException("Exception thrown!");
       }
-      auto pair = gEnv.find(node->getRepr());
-      if (pair != gEnv.end()) {
-        // pair->second is list of possible values
-        return pair->second.front()->deepCopy();
-      } else {
-        throw TodaluException(std::string("Undefined symbol : ") +
-                              node->getRepr());
-      }
+      if (auto value = env.lookup(id)) return value->deepCopy();
+      throw TodaluException(std::string("Undefined symbol : ") +
+                            node->getRepr());
     }
     return node->deepCopy();
   } catch (...) {
     std::cerr << "Error encountered while operating on : " + node->getRepr()
               << std::endl;
+    if (node != root)
+      std::cerr << "Error encountered while operating on : " + root->getRepr()
+                << std::endl;
     throw;
   }
 }
-
-void free_env() {
-  for (auto p : gEnv) {
-    for (auto node : p.second) delete node;
-  }
-}
@@ -0,0 +1,367 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "ast.h"
+#include "common.h"
+#include "value.h"
+
+namespace {
+
+// The file starts with the header, followed by the nodes, the children and
+// the roots of the forms, the end offset of every symbol name, the symbol
+// names and the characters of strings. Nodes are copied as they are, and only
+// symbol ids need fixing up when the image is read.
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t symbols;
+  uint32_t nodes;
+  uint32_t children;
+  uint32_t roots;
+  uint32_t chars;
+  uint32_t symbol_chars;
+  uint32_t reserved;
+};
+
+constexpr char kMagic[8] = {'T', 'O', 'D', 'A', 'L', 'U', 'I', 'M'};
+constexpr uint32_t kVersion = 1;
+static_assert(std::is_trivially_copyable_v<FlatNode>);
+static_assert(sizeof(ImageHeader) % alignof(FlatNode) == 0);
+
+// Thrown for values that no form recreates.
+struct Unsaveable {};
+
+uint32_t add_list(FlatAST& ast, std::vector<uint32_t>& children) {
+  auto index = ast.add({ASTNodeType::List});
+  ast.close_list(index, children, 0);
+  return index;
+}
+
+uint32_t add_symbol(FlatAST& ast, uint32_t id) {
+  FlatNode node{ASTNodeType::Symbol};
+  node.id = id;
+  return ast.add(node);
+}
+
+uint32_t add_call(FlatAST& ast, Builtin fun, std::vector<uint32_t> args) {
+  args.insert(args.begin(), add_symbol(ast, static_cast<uint32_t>(fun)));
+  return add_list(ast, args);
+}
+
+uint32_t add_string(FlatAST& ast, const std::string& str) {
+  FlatNode node{ASTNodeType::String};
+  node.first = ast.chars.size();
+  node.size = str.size();
+  ast.chars += str;
+  return ast.add(node);
+}
+
+// (array (quote (x0 x1 ...)))
+uint32_t array_form(const NumArray& array, FlatAST& ast) {
+  std::vector<uint32_t> elements;
+  for (size_t i = 0; i < array.size(); i++) {
+    FlatNode node{array.decimal ? ASTNodeType::Decimal : ASTNodeType::Integer};
+    if (array.decimal)
+      node.decimal = array.decimals[i];
+    else
+      node.integer = array.ints[i];
+    elements.push_back(ast.add(node));
+  }
+  auto list = add_list(ast, elements);
+  return add_call(ast, Builtin::MakeArray,
+                  {add_call(ast, Builtin::Quote, {list})});
+}
+
+// (memo lambda capacity), the cache of a memoized lambda isn't saved.
+uint32_t memo_form(uint32_t lambda, size_t capacity, FlatAST& ast) {
+  FlatNode node{ASTNodeType::Integer};
+  node.integer = capacity;
+  return add_call(ast, Builtin::Memo, {lambda, ast.add(node)});
+}
+
+uint32_t datum(const Value& value, FlatAST& ast) {
+  auto index = flatten(value, ast);
+  if (!ast.objects.empty()) throw Unsaveable();
+  return index;
+}
+
+uint32_t datum(const ASTNode* value, FlatAST& ast) {
+  FlatNode node{value->type()};
+  switch (value->type()) {
+    case ASTNodeType::Bool:
+      node.boolean = static_cast<const BoolNode*>(value)->value;
+      break;
+    case ASTNodeType::Integer:
+      return ast.add_integer(static_cast<const IntegerNode*>(value)->bigint());
+    case ASTNodeType::Decimal:
+      node.decimal = static_cast<const DecimalNode*>(value)->value;
+      break;
+    case ASTNodeType::String:
+      return add_string(ast, static_cast<const StringNode*>(value)->value);
+    case ASTNodeType::Symbol:
+      node.id = static_cast<const SymbolNode*>(value)->id;
+      break;
+    case ASTNodeType::List: {
+      std::vector<uint32_t> children;
+      for (auto child : static_cast<const ListNode*>(value)->list)
+        children.push_back(datum(child, ast));
+      return add_list(ast, children);
+    }
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      throw Unsaveable();
+  }
+  return ast.add(node);
+}
+
+// Whether value holds a lambda or an array, which quote can't recreate.
+bool holds_objects(const Value& value) {
+  switch (value.type()) {
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      return true;
+    case ASTNodeType::List:
+      for (auto list = &value; !list->is_empty_list();
+           list = &list->as<PairObject>()->cdr)
+        if (holds_objects(list->as<PairObject>()->car)) return true;
+      return false;
+    default:
+      return false;
+  }
+}
+
+bool holds_objects(const ASTNode* value) {
+  switch (value->type()) {
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      return true;
+    case ASTNodeType::List:
+      for (auto child : static_cast<const ListNode*>(value)->list)
+        if (holds_objects(child)) return true;
+      return false;
+    default:
+      return false;
+  }
+}
+
+// (cons x0 (cons x1 ... (quote ()))) for the forms of the elements.
+uint32_t cons_form(const std::vector<uint32_t>& elements, FlatAST& ast) {
+  std::vector<uint32_t> empty;
+  auto list = add_call(ast, Builtin::Quote, {add_list(ast, empty)});
+  for (auto it = elements.rbegin(); it != elements.rend(); it++)
+    list = add_call(ast, Builtin::Cons, {*it, list});
+  return list;
+}
+
+uint32_t value_form(const Value& value, FlatAST& ast) {
+  switch (value.type()) {
+    case ASTNodeType::Symbol:
+      return add_call(ast, Builtin::Quote, {datum(value, ast)});
+    case ASTNodeType::List: {
+      if (!holds_objects(value))
+        return add_call(ast, Builtin::Quote, {datum(value, ast)});
+      std::vector<uint32_t> elements;
+      for (auto list = &value; !list->is_empty_list();
+           list = &list->as<PairObject>()->cdr)
+        elements.push_back(value_form(list->as<PairObject>()->car, ast));
+      return cons_form(elements, ast);
+    }
+    case ASTNodeType::Lambda: {
+      auto lambda = value.as<LambdaObject>();
+      if (lambda->env) throw Unsaveable();
+      auto form = add_call(ast, Builtin::Lambda, {datum(lambda->arglist, ast),
+                                                  datum(lambda->body, ast)});
+      if (lambda->memo) return memo_form(form, lambda->memo->capacity, ast);
+      return form;
+    }
+    case ASTNodeType::Array:
+      return array_form(value.as<ArrayObject>()->data, ast);
+    default:
+      return datum(value, ast);
+  }
+}
+
+uint32_t value_form(const ASTNode* value, FlatAST& ast) {
+  switch (value->type()) {
+    case ASTNodeType::Symbol:
+      return add_call(ast, Builtin::Quote, {datum(value, ast)});
+    case ASTNodeType::List: {
+      if (!holds_objects(value))
+        return add_call(ast, Builtin::Quote, {datum(value, ast)});
+      std::vector<uint32_t> elements;
+      for (auto child : static_cast<const ListNode*>(value)->list)
+        elements.push_back(value_form(child, ast));
+      return cons_form(elements, ast);
+    }
+    case ASTNodeType::Lambda: {
+      auto lambda = static_cast<const LambdaNode*>(value);
+      auto form = add_call(ast, Builtin::Lambda, {datum(lambda->arglist, ast),
+                                                  datum(lambda->body, ast)});
+      if (lambda->memo) return memo_form(form, lambda->memo->capacity, ast);
+      return form;
+    }
+    case ASTNodeType::Array:
+      return array_form(*static_cast<const ArrayNode*>(value)->array, ast);
+    default:
+      return datum(value, ast);
+  }
+}
+
+template <class T>
+void add_def(uint32_t id, const T& value, FlatAST& forms) {
+  try {
+    auto form = value_form(value, forms);
+    forms.roots.push_back(
+        add_call(forms, Builtin::Def, {add_symbol(forms, id), form}));
+  } catch (Unsaveable&) {
+    throw TodaluException("Can't save " + symbol_name(id) +
+                          " to an image, its value holds a closure");
+  }
+}
+
+template <class T>
+void write_array(std::ofstream& out, const std::vector<T>& array) {
+  out.write(reinterpret_cast<const char*>(array.data()),
+            array.size() * sizeof(T));
+}
+
+}  // namespace
+
+void add_binding(uint32_t id, const Value& value, FlatAST& forms) {
+  add_def(id, value, forms);
+}
+
+void add_binding(uint32_t id, const ASTNode* value, FlatAST& forms) {
+  add_def(id, value, forms);
+}
+
+void write_image(const std::string& path, const FlatAST& forms) {
+  uint32_t symbols = 0;
+  for (auto& node : forms.nodes)
+    if (node.type == ASTNodeType::Symbol)
+      symbols = std::max(symbols, node.id + 1);
+  std::vector<uint32_t> symbol_ends;
+  std::string symbol_chars;
+  for (uint32_t id = 0; id < symbols; id++) {
+    symbol_chars += symbol_name(id);
+    symbol_ends.push_back(symbol_chars.size());
+  }
+
+  ImageHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.symbols = symbols;
+  header.nodes = forms.nodes.size();
+  header.children = forms.children.size();
+  header.roots = forms.roots.size();
+  header.chars = forms.chars.size();
+  header.symbol_chars = symbol_chars.size();
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  write_array(out, forms.nodes);
+  write_array(out, forms.children);
+  write_array(out, forms.roots);
+  write_array(out, symbol_ends);
+  out.write(symbol_chars.data(), symbol_chars.size());
+  out.write(forms.chars.data(), forms.chars.size());
+  if (!out.good()) throw TodaluException("Couldn't write image : " + path);
+}
+
+void read_image(const std::string& path, FlatAST& forms) {
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw TodaluException("Couldn't read image : " + path);
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw TodaluException("Couldn't read image : " + path);
+  struct Mapping {
+    ~Mapping() { munmap(data, size); }
+    void* data;
+    size_t size;
+  } mapping{data, (size_t)st.st_size};
+
+  auto invalid = [&path]() {
+    return TodaluException("Not a valid image : " + path);
+  };
+  ImageHeader header;
+  if (mapping.size < sizeof(header)) throw invalid();
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) ||
+      header.version != kVersion)
+    throw invalid();
+  uint64_t size = sizeof(header) + (uint64_t)header.nodes * sizeof(FlatNode) +
+                  ((uint64_t)header.children + header.roots + header.symbols) *
+                      sizeof(uint32_t) +
+                  header.symbol_chars + header.chars;
+  if (size != mapping.size) throw invalid();
+
+  auto cursor = static_cast<const char*>(data) + sizeof(header);
+  auto take = [&cursor](auto& array, size_t count) {
+    using T = typename std::remove_reference_t<decltype(array)>::value_type;
+    auto begin = reinterpret_cast<const T*>(cursor);
+    array.assign(begin, begin + count);
+    cursor += count * sizeof(T);
+  };
+  forms.clear();
+  take(forms.nodes, header.nodes);
+  take(forms.children, header.children);
+  take(forms.roots, header.roots);
+  std::vector<uint32_t> symbol_ends;
+  take(symbol_ends, header.symbols);
+  std::string_view symbol_chars(cursor, header.symbol_chars);
+  cursor += header.symbol_chars;
+  forms.chars.assign(cursor, header.chars);
+
+  std::vector<uint32_t> ids;
+  uint32_t start = 0;
+  for (auto end : symbol_ends) {
+    if (end < start || end > symbol_chars.size()) throw invalid();
+    ids.push_back(intern(std::string(symbol_chars.substr(start, end - start))));
+    start = end;
+  }
+  // Children come before their list, so the forms can't be cyclic.
+  for (uint32_t i = 0; i < forms.nodes.size(); i++) {
+    auto& node = forms.nodes[i];
+    switch (node.type) {
+      case ASTNodeType::Bool:
+      case ASTNodeType::Decimal:
+        break;
+      case ASTNodeType::Integer:
+        if (node.size && (uint64_t)node.first + node.size > forms.chars.size())
+          throw invalid();
+        break;
+      case ASTNodeType::Symbol:
+        if (node.id >= ids.size()) throw invalid();
+        node.id = ids[node.id];
+        break;
+      case ASTNodeType::String:
+        if ((uint64_t)node.first + node.size > forms.chars.size())
+          throw invalid();
+        break;
+      case ASTNodeType::List:
+        if ((uint64_t)node.first + node.size > forms.children.size())
+          throw invalid();
+        for (uint32_t j = 0; j < node.size; j++)
+          if (forms.children[node.first + j] >= i) throw invalid();
+        break;
+      default:
+        throw invalid();
+    }
+  }
+  for (auto root : forms.roots)
+    if (root >= forms.nodes.size()) throw invalid();
+}
@@ -1,9 +1,94 @@
 #ifndef _ASTH
 #define _ASTH
+#include <cstdint>
 #include <list>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
-enum ASTNodeType { Bool = 0, Integer, Decimal, Symbol, List, Lambda, String };
+#include "bigint.h"
+#include "memo.h"
+#include "numarray.h"
+
+class Object;
+
+enum ASTNodeType {
+  Bool = 0,
+  Integer,
+  Decimal,
+  Symbol,
+  List,
+  Lambda,
+  String,
+  Array
+};
+
+// Symbols are interned as they are parsed. The builtins are interned first, in
+// this order, so that their ids can index dispatch tables directly.
+enum class Builtin : uint32_t {
+  Add = 0,
+  Subtract,
+  Multiply,
+  Divide,
+  Equal,
+  IsList,
+  IsInt,
+  IsBool,
+  IsDecimal,
+  IsString,
+  Greater,
+  Progn,
+  Print,
+  Println,
+  Quote,
+  Eval,
+  Exit,
+  ReadStr,
+  Read,
+  Car,
+  Cdr,
+  Cons,
+  Lambda,
+  Def,
+  If,
+  MakeArray,
+  Arange,
+  IsArray,
+  Aref,
+  Sum,
+  Dot,
+  Min,
+  Max,
+  PrefixSum,
+  Map,
+  Filter,
+  Reduce,
+  Range,
+  Length,
+  Reverse,
+  Append,
+  Sort,
+  Time,
+  Memo,
+  MemoStats,
+  Pmap,
+  Pfilter,
+  Preduce,
+  Count
+};
+// Evaluating this symbol throws.
+const uint32_t kExceptionSymbol = static_cast<uint32_t>(Builtin::Count);
+// Name of lambdas that haven't been bound with def.
+const uint32_t kAnonymousLambda = UINT32_MAX;
+
+// Ids are the same for every interpreter in the process, and both are safe
+// to call from any thread.
+uint32_t intern(const std::string& symbol);
+const std::string& symbol_name(uint32_t id);
+inline bool is_builtin(uint32_t id) {
+  return id < static_cast<uint32_t>(Builtin::Count);
+}
 
 class ASTNode {
  public:
@@ -27,19 +112,34 @@ class BoolNode : public ASTNode {
   bool value = false;
 };
 
+// Integers that don't fit in int64 are kept in big, and value is 0.
 class IntegerNode : public ASTNode {
  public:
-  IntegerNode(int v) : value(v) {}
+  IntegerNode(int64_t v) : value(v) {}
+  IntegerNode(const BigInt& v) {
+    if (v.fits_int64())
+      value = v.to_int64();
+    else
+      big = std::make_shared<const BigInt>(v);
+  }
   ASTNodeType type() const { return ASTNodeType::Integer; }
-  bool getBool() const { return (value != 0); }
-  std::string getRepr() const { return std::to_string(value); }
-  ASTNode* deepCopy() const { return new IntegerNode(value); }
+  bool getBool() const { return value != 0 || big; }
+  std::string getRepr() const {
+    return big ? big->to_string() : std::to_string(value);
+  }
+  ASTNode* deepCopy() const {
+    auto copy = new IntegerNode(value);
+    copy->big = big;
+    return copy;
+  }
+  BigInt bigint() const { return big ? *big : BigInt(value); }
   int64_t value = 0;
+  std::shared_ptr<const BigInt> big;
 };
 
 class DecimalNode : public ASTNode {
  public:
-  DecimalNode(float v) : value(v) {}
+  DecimalNode(double v) : value(v) {}
   ASTNodeType type() const { return ASTNodeType::Decimal; }
   bool getBool() const { return (value != 0); }
   std::string getRepr() const { return std::to_string(value); }
@@ -64,12 +164,14 @@ class StringNode : public ASTNode {
 
 class SymbolNode : public ASTNode {
  public:
-  SymbolNode(std::string v) : symbol(v) {}
+  SymbolNode(std::string v) : symbol(v), id(intern(symbol)) {}
+  SymbolNode(std::string v, uint32_t i) : symbol(v), id(i) {}
   ASTNodeType type() const { return ASTNodeType::Symbol; }
   bool getBool() const { return true; }
   std::string getRepr() const { return symbol; }
-  ASTNode* deepCopy() const { return new SymbolNode(symbol); }
+  ASTNode* deepCopy() const { return new SymbolNode(symbol, id); }
   std::string symbol;
+  uint32_t id;
 };
 
 class LambdaNode : public ASTNode {
@@ -85,10 +187,30 @@ class LambdaNode : public ASTNode {
     return std::string("<lambda=") + std::to_string((uint64_t)this) + ">";
   }
   ASTNode* deepCopy() const {
-    return new LambdaNode(arglist->deepCopy(), body->deepCopy());
+    auto copy = new LambdaNode(arglist->deepCopy(), body->deepCopy());
+    copy->name = name;
+    copy->memo = memo;
+    return copy;
   }
   ASTNode* arglist = nullptr;
   ASTNode* body = nullptr;
+  // Symbol the lambda was first bound to, for the profiler.
+  uint32_t name = kAnonymousLambda;
+  // Results of the calls of a lambda returned by memo, shared by its copies.
+  std::shared_ptr<MemoTable<std::unique_ptr<ASTNode>>> memo;
+};
+
+std::string array_repr(const NumArray& array);
+
+// Arrays are immutable, so copies share the elements.
+class ArrayNode : public ASTNode {
+ public:
+  ArrayNode(std::shared_ptr<const NumArray> a) : array(std::move(a)) {}
+  ASTNodeType type() const { return ASTNodeType::Array; }
+  bool getBool() const { return array->size() != 0; }
+  std::string getRepr() const { return array_repr(*array); }
+  ASTNode* deepCopy() const { return new ArrayNode(array); }
+  std::shared_ptr<const NumArray> array;
 };
 
 class ListNode : public ASTNode {
@@ -118,4 +240,106 @@ class ListNode : public ASTNode {
   std::list<ASTNode*> list;
 };
 
+// Contiguous representation of the forms parsed from one input. Nodes live in
+// a single vector and the children of a list are a range of child indices, so
+// parsing costs a few buffer appends and clear() releases every node at once
+// while keeping the buffers for the next form.
+struct FlatNode {
+  ASTNodeType type;
+  // Number of children of a list, length of a string or of the digits of an
+  // integer that doesn't fit in int64, and zero for other integers.
+  uint32_t size = 0;
+  union {
+    bool boolean;
+    int64_t integer;
+    double decimal;
+    uint32_t id;
+    // Start of the children of a list, of the characters of a string or
+    // digits, or index into objects for a lambda or an array.
+    uint32_t first;
+  };
+};
+
+class NodeRef;
+
+class FlatAST {
+ public:
+  size_t size() const { return roots.size(); }
+  NodeRef root(size_t i) const;
+  void clear() {
+    nodes.clear();
+    children.clear();
+    chars.clear();
+    objects.clear();
+    roots.clear();
+  }
+  uint32_t add(const FlatNode& node) {
+    nodes.push_back(node);
+    return nodes.size() - 1;
+  }
+  // Keeps the digits in chars if value doesn't fit in int64.
+  uint32_t add_integer(const BigInt& value);
+  // Makes the indices in pending from mark on the children of list.
+  void close_list(uint32_t list, std::vector<uint32_t>& pending, size_t mark);
+  // Copies node and what it holds from another FlatAST.
+  uint32_t add_copy(NodeRef node);
+  // Replaces the forms with a copy of node, and returns the copy.
+  NodeRef assign(NodeRef node);
+  std::vector<FlatNode> nodes;
+  std::vector<uint32_t> children;
+  std::string chars;
+  // Lambdas and arrays that eval splices into a form. Not owned, the caller
+  // keeps them alive while the form is compiled.
+  std::vector<Object*> objects;
+  std::vector<uint32_t> roots;
+};
+
+// Node of a FlatAST, valid until the FlatAST is cleared.
+class NodeRef {
+ public:
+  NodeRef(const FlatAST* a, uint32_t i) : ast(a), index(i) {}
+  ASTNodeType type() const { return node().type; }
+  size_t size() const { return node().size; }
+  NodeRef operator[](size_t i) const {
+    return NodeRef(ast, ast->children[node().first + i]);
+  }
+  NodeRef front() const { return (*this)[0]; }
+  NodeRef back() const { return (*this)[size() - 1]; }
+  bool boolean() const { return node().boolean; }
+  int64_t integer() const { return node().integer; }
+  // Integers that don't fit in int64, whose digits string() returns.
+  bool is_bigint() const {
+    return type() == ASTNodeType::Integer && node().size;
+  }
+  BigInt bigint() const {
+    BigInt value;
+    BigInt::parse(std::string(string()), value);
+    return value;
+  }
+  double decimal() const { return node().decimal; }
+  uint32_t id() const { return node().id; }
+  const std::string& symbol() const { return symbol_name(node().id); }
+  std::string_view string() const {
+    return std::string_view(ast->chars).substr(node().first, node().size);
+  }
+  Object* object() const { return ast->objects[node().first]; }
+  bool is_symbol(Builtin fun) const {
+    return type() == ASTNodeType::Symbol &&
+           node().id == static_cast<uint32_t>(fun);
+  }
+  std::string getRepr() const;
+  // Where the node is in its FlatAST, NodeRef(ast, index) is the node again.
+  uint32_t position() const { return index; }
+  // Tree copy of this node for the tree walker.
+  ASTNode* to_node() const;
+
+ private:
+  friend class FlatAST;
+  const FlatNode& node() const { return ast->nodes[index]; }
+  const FlatAST* ast;
+  uint32_t index;
+};
+
+inline NodeRef FlatAST::root(size_t i) const { return NodeRef(this, roots[i]); }
+
 #endif
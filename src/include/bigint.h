@@ -0,0 +1,350 @@
+#ifndef _BIGINTH
+#define _BIGINTH
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Arbitrary precision integer, which the arithmetic of every engine moves to
+// when int64 overflows. The magnitude is kept in 32 bit limbs, least
+// significant first and without leading zeros, so zero has no limbs. Header
+// only like numarray.h, since trt.cpp is compiled to trt.ll on its own.
+class BigInt {
+ public:
+  BigInt() = default;
+  BigInt(int64_t v) : negative(v < 0) {
+    for (uint64_t m = v < 0 ? 0 - (uint64_t)v : v; m; m >>= 32)
+      limbs.push_back((uint32_t)m);
+  }
+
+  // Decimal digits after an optional sign.
+  static bool parse(const std::string& text, BigInt& out) {
+    out = BigInt();
+    size_t start = !text.empty() && (text[0] == '-' || text[0] == '+');
+    if (start == text.size()) return false;
+    for (size_t i = start; i < text.size(); i++) {
+      if (text[i] < '0' || text[i] > '9') return false;
+      out.multiply_add(10, text[i] - '0');
+    }
+    bool negative = text[0] == '-';
+    out.negative = negative && !out.is_zero();
+    return true;
+  }
+
+  bool is_zero() const { return limbs.empty(); }
+  bool fits_int64() const {
+    if (limbs.size() < 2) return true;
+    if (limbs.size() > 2) return false;
+    uint64_t m = magnitude64();
+    return m < (uint64_t(1) << 63) || (negative && m == (uint64_t(1) << 63));
+  }
+  // Only meaningful if fits_int64.
+  int64_t to_int64() const {
+    uint64_t m = magnitude64();
+    return negative ? (int64_t)(0 - m) : (int64_t)m;
+  }
+  double to_double() const {
+    double d = 0;
+    for (size_t i = limbs.size(); i > 0; i--)
+      d = d * 4294967296.0 + limbs[i - 1];
+    return negative ? -d : d;
+  }
+  std::string to_string() const {
+    if (is_zero()) return "0";
+    // Nine digits at a time, least significant first.
+    std::vector<uint32_t> chunks;
+    Limbs rest = limbs;
+    while (!rest.empty()) chunks.push_back(divide_small(rest, 1000000000));
+    std::string text = negative ? "-" : "";
+    text += std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i > 0; i--) {
+      auto chunk = std::to_string(chunks[i - 1]);
+      text += std::string(9 - chunk.size(), '0') + chunk;
+    }
+    return text;
+  }
+
+  friend bool operator==(const BigInt& x, const BigInt& y) {
+    return x.negative == y.negative && x.limbs == y.limbs;
+  }
+  friend int compare(const BigInt& x, const BigInt& y) {
+    if (x.negative != y.negative) return x.negative ? -1 : 1;
+    int order = compare_magnitude(x.limbs, y.limbs);
+    return x.negative ? -order : order;
+  }
+  friend BigInt operator+(const BigInt& x, const BigInt& y) {
+    return add(x, y, y.negative);
+  }
+  friend BigInt operator-(const BigInt& x, const BigInt& y) {
+    return add(x, y, !y.negative);
+  }
+  friend BigInt operator*(const BigInt& x, const BigInt& y) {
+    BigInt result;
+    result.limbs = multiply(x.limbs, y.limbs);
+    result.negative = x.negative != y.negative && !result.is_zero();
+    return result;
+  }
+  // Truncates towards zero, as int64 division does. y must not be zero.
+  friend BigInt operator/(const BigInt& x, const BigInt& y) {
+    BigInt result;
+    result.limbs = divide(x.limbs, y.limbs);
+    result.negative = x.negative != y.negative && !result.is_zero();
+    return result;
+  }
+
+ private:
+  using Limbs = std::vector<uint32_t>;
+  // Below this many limbs multiplying the schoolbook way is faster.
+  static constexpr size_t kKaratsuba = 32;
+
+  uint64_t magnitude64() const {
+    uint64_t m = 0;
+    for (size_t i = limbs.size(); i > 0; i--) m = (m << 32) | limbs[i - 1];
+    return m;
+  }
+  void multiply_add(uint32_t factor, uint32_t addend) {
+    uint64_t carry = addend;
+    for (auto& limb : limbs) {
+      carry += (uint64_t)limb * factor;
+      limb = (uint32_t)carry;
+      carry >>= 32;
+    }
+    if (carry) limbs.push_back((uint32_t)carry);
+  }
+  static void trim(Limbs& x) {
+    while (!x.empty() && !x.back()) x.pop_back();
+  }
+  static int compare_magnitude(const Limbs& x, const Limbs& y) {
+    if (x.size() != y.size()) return x.size() < y.size() ? -1 : 1;
+    for (size_t i = x.size(); i > 0; i--)
+      if (x[i - 1] != y[i - 1]) return x[i - 1] < y[i - 1] ? -1 : 1;
+    return 0;
+  }
+  // x += y << (32 * shift).
+  static void add_to(Limbs& x, const Limbs& y, size_t shift = 0) {
+    if (x.size() < y.size() + shift) x.resize(y.size() + shift);
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < y.size() || carry; i++) {
+      if (i + shift == x.size()) x.push_back(0);
+      carry += (uint64_t)x[i + shift] + (i < y.size() ? y[i] : 0);
+      x[i + shift] = (uint32_t)carry;
+      carry >>= 32;
+    }
+  }
+  // x -= y, where x >= y.
+  static void subtract_from(Limbs& x, const Limbs& y) {
+    int64_t borrow = 0;
+    for (size_t i = 0; i < x.size() && (i < y.size() || borrow); i++) {
+      int64_t d = (int64_t)x[i] - (i < y.size() ? y[i] : 0) - borrow;
+      borrow = d < 0;
+      x[i] = (uint32_t)(d + (borrow << 32));
+    }
+    trim(x);
+  }
+  // x + y, or x - y when y_negative is the sign of x flipped.
+  static BigInt add(const BigInt& x, const BigInt& y, bool y_negative) {
+    BigInt result;
+    if (x.negative == y_negative) {
+      result.limbs = x.limbs;
+      add_to(result.limbs, y.limbs);
+      result.negative = x.negative;
+    } else if (compare_magnitude(x.limbs, y.limbs) >= 0) {
+      result.limbs = x.limbs;
+      subtract_from(result.limbs, y.limbs);
+      result.negative = x.negative;
+    } else {
+      result.limbs = y.limbs;
+      subtract_from(result.limbs, x.limbs);
+      result.negative = y_negative;
+    }
+    if (result.is_zero()) result.negative = false;
+    return result;
+  }
+  static Limbs multiply(const Limbs& x, const Limbs& y) {
+    if (x.empty() || y.empty()) return {};
+    if (std::min(x.size(), y.size()) < kKaratsuba) {
+      Limbs result(x.size() + y.size());
+      for (size_t i = 0; i < x.size(); i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < y.size(); j++) {
+          carry += (uint64_t)x[i] * y[j] + result[i + j];
+          result[i + j] = (uint32_t)carry;
+          carry >>= 32;
+        }
+        result[i + y.size()] = (uint32_t)carry;
+      }
+      trim(result);
+      return result;
+    }
+    // x = x1 B + x0 and y = y1 B + y0, with three products instead of four.
+    size_t half = std::max(x.size(), y.size()) / 2;
+    auto low = [half](const Limbs& v) {
+      Limbs part(v.begin(), v.begin() + std::min(half, v.size()));
+      trim(part);
+      return part;
+    };
+    auto high = [half](const Limbs& v) {
+      return v.size() > half ? Limbs(v.begin() + half, v.end()) : Limbs();
+    };
+    Limbs x0 = low(x), x1 = high(x), y0 = low(y), y1 = high(y);
+    Limbs z0 = multiply(x0, y0);
+    Limbs z2 = multiply(x1, y1);
+    add_to(x0, x1);
+    add_to(y0, y1);
+    Limbs z1 = multiply(x0, y0);
+    subtract_from(z1, z0);
+    subtract_from(z1, z2);
+    Limbs result = z0;
+    add_to(result, z1, half);
+    add_to(result, z2, 2 * half);
+    trim(result);
+    return result;
+  }
+  // x /= divisor, returning the remainder.
+  static uint32_t divide_small(Limbs& x, uint32_t divisor) {
+    uint64_t rest = 0;
+    for (size_t i = x.size(); i > 0; i--) {
+      rest = (rest << 32) | x[i - 1];
+      x[i - 1] = (uint32_t)(rest / divisor);
+      rest %= divisor;
+    }
+    trim(x);
+    return (uint32_t)rest;
+  }
+  // Knuth's algorithm D, estimating each quotient limb from the top two limbs
+  // of the remainder after shifting the divisor's top bit into place.
+  static Limbs divide(const Limbs& u, const Limbs& v) {
+    if (compare_magnitude(u, v) < 0) return {};
+    if (v.size() == 1) {
+      Limbs q = u;
+      divide_small(q, v[0]);
+      return q;
+    }
+    size_t n = v.size(), m = u.size() - n;
+    int shift = __builtin_clz(v.back());
+    // The bits of limb i - 1 of x that shifting moves into limb i.
+    auto carried = [shift](const Limbs& x, size_t i) {
+      return shift && i ? x[i - 1] >> (32 - shift) : 0;
+    };
+    Limbs vn(n), un(u.size() + 1);
+    for (size_t i = 0; i < n; i++) vn[i] = (v[i] << shift) | carried(v, i);
+    for (size_t i = 0; i < u.size(); i++)
+      un[i] = (u[i] << shift) | carried(u, i);
+    un[u.size()] = carried(u, u.size());
+
+    Limbs q(m + 1);
+    for (size_t j = m + 1; j-- > 0;) {
+      uint64_t top = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+      uint64_t qhat = top / vn[n - 1];
+      uint64_t rhat = top % vn[n - 1];
+      while (qhat >> 32 ||
+             qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+        qhat--;
+        rhat += vn[n - 1];
+        if (rhat >> 32) break;
+      }
+      int64_t borrow = 0, t;
+      for (size_t i = 0; i < n; i++) {
+        uint64_t p = qhat * vn[i];
+        t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+        un[i + j] = (uint32_t)t;
+        borrow = (int64_t)(p >> 32) - (t >> 32);
+      }
+      t = (int64_t)un[j + n] - borrow;
+      un[j + n] = (uint32_t)t;
+      q[j] = (uint32_t)qhat;
+      // qhat was one too many, add the divisor back.
+      if (t < 0) {
+        q[j]--;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; i++) {
+          carry += (uint64_t)un[i + j] + vn[i];
+          un[i + j] = (uint32_t)carry;
+          carry >>= 32;
+        }
+        un[j + n] += (uint32_t)carry;
+      }
+    }
+    trim(q);
+    return q;
+  }
+
+  bool negative = false;
+  Limbs limbs;
+};
+
+// Exact fold of + - * or / over integers, for the arithmetic builtins. It
+// stays on int64 and only moves to a BigInt once a step overflows. Division
+// truncates towards zero.
+class IntegerFold {
+ public:
+  explicit IntegerFold(int64_t first) : small(first) {}
+  explicit IntegerFold(const BigInt& first) : big(first), wide(true) {}
+
+  // Returns an error message, or null.
+  const char* apply(char op, int64_t y) {
+    if (!wide) {
+      int64_t result;
+      bool overflow = false;
+      switch (op) {
+        case '+':
+          overflow = __builtin_add_overflow(small, y, &result);
+          break;
+        case '-':
+          overflow = __builtin_sub_overflow(small, y, &result);
+          break;
+        case '*':
+          overflow = __builtin_mul_overflow(small, y, &result);
+          break;
+        case '/':
+          if (!y) return "Division by zero";
+          overflow = small == INT64_MIN && y == -1;
+          if (!overflow) result = small / y;
+          break;
+        default:
+          return "Invalid operation";
+      }
+      if (!overflow) {
+        small = result;
+        return nullptr;
+      }
+    }
+    return apply(op, BigInt(y));
+  }
+  const char* apply(char op, const BigInt& y) {
+    if (!wide) {
+      big = BigInt(small);
+      wide = true;
+    }
+    switch (op) {
+      case '+':
+        big = big + y;
+        break;
+      case '-':
+        big = big - y;
+        break;
+      case '*':
+        big = big * y;
+        break;
+      case '/':
+        if (y.is_zero()) return "Division by zero";
+        big = big / y;
+        break;
+      default:
+        return "Invalid operation";
+    }
+    return nullptr;
+  }
+
+  // Whether the result is an int64, which integer() returns, or else result().
+  bool fits() const { return !wide || big.fits_int64(); }
+  int64_t integer() const { return wide ? big.to_int64() : small; }
+  const BigInt& result() const { return big; }
+
+ private:
+  int64_t small = 0;
+  BigInt big;
+  bool wide = false;
+};
+#endif
@@ -1,10 +1,12 @@
 #ifndef _COMMONH
 #define _COMMONH
 #include <exception>
+#include <functional>
 #include <list>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 
 #include "ast.h"
 
@@ -12,17 +14,37 @@ class Inpiler {
  public:
   virtual std::string handle_line(std::string str) = 0;
   virtual ~Inpiler() {}
-  bool is_balanced(std::string& line) {
-    int count = 0;
-    for (auto c : line) {
-      if (c == '(')
-        count++;
-      else if (c == ')')
-        count--;
-    }
-    return (count <= 0);
-  }
   void load_granthalaya();
+  // Runs the forms of the script at path as they are read. Regular files are
+  // mapped, anything else like a pipe is read in chunks. Returns false if path
+  // can't be opened.
+  bool load_file(const std::string& path);
+};
+
+// Splits text into top level forms, one byte at a time, so that the text can
+// arrive in pieces of any size and a form is handed on as soon as it is
+// complete. Parens inside strings don't count, and lines starting with '#'
+// are comments, which are left out of the forms.
+class FormReader {
+ public:
+  using Emit = std::function<void(const std::string&)>;
+  void feed(std::string_view text, const Emit& emit);
+  // Ends the input, handing on a symbol or number at its very end. Returns
+  // false if a form is left unfinished.
+  bool finish(const Emit& emit);
+
+ private:
+  void complete(const Emit& emit);
+  // The form read so far, without comments.
+  std::string form;
+  size_t depth = 0;
+  // A symbol or number outside of any list.
+  bool in_atom = false;
+  bool in_string = false;
+  bool escaped = false;
+  bool in_comment = false;
+  // Only blanks since the start of the line.
+  bool line_start = true;
 };
 
 class TodaluException : public std::runtime_error {
@@ -31,9 +53,6 @@ class TodaluException : public std::runtime_error {
 };
 
 bool is_comment(std::string& line);
-std::list<std::string> tokenizer(std::string& str);
-std::list<ASTNode*> create_ast(std::list<std::string>& tokens,
-                               bool closing_paren_allow = false);
-
-void free_ast(std::list<ASTNode*>& list);
+// Appends the forms read from src to ast.
+void read_forms(std::string_view src, FlatAST& ast);
 #endif
@@ -1,40 +1,153 @@
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/Target/TargetMachine.h>
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "common.h"
+
+// Type of an expression as far as the compiler can tell without running it.
+// Expressions of a known type are computed unboxed.
+enum class StaticType { Unknown, Bool, Integer, Decimal };
+
 class Compiler : public Inpiler {
  public:
-  Compiler(std::string s);
+  // jit runs the program in process when the compiler is destroyed, instead
+  // of printing it linked with trt.ll. level is the optimization level, 0 to
+  // 3, of the pipeline run over the module before either.
+  //
+  // Every compiler has its own LLVM context and symbols, and runs the program
+  // in a runtime of its own, so compilers on different threads don't share
+  // any state.
+  Compiler(std::string s, bool jit = false, unsigned level = 0);
   ~Compiler();
   std::string handle_line(std::string str);
 
  private:
-  llvm::Value* generate_code(ASTNode* node);
-  llvm::Value* generate_arithmetic(char op, ListNode* listnode);
-  llvm::Value* generate_print(ASTNode* node, char end);
+  // An evaluated expression, unboxed unless its type is Unknown. Integer
+  // arithmetic on operands that aren't known has an i1 integer as well, which
+  // is false if they weren't integers or the result overflowed. Then node
+  // holds the result from the runtime instead of value, and is null
+  // otherwise.
+  struct Operand {
+    llvm::Value* value;
+    StaticType type;
+    llvm::Value* integer = nullptr;
+    llvm::Value* node = nullptr;
+  };
+  using Emitter = std::function<llvm::Value*(std::vector<llvm::Value*>&)>;
+  // Version of a lambda defined with def that takes its arguments as i64 and
+  // returns an i64 or i1 along with an i1 that is true if the result
+  // overflowed or divided by zero. Only lambdas whose body computes on
+  // integers and booleans, calling nothing but themselves and other
+  // specialized lambdas, have one. They can't have side effects, so the
+  // lambdas they call stay bound to the same functions while they run.
+  struct Specialization {
+    llvm::Function* fun = nullptr;
+    StaticType result = StaticType::Unknown;
+    // Symbols of the lambdas it calls, directly or not, with the function
+    // each must still be bound to for it to be used.
+    std::map<std::string, llvm::Function*> callees;
+    // True while the generic body runs because the specialization failed.
+    llvm::GlobalVariable* retrying = nullptr;
+  };
+  // Lambda being specialized. params maps the parameters to the i64
+  // arguments, which are null while inferring.
+  struct PureLambda {
+    llvm::Function* generic;
+    std::map<std::string, llvm::Value*> params;
+    Specialization specialization;
+    llvm::BasicBlock* failed = nullptr;
+    // Calls to itself are expanded in place up to depth levels deep, as long
+    // as the nodes expanded stay within budget.
+    const NodeRef* arglist = nullptr;
+    const NodeRef* body = nullptr;
+    size_t size = 0;
+    unsigned depth = 0;
+    size_t budget = 0;
+  };
+  llvm::Value* generate_code(NodeRef node);
+  Operand generate_operand(NodeRef node);
+  llvm::Value* generate_unboxed(NodeRef node, StaticType type);
+  llvm::Value* generate_native(char op, std::vector<llvm::Value*> values);
+  llvm::Value* generate_checked(char op,
+                                const std::vector<llvm::Value*>& values,
+                                llvm::Value*& failed);
+  llvm::Value* generate_guarded(std::vector<Operand> operands,
+                                const Emitter& fast, const Emitter& slow);
+  llvm::Value* generate_condition(NodeRef node);
+  llvm::Value* box(const Operand& operand);
+  Operand generate_arithmetic(char op, NodeRef listnode);
+  llvm::Value* generate_print(NodeRef node, char end);
   llvm::Value* generate_irnode(uint32_t type, int64_t value);
   llvm::Value* generate_irnode(uint32_t type, llvm::Value* value);
-  llvm::Value* generate_irnode(ASTNode* node);
-  llvm::Value* generate_define(SymbolNode* symnode, ASTNode* valuenode);
-  llvm::Value* generate_isequal(ASTNode* oprnd1, ASTNode* oprnd2);
-  llvm::Value* generate_istype(ASTNode* oprnd1, uint32_t oprnd2);
-  llvm::Value* generate_greater(ASTNode* node1, ASTNode* node2);
-  llvm::Value* generate_exit(ASTNode* node);
-  llvm::Value* generate_if(ASTNode* cond, ASTNode* ifbody, ASTNode* elsebody);
-  llvm::Value* generate_car(ASTNode* node);
-  llvm::Value* generate_cdr(ASTNode* node);
-  llvm::Value* generate_cons(ASTNode* node, ASTNode* listnode);
-  llvm::Value* generate_lambda_call(ListNode* node);
-  llvm::Value* generate_lambda(LambdaNode* node);
+  llvm::Value* generate_irnode(NodeRef node);
+  llvm::Value* generate_symbol(int64_t id);
+  llvm::Value* generate_define(NodeRef symnode, NodeRef valuenode);
+  llvm::Value* generate_define(llvm::Value* symbol, llvm::Value* value);
+  llvm::Value* generate_comparison(const std::string& fun, NodeRef oprnd1,
+                                   NodeRef oprnd2, bool condition);
+  llvm::Value* generate_istype(NodeRef oprnd1, uint32_t oprnd2);
+  llvm::Value* generate_exit(NodeRef node);
+  llvm::Value* generate_if(NodeRef cond, NodeRef ifbody, NodeRef elsebody,
+                           StaticType type = StaticType::Unknown);
+  llvm::Value* generate_truth(llvm::Value* node);
+  llvm::Value* generate_car(NodeRef node);
+  llvm::Value* generate_cdr(NodeRef node);
+  llvm::Value* generate_cons(NodeRef node, NodeRef listnode);
+  llvm::Value* generate_lambda_call(NodeRef node);
+  llvm::Value* generate_lambda(NodeRef arglist, NodeRef body,
+                               const std::string& name = "");
+  StaticType infer_pure(NodeRef node, PureLambda& lambda);
+  void specialize(NodeRef arglist, NodeRef body, llvm::Function* generic);
+  llvm::Value* generate_pure(NodeRef node, PureLambda& lambda);
+  llvm::Value* generate_specialized_call(llvm::Function* generic);
   llvm::Value* generate_exception();
-  llvm::Value* generate_string(StringNode* node);
+  llvm::Value* generate_runtime_call(const std::string& fname,
+                                    NodeRef listnode);
+  llvm::Value* generate_runtime_call(const std::string& fname,
+                                    std::vector<llvm::Value*> operands);
+  llvm::Value* generate_append(NodeRef listnode);
+  llvm::Value* generate_optional_call(const std::string& fname,
+                                     NodeRef listnode);
+  llvm::Value* generate_reduce(NodeRef node, char op);
+  llvm::Value* generate_time(NodeRef node);
+  llvm::Value* generate_string(NodeRef node);
+  llvm::Function* runtime_function(const std::string& name,
+                                   llvm::FunctionType* type);
+  // Number the runtime knows the symbol of node by. Only create assigns
+  // numbers to symbols that don't have one yet.
+  int64_t convert_sym(NodeRef node, bool create = false);
+  void generate_safepoint();
+  void add_shadow_frame(llvm::Function* fun);
+  void optimize(llvm::TargetMachine* machine);
+  void run_jit();
   std::string mfilename;
+  bool mjit;
+  unsigned mlevel;
+  // Handed over to the jit with the module.
+  std::unique_ptr<llvm::LLVMContext> pcontext;
+  llvm::LLVMContext& context;
+  std::map<std::string, int64_t> msymbolIds;
+  std::map<int64_t, llvm::GlobalVariable*> msymbols;
   llvm::Module* pmodule;
   llvm::IRBuilder<>* pbuilder;
   llvm::Function* pfun;
   llvm::StructType* irnode;
+  llvm::StructType* lambdaStruct;
+  // Arguments of the lambda being compiled that its body refers to directly,
+  // by symbol.
+  std::map<std::string, llvm::Value*> mparams;
+  // Function of the lambda last defined as each symbol.
+  std::map<std::string, llvm::Function*> mlambdas;
+  // Keyed by the function of the lambda.
+  std::map<llvm::Function*, Specialization> mspecialized;
   std::unique_ptr<llvm::Module> originalModule;
   llvm::Value* mret;
   llvm::Function* mainFun;
+  // Nodes of the form being compiled, reused for every line.
+  FlatAST form;
 };
@@ -1,6 +1,35 @@
 #ifndef _EVALH
 #define _EVALH
+#include <cstdint>
+#include <deque>
+#include <list>
+
 #include "ast.h"
-ASTNode* eval_tree(ASTNode* node);
-void free_env();
+
+// Bindings of the tree walker, a stack of values for every symbol id whose
+// front is the current value. Each interpreter evaluates in an env of its
+// own, so interpreters on different threads don't share any state. The env
+// owns the values bound in it.
+class Environment {
+ public:
+  // The calls pmap, pfilter and preduce spread over the pool bind in an env
+  // whose parent is the env of the caller, which they only read.
+  explicit Environment(const Environment* p = nullptr) : parent(p) {}
+  ~Environment();
+  Environment(const Environment&) = delete;
+  Environment& operator=(const Environment&) = delete;
+  // Value bound to id in this env or its parents, or null.
+  ASTNode* lookup(uint32_t id) const;
+  // Values bound to id in this env.
+  std::list<ASTNode*>& bindings_of(uint32_t id);
+  bool in_worker() const { return parent; }
+  // Symbol ids past this one are unbound.
+  size_t size() const { return bindings.size(); }
+
+ private:
+  const Environment* parent;
+  std::deque<std::list<ASTNode*>> bindings;
+};
+
+ASTNode* eval_tree(ASTNode* node, Environment& env);
 #endif
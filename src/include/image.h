@@ -0,0 +1,24 @@
+#ifndef _IMAGEH
+#define _IMAGEH
+#include <string>
+
+#include "ast.h"
+#include "value.h"
+
+// An image holds the global bindings of an interpreter as already read
+// (def symbol value) forms. Values that aren't self-evaluating are wrapped in
+// quote, lambdas are saved as their lambda form, arrays as an array call and
+// lists that hold either as the conses that build them, so evaluating the
+// forms in order restores every binding on either engine.
+//
+// Appends the form that rebinds id to value. Throws if value holds a closure
+// over arguments of enclosing lambdas, which no form recreates.
+void add_binding(uint32_t id, const Value& value, FlatAST& forms);
+void add_binding(uint32_t id, const ASTNode* value, FlatAST& forms);
+
+// Writes the root forms of forms to path.
+void write_image(const std::string& path, const FlatAST& forms);
+// Maps the image at path into memory and replaces forms with its forms, with
+// their symbols interned in this process.
+void read_image(const std::string& path, FlatAST& forms);
+#endif
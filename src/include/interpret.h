@@ -2,9 +2,31 @@
 
 #include "ast.h"
 #include "common.h"
+#include "eval.h"
+#include "vm.h"
 
 class Interpreter : public Inpiler {
  public:
-  ~Interpreter();
+  // use_walker evaluates with the tree walker in eval.cpp instead of
+  // compiling each form to bytecode for the vm. dynamic_scope makes the vm
+  // resolve symbols at runtime through its globals like the tree walker does.
+  //
+  // Every interpreter has bindings of its own, so several of them can run in
+  // one process, each on a thread of its own.
+  Interpreter(bool use_walker = false, bool dynamic_scope = false)
+      : walker(use_walker), dynamic(dynamic_scope) {}
   std::string handle_line(std::string str);
+  // Saves the global bindings to an image, or restores the bindings saved in
+  // one. See image.h. Nothing is written if a binding can't be saved.
+  void save_image(const std::string& path);
+  void load_image(const std::string& path);
+
+ private:
+  std::string run(NodeRef node);
+  bool walker;
+  bool dynamic;
+  Environment env;
+  Globals globals;
+  // Nodes of the form being evaluated, reused for every line.
+  FlatAST form;
 };
@@ -0,0 +1,117 @@
+#ifndef _MEMOH
+#define _MEMOH
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "numarray.h"
+
+// Caches for lambdas wrapped by memo, shared by the tree walker, the vm and
+// the compiled runtime. Like numarray.h this is header only, so that trt.cpp
+// still compiles on its own.
+
+// Number of results a memoized lambda keeps when memo isn't given one.
+constexpr size_t kMemoCapacity = 4096;
+
+// Encoding of the arguments of a call, equal for arguments that are equal as
+// values. Each engine writes a tag for the type of every value followed by
+// its contents, with lengths before anything of variable size.
+class MemoKey {
+ public:
+  void tag(char t) { bytes.push_back(t); }
+  void integer(int64_t v) { append(&v, sizeof(v)); }
+  void decimal(double v) { append(&v, sizeof(v)); }
+  void pointer(const void* p) { append(&p, sizeof(p)); }
+  void text(const char* s, size_t size) {
+    integer(size);
+    bytes.append(s, size);
+  }
+  void text(const std::string& s) { text(s.data(), s.size()); }
+  void array(const NumArray& a) {
+    tag(a.decimal ? 'd' : 'i');
+    integer(a.size());
+    if (a.decimal)
+      append(a.decimals.data(), a.decimals.size() * sizeof(double));
+    else
+      append(a.ints.data(), a.ints.size() * sizeof(int64_t));
+  }
+  std::string bytes;
+
+ private:
+  void append(const void* p, size_t size) {
+    bytes.append(static_cast<const char*>(p), size);
+  }
+};
+
+// Results of a memoized lambda by the key of their arguments. Once there are
+// capacity of them the least recently used one is evicted, and a capacity of
+// 0 keeps every result. pmap may call a lambda from several threads, so the
+// table takes a lock.
+template <class V>
+class MemoTable {
+ public:
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t size;
+    uint64_t capacity;
+  };
+
+  explicit MemoTable(size_t c) : capacity(c) {}
+  // Calls f with the result and returns true on a hit, which makes it the
+  // most recently used result.
+  template <class F>
+  bool find(const std::string& key, F f) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      misses++;
+      return false;
+    }
+    hits++;
+    entries.splice(entries.begin(), entries, it->second);
+    f(it->second->second);
+    return true;
+  }
+  void insert(const std::string& key, V value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      it->second->second = std::move(value);
+      entries.splice(entries.begin(), entries, it->second);
+      return;
+    }
+    entries.emplace_front(key, std::move(value));
+    index.emplace(key, entries.begin());
+    if (capacity && entries.size() > capacity) {
+      index.erase(entries.back().first);
+      entries.pop_back();
+    }
+  }
+  template <class F>
+  void for_each(F f) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& entry : entries) f(entry.second);
+  }
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {hits, misses, entries.size(), capacity};
+  }
+  const size_t capacity;
+
+ private:
+  std::mutex mutex;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  // Most recently used first.
+  std::list<std::pair<std::string, V>> entries;
+  std::unordered_map<std::string,
+                     typename std::list<std::pair<std::string, V>>::iterator>
+      index;
+};
+#endif
@@ -0,0 +1,418 @@
+#ifndef _NUMARRAYH
+#define _NUMARRAYH
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Typed numeric array shared by the tree walker, the vm and the compiled
+// runtime. The elements are either all int64 or all double, stored
+// contiguously. Arrays are immutable once built.
+struct NumArray {
+  bool decimal = false;
+  std::vector<int64_t> ints;
+  std::vector<double> decimals;
+  size_t size() const { return decimal ? decimals.size() : ints.size(); }
+};
+
+// Scalar operand or result of an array operation.
+struct Number {
+  bool decimal = false;
+  int64_t integer = 0;
+  double real = 0;
+  double as_double() const { return decimal ? real : integer; }
+};
+
+// Either an array or, when array is null, a scalar that is broadcast.
+struct Operand {
+  const NumArray* array = nullptr;
+  Number scalar;
+};
+
+// The element-wise kernels are plain loops over contiguous storage that the
+// compiler vectorizes. Reducing doubles can't be vectorized without
+// reordering the additions, so those kernels use SSE2 lanes explicitly when
+// available, with a scalar loop for the remainder and as the fallback.
+//
+// The int64 kernels wrap in uint64_t, which is defined, and report whether
+// any element overflowed. Integer reductions accumulate in __int128.
+namespace kernels {
+
+template <class T, class Out, class F>
+void zip(const T* a, bool a_scalar, const T* b, bool b_scalar, Out* out,
+         size_t n, F f) {
+  if (a_scalar) {
+    const T x = *a;
+    for (size_t i = 0; i < n; i++) out[i] = f(x, b[i]);
+  } else if (b_scalar) {
+    const T y = *b;
+    for (size_t i = 0; i < n; i++) out[i] = f(a[i], y);
+  } else {
+    for (size_t i = 0; i < n; i++) out[i] = f(a[i], b[i]);
+  }
+}
+
+// Returns true if an int64 element overflowed. Divisors must not be zero.
+inline bool arith(char op, const int64_t* a, bool a_scalar, const int64_t* b,
+                  bool b_scalar, int64_t* out, size_t n) {
+  bool overflow = false;
+  switch (op) {
+    case '+':
+      zip(a, a_scalar, b, b_scalar, out, n, [&overflow](int64_t x, int64_t y) {
+        int64_t r = (uint64_t)x + (uint64_t)y;
+        overflow |= ((x ^ r) & (y ^ r)) < 0;
+        return r;
+      });
+      break;
+    case '-':
+      zip(a, a_scalar, b, b_scalar, out, n, [&overflow](int64_t x, int64_t y) {
+        int64_t r = (uint64_t)x - (uint64_t)y;
+        overflow |= ((x ^ y) & (x ^ r)) < 0;
+        return r;
+      });
+      break;
+    case '*':
+      zip(a, a_scalar, b, b_scalar, out, n, [&overflow](int64_t x, int64_t y) {
+        int64_t r;
+        overflow |= __builtin_mul_overflow(x, y, &r);
+        return r;
+      });
+      break;
+    case '/':
+      zip(a, a_scalar, b, b_scalar, out, n, [&overflow](int64_t x, int64_t y) {
+        if (y != -1) return x / y;
+        overflow |= x == INT64_MIN;
+        return (int64_t)(0 - (uint64_t)x);
+      });
+      break;
+  }
+  return overflow;
+}
+
+template <class T>
+bool arith(char op, const T* a, bool a_scalar, const T* b, bool b_scalar,
+           T* out, size_t n) {
+  static_assert(std::is_floating_point<T>::value);
+  switch (op) {
+    case '+':
+      zip(a, a_scalar, b, b_scalar, out, n, [](T x, T y) { return x + y; });
+      break;
+    case '-':
+      zip(a, a_scalar, b, b_scalar, out, n, [](T x, T y) { return x - y; });
+      break;
+    case '*':
+      zip(a, a_scalar, b, b_scalar, out, n, [](T x, T y) { return x * y; });
+      break;
+    case '/':
+      zip(a, a_scalar, b, b_scalar, out, n, [](T x, T y) { return x / y; });
+      break;
+  }
+  return false;
+}
+
+// '>' or '=', producing 1 or 0 per element.
+template <class T>
+void compare(char op, const T* a, bool a_scalar, const T* b, bool b_scalar,
+             int64_t* out, size_t n) {
+  if (op == '>')
+    zip(a, a_scalar, b, b_scalar, out, n,
+        [](T x, T y) { return (int64_t)(x > y); });
+  else
+    zip(a, a_scalar, b, b_scalar, out, n,
+        [](T x, T y) { return (int64_t)(x == y); });
+}
+
+inline __int128 sum(const int64_t* a, size_t n) {
+  __int128 total = 0;
+  for (size_t i = 0; i < n; i++) total += a[i];
+  return total;
+}
+
+inline double sum(const double* a, size_t n) {
+  size_t i = 0;
+  double total = 0;
+#ifdef __SSE2__
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+    acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  total = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) total += a[i];
+  return total;
+}
+
+// Returns true if the total overflowed __int128.
+inline bool dot(const int64_t* a, const int64_t* b, size_t n, __int128& total) {
+  total = 0;
+  bool overflow = false;
+  for (size_t i = 0; i < n; i++)
+    overflow |= __builtin_add_overflow(total, (__int128)a[i] * b[i], &total);
+  return overflow;
+}
+
+inline double dot(const double* a, const double* b, size_t n) {
+  size_t i = 0;
+  double total = 0;
+#ifdef __SSE2__
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0,
+                      _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    acc1 = _mm_add_pd(
+        acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  total = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) total += a[i] * b[i];
+  return total;
+}
+
+// n must be at least 1.
+template <class T>
+T min(const T* a, size_t n) {
+  T m = a[0];
+  for (size_t i = 1; i < n; i++) m = a[i] < m ? a[i] : m;
+  return m;
+}
+
+template <class T>
+T max(const T* a, size_t n) {
+  T m = a[0];
+  for (size_t i = 1; i < n; i++) m = a[i] > m ? a[i] : m;
+  return m;
+}
+
+inline bool prefix_sum(const int64_t* a, int64_t* out, size_t n) {
+  int64_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (__builtin_add_overflow(total, a[i], &total)) return true;
+    out[i] = total;
+  }
+  return false;
+}
+
+inline bool prefix_sum(const double* a, double* out, size_t n) {
+  double total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += a[i];
+    out[i] = total;
+  }
+  return false;
+}
+
+}  // namespace kernels
+
+// The operations below return an error message, or nullptr after filling in
+// out. Each engine raises the message with its own exception type.
+namespace numarray {
+
+// Arrays hold int64 elements only, so unlike scalar arithmetic, which moves
+// to a big integer, integer array operations that overflow fail.
+constexpr const char* kOverflow = "Integer overflow in array arithmetic";
+
+inline bool fits_int64(__int128 value) {
+  return value >= INT64_MIN && value <= INT64_MAX;
+}
+
+inline std::vector<double> to_decimals(const NumArray& a) {
+  if (a.decimal) return a.decimals;
+  return std::vector<double>(a.ints.begin(), a.ints.end());
+}
+
+// out may alias x or y.
+inline const char* apply(char op, const Number& x, const Number& y,
+                         Number& out) {
+  Number result;
+  if (op == '>' || op == '=') {
+    result.integer = op == '>' ? x.as_double() > y.as_double()
+                               : x.as_double() == y.as_double();
+  } else if (x.decimal || y.decimal) {
+    result.decimal = true;
+    double a = x.as_double();
+    double b = y.as_double();
+    kernels::arith(op, &a, true, &b, true, &result.real, 1);
+  } else {
+    if (op == '/' && y.integer == 0) return "Division by zero";
+    if (kernels::arith(op, &x.integer, true, &y.integer, true, &result.integer,
+                       1))
+      return kOverflow;
+  }
+  out = result;
+  return nullptr;
+}
+
+// op is one of + - * / > =, at least one of x and y must be an array.
+inline const char* elementwise(char op, const Operand& x, const Operand& y,
+                               NumArray& out) {
+  if (x.array && y.array && x.array->size() != y.array->size())
+    return "Array sizes don't match";
+  size_t n = x.array ? x.array->size() : y.array->size();
+  bool decimal = (x.array ? x.array->decimal : x.scalar.decimal) ||
+                 (y.array ? y.array->decimal : y.scalar.decimal);
+  bool compare = op == '>' || op == '=';
+  out = NumArray();
+  out.decimal = decimal && !compare;
+  if (decimal) {
+    std::vector<double> xs, ys;
+    double xv = x.scalar.as_double();
+    double yv = y.scalar.as_double();
+    const double* a = &xv;
+    const double* b = &yv;
+    if (x.array) {
+      if (!x.array->decimal) xs = to_decimals(*x.array);
+      a = x.array->decimal ? x.array->decimals.data() : xs.data();
+    }
+    if (y.array) {
+      if (!y.array->decimal) ys = to_decimals(*y.array);
+      b = y.array->decimal ? y.array->decimals.data() : ys.data();
+    }
+    if (compare) {
+      out.ints.resize(n);
+      kernels::compare(op, a, !x.array, b, !y.array, out.ints.data(), n);
+    } else {
+      out.decimals.resize(n);
+      kernels::arith(op, a, !x.array, b, !y.array, out.decimals.data(), n);
+    }
+    return nullptr;
+  }
+  const int64_t* a = x.array ? x.array->ints.data() : &x.scalar.integer;
+  const int64_t* b = y.array ? y.array->ints.data() : &y.scalar.integer;
+  out.ints.resize(n);
+  if (compare) {
+    kernels::compare(op, a, !x.array, b, !y.array, out.ints.data(), n);
+    return nullptr;
+  }
+  auto divisors = b + (y.array ? n : 1);
+  if (op == '/' && std::find(b, divisors, 0) != divisors)
+    return "Division by zero";
+  if (kernels::arith(op, a, !x.array, b, !y.array, out.ints.data(), n))
+    return kOverflow;
+  return nullptr;
+}
+
+// Folds op over operands from left to right, the way + - * / do. At least
+// one operand must be an array.
+inline const char* fold(char op, const std::vector<Operand>& operands,
+                        NumArray& out) {
+  NumArray acc;
+  Operand current = operands[0];
+  for (size_t i = 1; i < operands.size(); i++) {
+    if (!current.array && !operands[i].array) {
+      if (auto error = apply(op, current.scalar, operands[i].scalar,
+                             current.scalar))
+        return error;
+      continue;
+    }
+    NumArray next;
+    if (auto error = elementwise(op, current, operands[i], next)) return error;
+    acc = std::move(next);
+    current.array = &acc;
+  }
+  out = std::move(acc);
+  return nullptr;
+}
+
+// Decimal if any element is.
+inline NumArray from_numbers(const std::vector<Number>& numbers) {
+  NumArray out;
+  for (auto& number : numbers) out.decimal |= number.decimal;
+  for (auto& number : numbers) {
+    if (out.decimal)
+      out.decimals.push_back(number.as_double());
+    else
+      out.ints.push_back(number.integer);
+  }
+  return out;
+}
+
+inline NumArray arange(const Number& start, const Number& end) {
+  NumArray out;
+  if (!start.decimal && !end.decimal) {
+    for (int64_t i = start.integer; i < end.integer; i++) out.ints.push_back(i);
+    return out;
+  }
+  out.decimal = true;
+  for (double i = start.as_double(); i < end.as_double(); i++)
+    out.decimals.push_back(i);
+  return out;
+}
+
+// op is 's' for sum, '<' for min and '>' for max.
+inline const char* reduce(char op, const NumArray& a, Number& out) {
+  out = Number();
+  out.decimal = a.decimal;
+  if (op != 's' && a.size() == 0) return "expects a non-empty array";
+  if (a.decimal) {
+    auto p = a.decimals.data();
+    out.real = op == 's'   ? kernels::sum(p, a.size())
+               : op == '<' ? kernels::min(p, a.size())
+                           : kernels::max(p, a.size());
+  } else if (op == 's') {
+    auto total = kernels::sum(a.ints.data(), a.size());
+    if (!fits_int64(total)) return "overflows int64";
+    out.integer = total;
+  } else {
+    auto p = a.ints.data();
+    out.integer =
+        op == '<' ? kernels::min(p, a.size()) : kernels::max(p, a.size());
+  }
+  return nullptr;
+}
+
+inline const char* dot(const NumArray& a, const NumArray& b, Number& out) {
+  if (a.size() != b.size()) return "Array sizes don't match";
+  out = Number();
+  if (!a.decimal && !b.decimal) {
+    __int128 total;
+    if (kernels::dot(a.ints.data(), b.ints.data(), a.size(), total) ||
+        !fits_int64(total))
+      return kOverflow;
+    out.integer = total;
+    return nullptr;
+  }
+  out.decimal = true;
+  auto x = to_decimals(a);
+  auto y = to_decimals(b);
+  out.real = kernels::dot(x.data(), y.data(), a.size());
+  return nullptr;
+}
+
+inline const char* prefix_sum(const NumArray& a, NumArray& out) {
+  out = NumArray();
+  out.decimal = a.decimal;
+  if (a.decimal) {
+    out.decimals.resize(a.size());
+    kernels::prefix_sum(a.decimals.data(), out.decimals.data(), a.size());
+  } else {
+    out.ints.resize(a.size());
+    if (kernels::prefix_sum(a.ints.data(), out.ints.data(), a.size()))
+      return kOverflow;
+  }
+  return nullptr;
+}
+
+inline const char* at(const NumArray& a, int64_t index, Number& out) {
+  if (index < 0 || (size_t)index >= a.size()) return "Index out of range";
+  out = Number();
+  out.decimal = a.decimal;
+  if (a.decimal)
+    out.real = a.decimals[index];
+  else
+    out.integer = a.ints[index];
+  return nullptr;
+}
+
+}  // namespace numarray
+#endif
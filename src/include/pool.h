@@ -0,0 +1,30 @@
+#ifndef _POOLH
+#define _POOLH
+#include <cstddef>
+#include <functional>
+
+// Threads that pmap, pfilter and preduce spread their work over. The pool
+// starts on first use, with the number of threads set by -t or one per core.
+namespace pool {
+
+// Has to be called before the first parallel_for. 0 is one per core, and 1
+// runs everything on the calling thread.
+void set_threads(size_t count);
+size_t threads();
+
+// Whether the calling thread is one of the pool's.
+bool in_worker();
+
+// Calls f(begin, end) on ranges covering [0, n) and returns when all of them
+// are done. Every worker starts on ranges of its own and steals ranges from
+// the others once it runs out, so uneven work still spreads. Called from a
+// worker, without more than one thread, while profiling, which follows a
+// single thread, or while the pool runs the ranges of another thread, it runs
+// f(0, n) instead.
+//
+// After a range throws no more ranges are started, and the first exception
+// is rethrown once the ones already started are done.
+void parallel_for(size_t n, const std::function<void(size_t, size_t)>& f);
+
+}  // namespace pool
+#endif
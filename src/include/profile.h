@@ -0,0 +1,69 @@
+#ifndef _PROFILEH
+#define _PROFILEH
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Set by --profile. The evaluators check it before calling into the profiler,
+// so profiling costs a branch per call when it is off.
+extern bool gProfiling;
+
+namespace profile {
+
+// Clock, allocation count and, where perf_event_open is allowed, hardware
+// counters at some point of the run.
+struct Counters {
+  int64_t ns = 0;
+  uint64_t allocations = 0;
+  uint64_t cycles = 0;
+  uint64_t cache_misses = 0;
+};
+Counters read();
+
+// Turns profiling on and prints the report to stderr at exit.
+void start();
+// Calls of the builtin or the lambda defined as symbol id, or
+// kAnonymousLambda. Calls nest, leave ends the innermost one.
+void enter(uint32_t id);
+void leave();
+// Number of calls in progress, and ending the calls made after depth was
+// taken when they are cut short by an exception.
+size_t depth();
+void unwind(size_t depth);
+
+// Ends the innermost call when it goes out of scope.
+class Scope {
+ public:
+  explicit Scope(uint32_t id) : active(gProfiling) {
+    if (active) enter(id);
+  }
+  ~Scope() {
+    if (active) leave();
+  }
+
+ private:
+  bool active;
+};
+
+// For (time expr). Prints what was spent since construction to stderr.
+// Allocations are counted while one exists.
+class Timer {
+ public:
+  Timer();
+  Timer(const Timer& timer);
+  ~Timer();
+  void report() const;
+
+ private:
+  Counters start;
+};
+
+// Counts allocations from now on, as start does, without profiling.
+void count_allocations();
+// Number of allocations with operator new by this thread while they were
+// counted.
+uint64_t allocations();
+uint64_t allocated_bytes();
+
+}  // namespace profile
+#endif
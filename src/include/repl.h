@@ -1 +1,5 @@
-int run_repl();
+#include <string>
+
+// Loads the image at image, if given, instead of the granthalaya.
+int run_repl(bool use_walker = false, bool dynamic_scope = false,
+             const std::string& image = "");
@@ -1,14 +1,185 @@
+#ifndef _TRTH
+#define _TRTH
+#include <cstddef>
 #include <cstdint>
-#include <list>
+#include <iterator>
+#include <vector>
 typedef struct _IRNode {
   uint8_t type;
   int64_t value;
 } IRNode;
 
+// The elements of a list node. cons and cdr share them with the list they
+// are given, like the cons cells of the vm share their tails, so a loop
+// consing onto a list takes memory linear in its length. The elements are
+// kept contiguous from the last one to the first, and each list sees the
+// first size() of them. Consing onto a list that sees all of them appends.
+class NodeList {
+ public:
+  NodeList() : cells(new Cells()), count(0) {}
+  // The list of nodes, in order.
+  explicit NodeList(const std::vector<IRNode*>& nodes);
+  ~NodeList();
+  NodeList(const NodeList&) = delete;
+  NodeList& operator=(const NodeList&) = delete;
+
+  using iterator = std::reverse_iterator<IRNode* const*>;
+  iterator begin() const { return iterator(cells->nodes.data() + count); }
+  iterator end() const { return iterator(cells->nodes.data()); }
+  size_t size() const { return count; }
+  bool empty() const { return !count; }
+  IRNode* front() const { return cells->nodes[count - 1]; }
+
+  // Puts node before the elements, which builds a list from its last
+  // element, or from its first one followed by reverse().
+  void push_front(IRNode* node);
+  void reverse();
+  // New lists sharing the elements with this one.
+  NodeList* cons(IRNode* node) const;
+  NodeList* cdr() const;
+
+  // Calls f with the elements the collection with this epoch hasn't seen
+  // yet, so that marking the lists sharing elements takes linear time.
+  template <class F>
+  void mark(uint64_t epoch, F f) const {
+    if (cells->epoch != epoch) cells->marked = 0;
+    cells->epoch = epoch;
+    for (; cells->marked < count; cells->marked++)
+      f(cells->nodes[cells->marked]);
+  }
+
+ private:
+  // Past the size of the longest list sharing them, the nodes may have been
+  // collected.
+  struct Cells {
+    std::vector<IRNode*> nodes;
+    size_t refs = 1;
+    uint64_t epoch = 0;
+    size_t marked = 0;
+  };
+  NodeList(Cells* c, size_t n) : cells(c), count(n) { cells->refs++; }
+  Cells* cells;
+  size_t count;
+};
+
+struct LambdaMemo;
+
 typedef struct _LambdaStruct {
-  std::list<IRNode*>* arglist;
-  IRNode* (*fun)();
+  // The parameter symbols.
+  std::vector<IRNode*>* arglist;
+  // Compiled function taking the argc arguments as IRNode*.
+  void* fun;
   int argc;
+  // Set for lambdas returned by memo, whose argc is -1 so that compiled code
+  // calls them through executeLambda.
+  LambdaMemo* memo;
 } LambdaStruct;
 
 IRNode* add(int num_args, ...);
+// Runtime entry points called by compiled code.
+IRNode* define(IRNode* symbol, IRNode* value, bool shouldPop);
+IRNode* retrieve(IRNode* symbol);
+// Whether symbol is bound to a lambda compiled to fun taking argc arguments.
+bool isBoundTo(IRNode* symbol, void* fun, int argc) noexcept;
+IRNode* arithmetic(char op, uint32_t num_args, ...);
+IRNode* deepCopy(IRNode* node);
+IRNode* executeLambda(IRNode* lambda, int argc, ...);
+IRNode* createLambda(void* fun, int argc, ...);
+IRNode* cons(IRNode* addNode, IRNode* listnode);
+// Allocation failure terminates, which lets compiled code assume these don't
+// throw.
+IRNode* allocNode() noexcept;
+char* allocList() noexcept;
+void listPushFront(char* list, IRNode* node) noexcept;
+// Booleans and small integers are shared nodes that are never freed, so only
+// larger integers allocate.
+IRNode* boxBool(bool value) noexcept;
+IRNode* boxInteger(int64_t value) noexcept;
+// Integer literals too wide for int64.
+IRNode* bigInteger(const char* digits);
+// (memo fn capacity) and (memo-stats fn). capacity may be null.
+IRNode* memoize(IRNode* fn, IRNode* capacity);
+IRNode* memoStats(IRNode* fn);
+
+// Nodes allocated by the runtime are garbage collected, by mark and sweep from
+// the bindings in the environment, the shadow stack and the GCRoots. The
+// collector only runs at the safepoints compiled code calls, so runtime code
+// only needs to root the nodes it holds while it calls back into a lambda.
+//
+// Every compiled function pushes a frame with a slot for each node it
+// computes on entry and pops it on return.
+struct ShadowFrame {
+  ShadowFrame* next;
+  int64_t size;
+  IRNode** slots() { return reinterpret_cast<IRNode**>(this + 1); }
+};
+extern ShadowFrame* gShadowStack;
+
+// Collects if enough nodes were allocated since the last collection.
+void gcSafepoint() noexcept;
+void gcCollect() noexcept;
+
+class GCRoot {
+ public:
+  explicit GCRoot(IRNode* node);
+  ~GCRoot();
+  GCRoot(const GCRoot&) = delete;
+  GCRoot& operator=(const GCRoot&) = delete;
+};
+
+// Counts since the start of the runtime, sizes in nodes. The limits are read
+// from the environment: TODALU_GC_MIN_HEAP is the number of nodes allocated
+// before the first collection, TODALU_GC_GROWTH how much the heap may grow
+// over what was live after a collection before the next, and
+// TODALU_GC_MAX_HEAP the number of live nodes past which the program is
+// aborted. TODALU_GC_STATS prints these when the runtime is done.
+//
+// Nodes are carved out of slabs, which TODALU_HUGE_PAGES asks to back with
+// huge pages. Each thread allocates from a free list of its own that it
+// refills from the heap in batches.
+struct GCStats {
+  uint64_t collections;
+  uint64_t allocated;
+  uint64_t freed;
+  uint64_t live;
+  uint64_t max_live;
+  uint64_t ns;
+  uint64_t max_pause_ns;
+};
+// Of the runtime of the calling thread.
+GCStats gcStats();
+
+// Bindings, nodes and shadow stack of a compiled program. The runtime
+// functions work on the runtime of the calling thread, which is one for the
+// whole process, used by programs linked with trt.ll, unless a Scope entered
+// another. Programs jitted by different compilers each run in a runtime of
+// their own, so they can run on different threads at once.
+class Runtime {
+ public:
+  struct State;
+
+  Runtime();
+  // Frees every node of the runtime.
+  ~Runtime();
+  Runtime(const Runtime&) = delete;
+  Runtime& operator=(const Runtime&) = delete;
+  // Where compiled code running in this runtime keeps its innermost frame,
+  // instead of gShadowStack.
+  ShadowFrame** shadowStack();
+
+  // Makes runtime the one of the calling thread for its lifetime.
+  class Scope {
+   public:
+    explicit Scope(Runtime& runtime);
+    ~Scope();
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    State* previous;
+  };
+
+ private:
+  State* state;
+};
+#endif
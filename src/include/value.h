@@ -0,0 +1,265 @@
+#ifndef _VALUEH
+#define _VALUEH
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+
+struct Chunk;
+struct Env;
+
+// Set on the threads of the pool while they run calls of pmap, pfilter or
+// preduce. The objects they see are shared with the other workers, so their
+// references are counted atomically.
+extern thread_local constinit bool tSharedObjects;
+
+// Heap objects of the vm. Objects are immutable once created and shared by
+// reference counting.
+class Object {
+ public:
+  Object(ASTNodeType t) : type(t) {}
+  virtual ~Object() {}
+  void retain() {
+    if (tSharedObjects)
+      std::atomic_ref<uint32_t>(refs).fetch_add(1, std::memory_order_relaxed);
+    else
+      refs++;
+  }
+  // Whether that was the last reference.
+  bool release() {
+    if (tSharedObjects)
+      return std::atomic_ref<uint32_t>(refs).fetch_sub(
+                 1, std::memory_order_acq_rel) == 1;
+    return --refs == 0;
+  }
+  bool unshared() {
+    return std::atomic_ref<uint32_t>(refs).load(std::memory_order_relaxed) == 1;
+  }
+  ASTNodeType type;
+  uint32_t refs = 0;
+};
+
+// Runtime values of the vm, NaN-boxed into 64 bits. A double is stored as is,
+// and every other value is a quiet NaN with the sign bit set carrying a tag
+// and a 48 bit payload. NaN doubles are canonicalized to a positive NaN so
+// that they can't be mistaken for a boxed value. Integers, booleans and
+// symbols are immediates, as is the empty list; strings, cons cells, lambdas,
+// arrays and integers too wide for the payload live on the heap. Copying a
+// Value never copies the object.
+class Value {
+ public:
+  Value() : bits(kEmpty) {}
+  explicit Value(Object* o) : bits(kBoxed | kObjectTag | (uint64_t)o) {
+    retain();
+  }
+  Value(const Value& other) : bits(other.bits) { retain(); }
+  Value(Value&& other) : bits(other.bits) { other.bits = kEmpty; }
+  ~Value() { release(); }
+  Value& operator=(const Value& other) {
+    if (other.is_object()) other.object()->retain();
+    release();
+    bits = other.bits;
+    return *this;
+  }
+  Value& operator=(Value&& other) {
+    std::swap(bits, other.bits);
+    return *this;
+  }
+
+  static Value boolean(bool v) { return Value(kBoxed | kBoolTag | v); }
+  static Value symbol(uint32_t id) { return Value(kBoxed | kSymbolTag | id); }
+  static Value empty_list() { return Value(kBoxed | kEmptyListTag); }
+  static Value decimal(double v) {
+    if (v != v) return Value(kCanonicalNaN);
+    uint64_t b;
+    std::memcpy(&b, &v, sizeof(b));
+    return Value(b);
+  }
+  static bool fits_fixnum(int64_t v) {
+    return v >= -(int64_t(1) << 47) && v < (int64_t(1) << 47);
+  }
+  // v must satisfy fits_fixnum.
+  static Value fixnum(int64_t v) {
+    return Value(kBoxed | kIntegerTag | ((uint64_t)v & kPayload));
+  }
+
+  bool is_decimal() const { return (bits & kBoxed) != kBoxed; }
+  bool is_fixnum() const { return tag() == kIntegerTag; }
+  bool is_bool() const { return tag() == kBoolTag; }
+  bool is_symbol() const { return tag() == kSymbolTag; }
+  bool is_object() const { return tag() == kObjectTag; }
+  bool is_empty_list() const { return tag() == kEmptyListTag; }
+  bool is_integer() const;
+  // Integers that don't fit in int64, for which integer() is 0.
+  bool is_bigint() const;
+  ASTNodeType type() const {
+    if (is_decimal()) return ASTNodeType::Decimal;
+    switch (tag()) {
+      case kIntegerTag:
+        return ASTNodeType::Integer;
+      case kBoolTag:
+        return ASTNodeType::Bool;
+      case kSymbolTag:
+        return ASTNodeType::Symbol;
+      case kEmptyListTag:
+        return ASTNodeType::List;
+      default:
+        return object()->type;
+    }
+  }
+
+  double decimal() const {
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+  int64_t integer() const;
+  BigInt bigint() const;
+  bool boolean() const { return bits & 1; }
+  uint32_t symbol() const { return (uint32_t)bits; }
+  Object* object() const { return (Object*)(bits & kPayload); }
+  template <class T>
+  T* as() const {
+    return static_cast<T*>(object());
+  }
+
+ private:
+  static constexpr uint64_t kBoxed = 0xFFF8000000000000;
+  static constexpr uint64_t kTagMask = 0x0007000000000000;
+  static constexpr uint64_t kPayload = 0x0000FFFFFFFFFFFF;
+  static constexpr uint64_t kIntegerTag = 0x0001000000000000;
+  static constexpr uint64_t kBoolTag = 0x0002000000000000;
+  static constexpr uint64_t kSymbolTag = 0x0003000000000000;
+  static constexpr uint64_t kObjectTag = 0x0004000000000000;
+  static constexpr uint64_t kEmptyListTag = 0x0005000000000000;
+  // Value() holds no object and is only a placeholder.
+  static constexpr uint64_t kEmpty = kBoxed;
+  static constexpr uint64_t kCanonicalNaN = 0x7FF8000000000000;
+
+  explicit Value(uint64_t b) : bits(b) {}
+  uint64_t tag() const {
+    if (is_decimal()) return 0;
+    return bits & kTagMask;
+  }
+  void retain() {
+    if (is_object()) object()->retain();
+  }
+  void release() {
+    if (is_object() && object()->release()) delete object();
+  }
+  uint64_t bits;
+};
+
+// Integer that doesn't fit in a fixnum, kept in big if it doesn't fit in
+// int64 either.
+class IntegerObject : public Object {
+ public:
+  IntegerObject(int64_t v) : Object(ASTNodeType::Integer), value(v) {}
+  IntegerObject(BigInt v)
+      : Object(ASTNodeType::Integer),
+        value(0),
+        big(std::make_unique<const BigInt>(std::move(v))) {}
+  int64_t value;
+  std::unique_ptr<const BigInt> big;
+};
+
+inline bool Value::is_integer() const {
+  return is_fixnum() || (is_object() && object()->type == ASTNodeType::Integer);
+}
+
+inline bool Value::is_bigint() const {
+  return is_object() && object()->type == ASTNodeType::Integer &&
+         as<IntegerObject>()->big;
+}
+
+inline int64_t Value::integer() const {
+  if (is_fixnum()) return (int64_t)(bits << 16) >> 16;
+  return as<IntegerObject>()->value;
+}
+
+inline BigInt Value::bigint() const {
+  if (is_bigint()) return *as<IntegerObject>()->big;
+  return BigInt(integer());
+}
+
+class StringObject : public Object {
+ public:
+  StringObject(std::string v) : Object(ASTNodeType::String), value(v) {}
+  std::string value;
+};
+
+// A non-empty list is a chain of pairs ending in the empty list. Tails are
+// shared, so car, cdr and cons are O(1).
+class PairObject : public Object {
+ public:
+  PairObject(Value a, Value d)
+      : Object(ASTNodeType::List), car(std::move(a)), cdr(std::move(d)) {}
+  ~PairObject();
+  Value car;
+  Value cdr;
+};
+
+// Result of a call of a lambda from memo. Lambda arguments are keyed by
+// their address, so the lambdas are kept alive for the address to stay
+// theirs.
+struct MemoResult {
+  Value value;
+  std::vector<Value> lambdas;
+};
+
+// The argument list and body are kept as data for eval and printing.
+class LambdaObject : public Object {
+ public:
+  LambdaObject(Value a, Value b, std::shared_ptr<Chunk> c,
+               std::shared_ptr<Env> e)
+      : Object(ASTNodeType::Lambda),
+        arglist(std::move(a)),
+        body(std::move(b)),
+        code(std::move(c)),
+        env(std::move(e)) {}
+  Value arglist;
+  Value body;
+  std::shared_ptr<Chunk> code;
+  std::shared_ptr<Env> env;
+  // Set for lambdas returned by memo.
+  std::shared_ptr<MemoTable<MemoResult>> memo;
+};
+
+class ArrayObject : public Object {
+ public:
+  ArrayObject(NumArray a) : Object(ASTNodeType::Array), data(std::move(a)) {}
+  NumArray data;
+};
+
+inline Value make_bool(bool v) { return Value::boolean(v); }
+inline Value make_integer(int64_t v) {
+  if (Value::fits_fixnum(v)) return Value::fixnum(v);
+  return Value(new IntegerObject(v));
+}
+inline Value make_integer(const BigInt& v) {
+  if (v.fits_int64()) return make_integer(v.to_int64());
+  return Value(new IntegerObject(v));
+}
+inline Value make_decimal(double v) { return Value::decimal(v); }
+inline Value make_string(std::string v) {
+  return Value(new StringObject(std::move(v)));
+}
+inline Value make_array(NumArray v) {
+  return Value(new ArrayObject(std::move(v)));
+}
+inline Value cons(Value car, Value cdr) {
+  return Value(new PairObject(std::move(car), std::move(cdr)));
+}
+
+bool truthy(const Value& value);
+std::string repr(const Value& value);
+Value from_ast(NodeRef node);
+// Appends value to ast as data for eval and returns its node index. Lambdas
+// and arrays are referenced, not copied.
+uint32_t flatten(const Value& value, FlatAST& ast);
+#endif
@@ -0,0 +1,147 @@
+#ifndef _VMH
+#define _VMH
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ast.h"
+#include "value.h"
+
+// Binding stacks of the vm, indexed by symbol id. The top of a stack is the
+// current value. Only dynamic scope pushes more than one. Each interpreter has
+// its own, which the chunks it compiles refer to, so interpreters on
+// different threads don't share any state.
+//
+// Pool workers compile the forms they eval, so growing the stacks is locked.
+// Growing a deque at the back keeps the stacks that chunks point to in place.
+class Globals {
+ public:
+  std::vector<Value>& of(uint32_t id);
+  // Symbol ids past this one are unbound.
+  size_t size() const;
+
+ private:
+  std::deque<std::vector<Value>> stacks;
+  mutable std::mutex mutex;
+};
+
+enum class OpCode : uint8_t {
+  Const,        // push constants[a]
+  Closure,      // push lambda constants[a] closed over the current env
+  Load,         // push value bound to symbols[a]
+  LoadLocal,    // push argument a of the current call
+  LoadEnv,      // push slot b of the env a levels above the current one
+  Def,          // bind symbols[a] to top of stack
+  DefDynamic,   // bind symbol below top of stack to top of stack
+  Pop,          // drop top of stack
+  Jump,         // pc = a
+  JumpIfFalse,  // pop, pc = a if falsy
+  Callable,     // check symbols[a] is bound to a lambda
+  Call,         // call lambda below a arguments
+  CallGlobal,   // call lambda bound to symbols[a] with b arguments
+  CallLocal,    // call lambda in argument a with b arguments
+  CallEnv,      // call lambda in slot b of env a levels up with c arguments
+  // Calls in tail position, which replace the current frame.
+  TailCall,
+  TailCallGlobal,
+  TailCallLocal,
+  TailCallEnv,
+  Arith,        // fold b operands with operator a
+  Equal,
+  Greater,
+  MakeArray,
+  Arange,
+  Aref,
+  Reduce,  // a = 's' for sum, '<' for min, '>' for max
+  Dot,
+  PrefixSum,
+  Map,
+  Filter,
+  Fold,
+  Range,
+  // Map, Filter and Fold spread over the pool.
+  Pmap,
+  Pfilter,
+  Pfold,
+  Length,
+  Reverse,
+  Append,  // concatenate a lists
+  Sort,    // a = 1 with a comparator
+  IsType,  // a = ASTNodeType
+  Print,   // a = 1 for println
+  Eval,
+  Exit,
+  ReadStr,
+  Read,
+  Car,
+  Cdr,
+  Cons,
+  Throw,      // throw TodaluException(constants[a])
+  TimeStart,  // start timing for time
+  TimeEnd,    // print the time since the matching TimeStart
+  Memo,       // a = 1 with a capacity
+  MemoStats,
+  Return
+};
+
+struct Instruction {
+  OpCode op;
+  int32_t a = 0;
+  int32_t b = 0;
+  int32_t c = 0;
+};
+
+// Arguments of a call whose body creates closures. Arguments of other calls
+// stay on the vm stack.
+struct Env {
+  Env(std::shared_ptr<Env> p) : parent(std::move(p)) {}
+  std::shared_ptr<Env> parent;
+  std::vector<Value> slots;
+};
+
+struct Chunk {
+  std::vector<Instruction> code;
+  std::vector<Value> constants;
+  std::vector<uint32_t> symbols;
+  // Globals the chunk was compiled against, which eval and def of a computed
+  // symbol use at runtime.
+  Globals* globals = nullptr;
+  // Entry in globals for each of symbols, resolved when the chunk is
+  // compiled.
+  std::vector<std::vector<Value>*> bindings;
+  // Free symbols are looked up in globals at runtime, and lambda arguments
+  // are pushed onto globals for the duration of the call, like the tree
+  // walker does with its env.
+  bool dynamic_scope = false;
+  // Lambda bodies only. Number of parameters and whether the lambda was
+  // declared with a single symbol instead of an argument list.
+  size_t arity = 0;
+  bool single_param = false;
+  // Entries in globals of the parameters with dynamic scope. Otherwise whether
+  // the arguments have to be moved into an Env.
+  std::vector<std::vector<Value>*> params;
+  bool captures = false;
+  // Symbol the lambda was first bound to, for the profiler.
+  uint32_t name = kAnonymousLambda;
+  // Copy of the top level form the chunk was compiled from, and the lists and
+  // symbols in it whose code is in [begin, end), innermost first, so that an
+  // error can name the forms it happened in. Lambdas and arrays in source are
+  // only printed by address.
+  struct Form {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t node;
+    bool tail;
+  };
+  std::shared_ptr<const FlatAST> source;
+  std::vector<Form> forms;
+};
+
+std::shared_ptr<Chunk> compile_form(NodeRef node, Globals& globals,
+                                    bool dynamic_scope = false);
+Value run_chunk(std::shared_ptr<Chunk> chunk);
+// Calls the lambda fn with args, for builtins that take a function.
+Value call_lambda(const Value& fn, std::vector<Value> args);
+#endif
@@ -9,22 +9,47 @@
 #include "ast.h"
 #include "common.h"
 #include "eval.h"
+#include "image.h"
+#include "vm.h"
 
 std::string Interpreter::handle_line(std::string str) {
   if (is_comment(str)) return "";
-  auto tokens = tokenizer(str);
-  auto ast = create_ast(tokens);
+  form.clear();
+  read_forms(str, form);
 
-  if (ast.size() == 0) return "";
+  if (form.size() == 0) return "";
 
-  if (ast.size() != 1)
+  if (form.size() != 1)
     throw TodaluException("Contains more than one node at the base");
 
-  std::unique_ptr<ASTNode> result(eval_tree(ast.front()));
+  return run(form.root(0)) + "\n";
+}
 
-  free_ast(ast);
+std::string Interpreter::run(NodeRef root) {
+  if (walker) {
+    // The tree walker doesn't evaluate the flat AST, only a tree copy of it.
+    std::unique_ptr<ASTNode> ast(root.to_node());
+    std::unique_ptr<ASTNode> node(eval_tree(ast.get(), env));
+    return node->getRepr();
+  }
+  return repr(run_chunk(compile_form(root, globals, dynamic)));
+}
 
-  return result->getRepr() + "\n";
+void Interpreter::save_image(const std::string& path) {
+  FlatAST image;
+  if (walker) {
+    for (uint32_t id = 0; id < env.size(); id++)
+      if (auto value = env.lookup(id)) add_binding(id, value, image);
+  } else {
+    for (uint32_t id = 0; id < globals.size(); id++)
+      if (!globals.of(id).empty())
+        add_binding(id, globals.of(id).back(), image);
+  }
+  write_image(path, image);
 }
 
-Interpreter::~Interpreter() { free_env(); }
+void Interpreter::load_image(const std::string& path) {
+  form.clear();
+  read_image(path, form);
+  for (size_t i = 0; i < form.size(); i++) run(form.root(i));
+}
@@ -1,6 +1,6 @@
 #include <getopt.h>
 
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
 #include <istream>
 #include <sstream>
@@ -9,22 +9,87 @@
 #include "compile.h"
 #include "history.h"
 #include "interpret.h"
+#include "pool.h"
+#include "profile.h"
 #include "readline.h"
 #include "repl.h"
 
 int main(int argc, char **argv) {
   std::string usage = std::string("Usage :") + argv[0] +
-                      " [-h] [-c] [file]\n-c to compile\n-h to print help";
+                      " [-h] [-c] [-j] [-O0|-O1|-O2|-O3] [-w] [-d] [-t N]"
+                      " [--profile] [--image file] [--save-image file] [file]\n"
+                      "-c to compile\n-j to compile and run in process\n"
+                      "-O to set the optimization level of the compiler, 0 "
+                      "by default\n"
+                      "-w to interpret with the tree walker instead of the "
+                      "bytecode vm\n-d to interpret with dynamic scoping\n"
+                      "-t to run pmap, pfilter and preduce on N threads, one "
+                      "per core by default\n"
+                      "--profile to print the time spent in each lambda and "
+                      "builtin at exit\n"
+                      "--image to start from the bindings saved in an image "
+                      "instead of loading the granthalaya\n"
+                      "--save-image to save the bindings to an image after "
+                      "running file\n-h to print help";
+  const struct option long_options[] = {
+      {"image", required_argument, nullptr, 'i'},
+      {"save-image", required_argument, nullptr, 's'},
+      {"profile", no_argument, nullptr, 'p'},
+      {nullptr, 0, nullptr, 0}};
   int option;
   bool compile = false;
+  bool jit = false;
+  unsigned level = 0;
+  bool walker = false;
+  bool dynamic = false;
   bool interactive = true;
+  bool profiling = false;
+  std::string image;
+  std::string save_image;
 
   std::string filename;
-  while ((option = getopt(argc, argv, "ch")) != -1) {
+  while ((option = getopt_long(argc, argv, "cjO:hwdt:", long_options,
+                               nullptr)) != -1) {
     switch (option) {
       case 'c':
         compile = true;
         break;
+      case 'j':
+        compile = true;
+        jit = true;
+        break;
+      case 'O':
+        if (optarg[0] < '0' || optarg[0] > '3' || optarg[1]) {
+          std::cerr << "Optimization level must be 0 to 3" << std::endl;
+          return 1;
+        }
+        level = optarg[0] - '0';
+        break;
+      case 'w':
+        walker = true;
+        break;
+      case 'd':
+        dynamic = true;
+        break;
+      case 't': {
+        char *end;
+        auto count = std::strtol(optarg, &end, 10);
+        if (*end || count < 1) {
+          std::cerr << "Thread count must be a positive integer" << std::endl;
+          return 1;
+        }
+        pool::set_threads(count);
+        break;
+      }
+      case 'i':
+        image = optarg;
+        break;
+      case 's':
+        save_image = optarg;
+        break;
+      case 'p':
+        profiling = true;
+        break;
       case 'h':
         std::cout << usage << std::endl;
         return 0;
@@ -43,30 +108,52 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (interactive) {
-    return run_repl();
+  if (compile && (!image.empty() || !save_image.empty())) {
+    std::cerr << "Images can only be used when interpreting" << std::endl;
+    return 1;
+  }
+  if (compile && profiling) {
+    std::cerr << "Only the interpreter can be profiled" << std::endl;
+    return 1;
+  }
+  if (profiling) profile::start();
+
+  if (interactive && save_image.empty()) {
+    return run_repl(walker, dynamic, image);
   }
 
   // Compile or interpret filename given.
-  Inpiler *engine = compile ? (Inpiler *)new Compiler(filename)
-                            : (Inpiler *)new Interpreter();
-  engine->load_granthalaya();
-  std::ifstream fs(filename);
-  if (!fs.good()) {
+  Inpiler *engine = compile ? (Inpiler *)new Compiler(filename, jit, level)
+                            : (Inpiler *)new Interpreter(walker, dynamic);
+  try {
+    if (image.empty())
+      engine->load_granthalaya();
+    else
+      static_cast<Interpreter *>(engine)->load_image(image);
+    // Without a file, the image holds the granthalaya or the loaded image.
+    if (interactive) {
+      static_cast<Interpreter *>(engine)->save_image(save_image);
+      delete engine;
+      return 0;
+    }
+  } catch (TodaluException &e) {
+    std::cerr << e.what() << std::endl;
+    delete engine;
+    return 1;
+  }
+  if (!engine->load_file(filename)) {
     std::cerr << "Input file couldn't be read" << std::endl;
     exit(1);
   }
-  std::string line;
-  std::string wholeline = "";
-  while (std::getline(fs, line)) {
-    wholeline += line;
-    if (engine->is_balanced(wholeline)) {
-      engine->handle_line(wholeline);
-      wholeline = "";
+  if (!save_image.empty()) {
+    try {
+      static_cast<Interpreter *>(engine)->save_image(save_image);
+    } catch (TodaluException &e) {
+      std::cerr << e.what() << std::endl;
+      delete engine;
+      return 1;
     }
   }
-  if (wholeline != "")
-    throw std::runtime_error("Please check that the input is wellformed");
   // TODO use smart pointer
   delete engine;
 }
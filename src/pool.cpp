@@ -0,0 +1,175 @@
+#include "pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "profile.h"
+
+namespace pool {
+
+namespace {
+
+// Each worker gets this many ranges per thread to start with. Smaller ranges
+// balance better, larger ones cost less to hand out.
+constexpr size_t kRangesPerThread = 8;
+
+struct Range {
+  size_t begin;
+  size_t end;
+};
+
+// Ranges of one worker, which takes them from the front in order while
+// thieves take them from the back.
+struct Queue {
+  std::mutex mutex;
+  std::deque<Range> ranges;
+};
+
+thread_local bool tWorker = false;
+size_t gThreads = 0;
+// Held by the thread whose ranges the pool is running.
+std::mutex gBusy;
+
+class Pool {
+ public:
+  explicit Pool(size_t count) : queues(count) {
+    for (size_t i = 0; i < count; i++)
+      threads.emplace_back(&Pool::work, this, i);
+  }
+  // Runs at exit, which a worker that called exit runs too. It can't join
+  // itself.
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) {
+      if (thread.get_id() == std::this_thread::get_id())
+        thread.detach();
+      else
+        thread.join();
+    }
+  }
+  // Only one thread calls run at a time.
+  void run(size_t n, const std::function<void(size_t, size_t)>& f);
+
+ private:
+  bool next(size_t self, Range& range);
+  void work(size_t self);
+
+  std::vector<Queue> queues;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  bool stopping = false;
+  // Bumped for every run, so that workers know there are ranges.
+  uint64_t generation = 0;
+  // The ranges of a run are handed out after job is set, under the mutex of
+  // their queue, so workers read it without taking mutex.
+  const std::function<void(size_t, size_t)>* job = nullptr;
+  std::atomic<size_t> remaining{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+};
+
+void Pool::run(size_t n, const std::function<void(size_t, size_t)>& f) {
+  auto count = std::min(n, queues.size() * kRangesPerThread);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &f;
+    error = nullptr;
+    failed = false;
+    remaining = count;
+    // Neighbouring ranges go to the same worker.
+    for (size_t i = 0; i < count; i++) {
+      auto& queue = queues[i * queues.size() / count];
+      std::lock_guard<std::mutex> queue_lock(queue.mutex);
+      queue.ranges.push_back({n * i / count, n * (i + 1) / count});
+    }
+    generation++;
+  }
+  wake.notify_all();
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return remaining == 0; });
+  job = nullptr;
+  if (error) std::rethrow_exception(error);
+}
+
+bool Pool::next(size_t self, Range& range) {
+  for (size_t i = 0; i < queues.size(); i++) {
+    auto& queue = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.ranges.empty()) continue;
+    if (i == 0) {
+      range = queue.ranges.front();
+      queue.ranges.pop_front();
+    } else {
+      range = queue.ranges.back();
+      queue.ranges.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void Pool::work(size_t self) {
+  tWorker = true;
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this, seen] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+    Range range;
+    while (next(self, range)) {
+      if (!failed) {
+        try {
+          (*job)(range.begin, range.end);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) error = std::current_exception();
+          failed = true;
+        }
+      }
+      if (--remaining == 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  }
+}
+
+}  // namespace
+
+void set_threads(size_t count) { gThreads = count; }
+
+size_t threads() {
+  if (gThreads) return gThreads;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool in_worker() { return tWorker; }
+
+void parallel_for(size_t n, const std::function<void(size_t, size_t)>& f) {
+  if (n == 0) return;
+  std::unique_lock<std::mutex> busy(gBusy, std::defer_lock);
+  if (tWorker || threads() == 1 || n == 1 || gProfiling || !busy.try_lock()) {
+    f(0, n);
+    return;
+  }
+  static Pool pool(threads());
+  pool.run(n, f);
+}
+
+}  // namespace pool
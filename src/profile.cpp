@@ -0,0 +1,288 @@
+#include "profile.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+
+bool gProfiling = false;
+
+namespace {
+// Counted per thread, since pool workers allocate at the same time, and only
+// while profiling, timing or benchmarking so that allocations cost a branch
+// otherwise.
+thread_local uint64_t tAllocations = 0;
+thread_local uint64_t tAllocatedBytes = 0;
+std::atomic<int> gCounting{0};
+
+void* allocate(size_t size, size_t alignment = 0) noexcept {
+  if (__builtin_expect(gCounting.load(std::memory_order_relaxed), 0)) {
+    tAllocations++;
+    tAllocatedBytes += size;
+  }
+  if (!size) size = 1;
+  if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+  void* p;
+  return posix_memalign(&p, alignment, size) ? nullptr : p;
+}
+
+void* allocate_or_throw(size_t size, size_t alignment = 0) {
+  if (auto p = allocate(size, alignment)) return p;
+  throw std::bad_alloc();
+}
+}  // namespace
+
+// The whole replaceable set, so that every form of new, including the ones
+// LLVM uses, is freed by a matching delete.
+void* operator new(size_t size) { return allocate_or_throw(size); }
+void* operator new[](size_t size) { return allocate_or_throw(size); }
+void* operator new(size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+namespace profile {
+
+namespace {
+
+Counters& operator+=(Counters& x, const Counters& y) {
+  x.ns += y.ns;
+  x.allocations += y.allocations;
+  x.cycles += y.cycles;
+  x.cache_misses += y.cache_misses;
+  return x;
+}
+
+Counters operator-(Counters x, const Counters& y) {
+  x.ns -= y.ns;
+  x.allocations -= y.allocations;
+  x.cycles -= y.cycles;
+  x.cache_misses -= y.cache_misses;
+  return x;
+}
+
+// Cycles and cache misses of this thread, read together as a group. Not
+// available when the kernel doesn't allow perf_event_open.
+class HardwareCounters {
+ public:
+  void open() {
+    cycles = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (cycles < 0) return;
+    cache_misses = open_counter(PERF_COUNT_HW_CACHE_MISSES, cycles);
+    if (cache_misses < 0) {
+      close(cycles);
+      cycles = -1;
+      return;
+    }
+    ioctl(cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  bool available() const { return cycles >= 0; }
+  void read(Counters& counters) const {
+    if (cycles < 0) return;
+    struct {
+      uint64_t count;
+      uint64_t values[2];
+    } group;
+    if (::read(cycles, &group, sizeof(group)) != sizeof(group)) return;
+    counters.cycles = group.values[0];
+    counters.cache_misses = group.values[1];
+  }
+
+ private:
+  static int open_counter(uint64_t config, int group) {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+  }
+  int cycles = -1;
+  int cache_misses = -1;
+};
+
+struct Stats {
+  uint64_t calls = 0;
+  Counters inclusive;
+  Counters exclusive;
+  // Calls in progress. Only the outermost of recursive calls adds to the
+  // inclusive counters.
+  uint32_t active = 0;
+};
+
+struct Frame {
+  Stats* stats;
+  Counters start;
+  Counters children;
+};
+
+struct Profiler {
+  HardwareCounters hardware;
+  std::unordered_map<uint32_t, Stats> stats;
+  std::vector<Frame> frames;
+};
+
+Profiler& profiler() {
+  static Profiler profiler;
+  return profiler;
+}
+
+std::string name_of(uint32_t id) {
+  if (id == kAnonymousLambda) return "(lambda)";
+  return symbol_name(id);
+}
+
+void report() {
+  auto& state = profiler();
+  unwind(0);
+  std::vector<std::pair<std::string, const Stats*>> rows;
+  size_t width = 4;
+  for (auto& [id, stats] : state.stats) {
+    rows.push_back({name_of(id), &stats});
+    width = std::max(width, rows.back().first.size());
+  }
+  std::sort(rows.begin(), rows.end(), [](auto& x, auto& y) {
+    return x.second->exclusive.ns > y.second->exclusive.ns;
+  });
+  bool hardware = state.hardware.available();
+  std::cout.flush();
+  std::fprintf(stderr, "\nProfile, sorted by exclusive time\n");
+  std::fprintf(stderr, "%-*s %10s %12s %12s %12s", (int)width, "name",
+               "calls", "incl ms", "excl ms", "excl allocs");
+  if (hardware)
+    std::fprintf(stderr, " %14s %12s", "excl cycles", "excl misses");
+  std::fprintf(stderr, "\n");
+  for (auto& [name, stats] : rows) {
+    std::fprintf(stderr, "%-*s %10llu %12.3f %12.3f %12llu", (int)width,
+                 name.c_str(), (unsigned long long)stats->calls,
+                 stats->inclusive.ns / 1e6, stats->exclusive.ns / 1e6,
+                 (unsigned long long)stats->exclusive.allocations);
+    if (hardware)
+      std::fprintf(stderr, " %14llu %12llu",
+                   (unsigned long long)stats->exclusive.cycles,
+                   (unsigned long long)stats->exclusive.cache_misses);
+    std::fprintf(stderr, "\n");
+  }
+}
+
+}  // namespace
+
+Counters read() {
+  Counters counters;
+  counters.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  counters.allocations = tAllocations;
+  profiler().hardware.read(counters);
+  return counters;
+}
+
+void start() {
+  auto& state = profiler();
+  // Statics constructed before the report is registered outlive it.
+  symbol_name(0);
+  state.hardware.open();
+  count_allocations();
+  gProfiling = true;
+  std::atexit(report);
+}
+
+void enter(uint32_t id) {
+  auto& state = profiler();
+  auto& stats = state.stats[id];
+  stats.calls++;
+  stats.active++;
+  state.frames.push_back({&stats, read(), {}});
+}
+
+void leave() {
+  auto& state = profiler();
+  auto frame = state.frames.back();
+  state.frames.pop_back();
+  auto spent = read() - frame.start;
+  if (--frame.stats->active == 0) frame.stats->inclusive += spent;
+  frame.stats->exclusive += spent - frame.children;
+  if (!state.frames.empty()) state.frames.back().children += spent;
+}
+
+size_t depth() { return profiler().frames.size(); }
+
+void unwind(size_t depth) {
+  while (profiler().frames.size() > depth) leave();
+}
+
+Timer::Timer() : start(read()) { gCounting++; }
+Timer::Timer(const Timer& timer) : start(timer.start) { gCounting++; }
+Timer::~Timer() { gCounting--; }
+
+void Timer::report() const {
+  auto spent = read() - start;
+  std::fprintf(stderr, "time : %.3f ms, %llu allocations", spent.ns / 1e6,
+               (unsigned long long)spent.allocations);
+  if (profiler().hardware.available())
+    std::fprintf(stderr, ", %llu cycles, %llu cache misses",
+                 (unsigned long long)spent.cycles,
+                 (unsigned long long)spent.cache_misses);
+  std::fprintf(stderr, "\n");
+}
+
+void count_allocations() { gCounting++; }
+uint64_t allocations() { return tAllocations; }
+uint64_t allocated_bytes() { return tAllocatedBytes; }
+
+}  // namespace profile
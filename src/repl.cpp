@@ -4,12 +4,21 @@
 #include "history.h"
 #include "interpret.h"
 #include "readline.h"
-int run_repl() {
+#include "repl.h"
+int run_repl(bool use_walker, bool dynamic_scope, const std::string& image) {
   char* line;
   const char* green_prompt = "\u001b[32mtodalu>\u001b[0m ";
   const char* red_prompt = "\u001b[31mtodalu>\u001b[0m ";
   const char* curr_prompt = green_prompt;
-  Interpreter engine;
+  Interpreter engine(use_walker, dynamic_scope);
+  if (!image.empty()) {
+    try {
+      engine.load_image(image);
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
   while ((line = readline(curr_prompt)) != nullptr) {
     curr_prompt = red_prompt;
     try {
@@ -1,45 +1,169 @@
 #include "trt.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <list>
 #include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
 
-static std::map<int64_t, std::list<IRNode*>> gEnv;
+#include <sys/mman.h>
+
+#include "bigint.h"
+#include "memo.h"
+#include "numarray.h"
+
+namespace {
+// Values bound to each symbol in the runtime of the calling thread, innermost
+// first.
+std::map<int64_t, std::list<IRNode*>>& bindings();
+// Prints the collector stats of the runtime a Runtime::Scope entered, if they
+// were asked for, since exit skips its destructor.
+void reportExit();
+}  // namespace
+
+// Results of a lambda from memo, which calls fun of its LambdaStruct with argc
+// arguments on a miss.
+struct LambdaMemo {
+  int argc;
+  MemoTable<IRNode*> results;
+};
 
 typedef union _as {
   int64_t integer;
   double decimal;
-  std::list<IRNode*>* list;
+  NodeList* list;
   char* str;
+  NumArray* array;
 } as;
 
-enum ASTNodeType { Bool = 0, Integer, Decimal, Symbol, List, Lambda, String };
+enum ASTNodeType {
+  Bool = 0,
+  Integer,
+  Decimal,
+  Symbol,
+  List,
+  Lambda,
+  String,
+  Array,
+  // Only in the runtime, an integer too wide for int64 kept in a BigInt.
+  // Compiled code checks for Integer before using the value as an int64.
+  BigInteger
+};
+
+static bool toOperand(IRNode* node, Operand& operand) {
+  as xformer;
+  xformer.integer = node->value;
+  switch (node->type) {
+    case ASTNodeType::Integer:
+      operand.scalar.integer = xformer.integer;
+      return true;
+    case ASTNodeType::Decimal:
+      operand.scalar.decimal = true;
+      operand.scalar.real = xformer.decimal;
+      return true;
+    case ASTNodeType::Array:
+      operand.array = xformer.array;
+      return true;
+  }
+  return false;
+}
+
+static const NumArray& toArray(IRNode* node, const std::string& fun) {
+  if (node->type != ASTNodeType::Array)
+    throw std::runtime_error(fun + " expects argument of type array");
+  return *(NumArray*)node->value;
+}
+
+static void check(const char* error) {
+  if (error) throw std::runtime_error(error);
+}
+
+static IRNode* fromNumber(const Number& number) {
+  if (!number.decimal) return boxInteger(number.integer);
+  auto ret = allocNode();
+  as xformer;
+  ret->type = ASTNodeType::Decimal;
+  xformer.decimal = number.real;
+  ret->value = xformer.integer;
+  return ret;
+}
+
+static bool isInteger(IRNode* node) {
+  return node->type == ASTNodeType::Integer ||
+         node->type == ASTNodeType::BigInteger;
+}
+
+static BigInt toBigInt(IRNode* node) {
+  if (node->type == ASTNodeType::BigInteger) return *(BigInt*)node->value;
+  return BigInt(node->value);
+}
+
+static double toDouble(IRNode* node) {
+  as xformer;
+  xformer.integer = node->value;
+  if (node->type == ASTNodeType::Integer) return (double)xformer.integer;
+  if (node->type == ASTNodeType::BigInteger)
+    return ((BigInt*)node->value)->to_double();
+  return xformer.decimal;
+}
+
+static IRNode* fromBigInt(const BigInt& value) {
+  if (value.fits_int64()) return boxInteger(value.to_int64());
+  auto ret = allocNode();
+  ret->type = ASTNodeType::BigInteger;
+  ret->value = (int64_t) new BigInt(value);
+  return ret;
+}
+
+static IRNode* fromArray(NumArray array) {
+  auto ret = allocNode();
+  ret->type = ASTNodeType::Array;
+  ret->value = (int64_t) new NumArray(std::move(array));
+  return ret;
+}
+
+static IRNode* compareArrays(char op, IRNode* oprnd1, IRNode* oprnd2) {
+  Operand x, y;
+  if (!toOperand(oprnd1, x) || !toOperand(oprnd2, y)) return boxBool(false);
+  NumArray result;
+  check(numarray::elementwise(op, x, y, result));
+  return fromArray(std::move(result));
+}
+
 IRNode* define(IRNode* symbol, IRNode* value, bool shouldPop) {
   if (symbol->type != ASTNodeType::Symbol)
     throw std::runtime_error("Non-symbol can't be defined");
-  if (gEnv.find(symbol->value) != gEnv.end() && gEnv[symbol->value].size()) {
-    if (shouldPop) gEnv[symbol->value].pop_front();
-    gEnv[symbol->value].push_front(value);
-  } else {
-    gEnv[symbol->value].push_front(value);
-  }
+  auto& values = bindings()[symbol->value];
+  if (shouldPop && values.size()) values.pop_front();
+  values.push_front(value);
   return value;
 }
 
-bool evaluateCondition(IRNode* node) {
+bool evaluateCondition(IRNode* node) noexcept {
   if (node->type == ASTNodeType::List) {
-    std::list<IRNode*>* plist = (std::list<IRNode*>*)node->value;
+    NodeList* plist = (NodeList*)node->value;
     return (plist->size() != 0);
   }
+  if (node->type == ASTNodeType::Array)
+    return ((NumArray*)node->value)->size() != 0;
   return (node->value != 0);
 }
 
 IRNode* undefine(IRNode* symbol) {
   if (symbol->type != ASTNodeType::Symbol)
     throw std::runtime_error("Non-symbol can't be undefined");
-  if (gEnv.find(symbol->value) != gEnv.end() && gEnv[symbol->value].size()) {
-    gEnv[symbol->value].pop_front();
+  auto& env = bindings();
+  auto it = env.find(symbol->value);
+  if (it != env.end() && it->second.size()) {
+    it->second.pop_front();
   } else {
     throw std::runtime_error("Can't undefine a symbol that is not defined");
   }
@@ -50,170 +174,605 @@ IRNode* retrieve(IRNode* symbol) {
   if (symbol->type != ASTNodeType::Symbol) {
     throw std::runtime_error("Can't retrieve value of non-symbol");
   }
-  if (gEnv.find(symbol->value) != gEnv.end() && gEnv[symbol->value].size()) {
-    return gEnv[symbol->value].front();
-  }
+  auto& env = bindings();
+  auto it = env.find(symbol->value);
+  if (it != env.end() && it->second.size()) return it->second.front();
   throw std::runtime_error("Undefined symbol");
 }
 
+bool isBoundTo(IRNode* symbol, void* fun, int argc) noexcept {
+  auto& env = bindings();
+  auto it = env.find(symbol->value);
+  if (it == env.end() || it->second.empty()) return false;
+  auto node = it->second.front();
+  if (node->type != ASTNodeType::Lambda) return false;
+  auto pls = (LambdaStruct*)node->value;
+  return pls->fun == fun && pls->argc == argc;
+}
+
 IRNode* is_equal(IRNode* oprnd1, IRNode* oprnd2) {
-  auto ret = new IRNode();
-  ret->type = ASTNodeType::Bool;
-  if (oprnd1->type == oprnd2->type && oprnd1->value == oprnd2->value)
-    ret->value = 1;
-  else
-    ret->value = 0;
-  return ret;
+  if (oprnd1->type == ASTNodeType::Array || oprnd2->type == ASTNodeType::Array)
+    return compareArrays('=', oprnd1, oprnd2);
+  if (oprnd1->type == ASTNodeType::BigInteger &&
+      oprnd2->type == ASTNodeType::BigInteger)
+    return boxBool(toBigInt(oprnd1) == toBigInt(oprnd2));
+  // Integers compare against decimals as doubles, like they do in is_greater.
+  if ((oprnd1->type == ASTNodeType::Decimal && isInteger(oprnd2)) ||
+      (isInteger(oprnd1) && oprnd2->type == ASTNodeType::Decimal))
+    return boxBool(toDouble(oprnd1) == toDouble(oprnd2));
+  return boxBool(oprnd1->type == oprnd2->type &&
+                 oprnd1->value == oprnd2->value);
 }
 
-IRNode* is_type(IRNode* oprnd1, uint32_t type) {
-  auto ret = new IRNode();
-  ret->type = ASTNodeType::Bool;
-  if (oprnd1->type == type)
-    ret->value = 1;
-  else
-    ret->value = 0;
-  return ret;
+IRNode* is_type(IRNode* oprnd1, uint32_t type) noexcept {
+  if (type == ASTNodeType::Integer) return boxBool(isInteger(oprnd1));
+  return boxBool(oprnd1->type == type);
 }
 
 IRNode* is_greater(IRNode* oprnd1, IRNode* oprnd2) {
-  if ((oprnd1->type != ASTNodeType::Integer &&
-       oprnd1->type != ASTNodeType::Decimal) ||
-      (oprnd2->type != ASTNodeType::Integer &&
-       oprnd2->type != ASTNodeType::Decimal))
+  if (oprnd1->type == ASTNodeType::Array || oprnd2->type == ASTNodeType::Array)
+    return compareArrays('>', oprnd1, oprnd2);
+  if ((!isInteger(oprnd1) && oprnd1->type != ASTNodeType::Decimal) ||
+      (!isInteger(oprnd2) && oprnd2->type != ASTNodeType::Decimal))
     throw std::runtime_error("Can't compare operands of non-numeric types");
-  auto ret = new IRNode();
-  ret->type = ASTNodeType::Bool;
-  if (oprnd1->type == oprnd2->type) {
-    if (oprnd1->value > oprnd2->value)
-      ret->value = 1;
-    else
-      ret->value = 0;
-  } else {
-    as xformer;
-    xformer.integer = oprnd1->value;
-    double x = oprnd1->type == ASTNodeType::Integer ? (double)xformer.integer
-                                                    : xformer.decimal;
-    xformer.integer = oprnd2->value;
-    double y = oprnd2->type == ASTNodeType::Integer ? (double)xformer.integer
-                                                    : xformer.decimal;
-    if (x > y)
-      ret->value = 1;
-    else
-      ret->value = 0;
-  }
-  return ret;
+  if (isInteger(oprnd1) && isInteger(oprnd2) &&
+      (oprnd1->type == ASTNodeType::BigInteger ||
+       oprnd2->type == ASTNodeType::BigInteger))
+    return boxBool(compare(toBigInt(oprnd1), toBigInt(oprnd2)) > 0);
+  if (oprnd1->type == ASTNodeType::Integer &&
+      oprnd2->type == ASTNodeType::Integer)
+    return boxBool(oprnd1->value > oprnd2->value);
+  return boxBool(toDouble(oprnd1) > toDouble(oprnd2));
 }
 
 void quit(IRNode* node) {
   if (node->type != ASTNodeType::Integer)
     throw std::runtime_error("Got non-integer exit code");
+  reportExit();
   exit(node->value);
 }
 
-IRNode* allocNode() { return new IRNode(); }
+namespace {
 
-char* allocList() { return (char*)new std::list<IRNode*>(); }
+// A free cell keeps the next free cell in node.value.
+struct Cell {
+  bool marked;
+  bool used;
+  IRNode node;
+};
 
-void listPushBack(char* list, IRNode* node) {
-  ((std::list<IRNode*>*)list)->push_back(node);
+Cell* cellOf(IRNode* node) {
+  return reinterpret_cast<Cell*>(reinterpret_cast<char*>(node) -
+                                 offsetof(Cell, node));
 }
 
-IRNode* arithmetic(char op, uint32_t num_args, ...) {
-  va_list args;
-  va_start(args, num_args);
-  double acc = op == '*' ? 1 : 0;
-  bool all_int = true;
-  as xformer;
-  auto operation = [](double a, double b, char op) {
-    switch (op) {
-      case '+':
-        return a + b;
-      case '-':
-        return a - b;
-      case '*':
-        return a * b;
-      case '/':
-        return a / b;
-      default:
-        throw std::runtime_error("Invalid operation");
+Cell*& nextFree(Cell* cell) {
+  return reinterpret_cast<Cell*&>(cell->node.value);
+}
+
+uint64_t environment(const char* name, uint64_t fallback) {
+  auto value = std::getenv(name);
+  return value ? std::strtoull(value, nullptr, 10) : fallback;
+}
+
+void printStats(const GCStats& stats) {
+  std::fprintf(stderr,
+               "gc : %llu collections, %llu nodes allocated, %llu freed, "
+               "%llu live, %llu at most, %.3f ms, %.3f ms longest pause\n",
+               (unsigned long long)stats.collections,
+               (unsigned long long)stats.allocated,
+               (unsigned long long)stats.freed, (unsigned long long)stats.live,
+               (unsigned long long)stats.max_live, stats.ns / 1e6,
+               stats.max_pause_ns / 1e6);
+}
+
+constexpr size_t kSlabBytes = 256 << 10;
+constexpr size_t kHugeSlabBytes = 2 << 20;
+// Cells a thread takes from the heap at a time.
+constexpr size_t kBatch = 256;
+
+struct Slab {
+  Cell* cells;
+  size_t top;
+  size_t capacity;
+};
+
+struct Heap {
+  Heap() {
+    minimum = environment("TODALU_GC_MIN_HEAP", 1 << 16);
+    growth = environment("TODALU_GC_GROWTH", 2);
+    maximum = environment("TODALU_GC_MAX_HEAP", 0);
+    huge = std::getenv("TODALU_HUGE_PAGES");
+    report = std::getenv("TODALU_GC_STATS");
+    threshold = minimum;
+  }
+  // Frees every node.
+  ~Heap();
+  std::mutex mutex;
+  std::vector<Slab> slabs;
+  Cell* free = nullptr;
+  // Bumped by every collection, which hands the cells in the free lists of
+  // the threads back to the heap.
+  uint64_t epoch = 0;
+  std::vector<IRNode*> roots;
+  uint64_t sinceCollection = 0;
+  uint64_t threshold;
+  uint64_t minimum;
+  uint64_t growth;
+  uint64_t maximum;
+  bool huge;
+  // Whether to print the stats when the program is done.
+  bool report;
+  GCStats stats{};
+};
+
+struct Cache {
+  // Heap the cells came from.
+  Heap* heap = nullptr;
+  Cell* free = nullptr;
+  uint64_t epoch = 0;
+  // Nodes allocated since the last flush.
+  uint64_t allocated = 0;
+};
+
+thread_local Cache tCache;
+
+// Counts the allocations of this thread into the heap. Expects the lock.
+void flush(Heap& state) {
+  if (tCache.heap != &state) return;
+  auto& stats = state.stats;
+  stats.allocated += tCache.allocated;
+  stats.live += tCache.allocated;
+  stats.max_live = std::max(stats.max_live, stats.live);
+  state.sinceCollection += tCache.allocated;
+  tCache.allocated = 0;
+}
+
+Slab newSlab(bool huge) {
+  auto bytes = huge ? kHugeSlabBytes : kSlabBytes;
+  // Huge pages need the slab aligned to their size, so map twice as much and
+  // trim.
+  auto mapped = huge ? 2 * bytes : bytes;
+  auto memory = (char*)mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    std::fprintf(stderr, "Out of memory : can't map a slab\n");
+    std::abort();
+  }
+  if (huge) {
+    auto aligned = (char*)(((uintptr_t)memory + bytes - 1) & ~(bytes - 1));
+    if (aligned > memory) munmap(memory, aligned - memory);
+    munmap(aligned + bytes, memory + mapped - aligned - bytes);
+    memory = aligned;
+    madvise(memory, bytes, MADV_HUGEPAGE);
+  }
+  return {(Cell*)memory, 0, bytes / sizeof(Cell)};
+}
+
+// Takes up to kBatch cells, from the free list of the heap or else out of
+// the last slab.
+Cell* refill(Heap& state) {
+  std::lock_guard<std::mutex> lock(state.mutex);
+  flush(state);
+  tCache.heap = &state;
+  tCache.epoch = state.epoch;
+  if (state.free) {
+    auto first = state.free;
+    auto last = first;
+    for (size_t i = 1; i < kBatch && nextFree(last); i++) last = nextFree(last);
+    state.free = nextFree(last);
+    nextFree(last) = nullptr;
+    return first;
+  }
+  if (state.slabs.empty() ||
+      state.slabs.back().top == state.slabs.back().capacity)
+    state.slabs.push_back(newSlab(state.huge));
+  auto& slab = state.slabs.back();
+  auto count = std::min(kBatch, slab.capacity - slab.top);
+  auto first = slab.cells + slab.top;
+  for (size_t i = 0; i < count; i++)
+    nextFree(first + i) = i + 1 < count ? first + i + 1 : nullptr;
+  slab.top += count;
+  return first;
+}
+
+// Lists, lambdas and arrays are owned by the one node that refers to them.
+void release(IRNode* node) {
+  switch (node->type) {
+    case ASTNodeType::List:
+      delete (NodeList*)node->value;
+      break;
+    case ASTNodeType::Lambda: {
+      auto pls = (LambdaStruct*)node->value;
+      delete pls->arglist;
+      delete pls->memo;
+      delete pls;
+      break;
     }
-  };
+    case ASTNodeType::Array:
+      delete (NumArray*)node->value;
+      break;
+    case ASTNodeType::BigInteger:
+      delete (BigInt*)node->value;
+      break;
+  }
+}
 
-  if (num_args < 2) {
-    std::runtime_error("Too few arguments..");
+Heap::~Heap() {
+  for (auto& slab : slabs) {
+    for (auto cell = slab.cells; cell < slab.cells + slab.top; cell++)
+      if (cell->used) release(&cell->node);
+    munmap(slab.cells, huge ? kHugeSlabBytes : kSlabBytes);
   }
+}
 
-  int i = 0;
-  if (op == '-' || op == '/') {
-    i++;
-    IRNode* arg = va_arg(args, IRNode*);
-    if (arg->type == ASTNodeType::Decimal) {
-      all_int = false;
-      xformer.integer = arg->value;
-      acc = operation(acc, xformer.decimal, '+');
-    } else if (arg->type != ASTNodeType::Integer) {
-      std::cerr << "Add received an incompatible operand type";
-      exit(1);
-    } else {
-      acc = operation(acc, arg->value, '+');
+void mark(std::vector<IRNode*>& stack, uint64_t epoch) {
+  while (!stack.empty()) {
+    auto node = stack.back();
+    stack.pop_back();
+    auto cell = cellOf(node);
+    if (cell->marked) continue;
+    cell->marked = true;
+    // The arguments of lambdas are symbols, which compiled code doesn't
+    // allocate.
+    if (node->type == ASTNodeType::List)
+      ((NodeList*)node->value)->mark(
+          epoch, [&stack](IRNode* child) { stack.push_back(child); });
+    if (node->type == ASTNodeType::Lambda) {
+      auto memo = ((LambdaStruct*)node->value)->memo;
+      if (memo)
+        memo->results.for_each(
+            [&stack](IRNode* result) { stack.push_back(result); });
     }
   }
+}
+
+constexpr int64_t kSmallMin = -256;
+constexpr int64_t kSmallMax = 1024;
+
+// Outside the slabs, so never swept, and marked so that they aren't
+// traversed either.
+struct Singletons {
+  Singletons() {
+    for (int64_t i = 0; i < 2; i++)
+      bools[i] = {true, true, {ASTNodeType::Bool, i}};
+    for (int64_t i = kSmallMin; i < kSmallMax; i++)
+      integers[i - kSmallMin] = {true, true, {ASTNodeType::Integer, i}};
+  }
+  Cell bools[2];
+  Cell integers[kSmallMax - kSmallMin];
+};
+
+Singletons gSingletons;
+
+GCStats statsOf(Heap& state) {
+  std::lock_guard<std::mutex> lock(state.mutex);
+  flush(state);
+  return state.stats;
+}
+
+// Hands the counts of the cache of this thread to its heap and empties it.
+// Its cells go back to the heap with the next collection.
+void dropCache() {
+  if (tCache.heap) {
+    std::lock_guard<std::mutex> lock(tCache.heap->mutex);
+    flush(*tCache.heap);
+  }
+  tCache = Cache();
+}
+
+}  // namespace
+
+ShadowFrame* gShadowStack = nullptr;
+
+struct Runtime::State {
+  explicit State(ShadowFrame** s) : stack(s) {}
+  std::map<int64_t, std::list<IRNode*>> env;
+  Heap heap;
+  // Where compiled code keeps its innermost frame.
+  ShadowFrame** stack;
+  ShadowFrame* frames = nullptr;
+};
+
+namespace {
+
+thread_local Runtime::State* tRuntime = nullptr;
+
+// Runtime of threads that haven't entered one, which compiled code finds
+// through gShadowStack. It is never freed, so that it outlives the atexit
+// handler.
+Runtime::State& processRuntime() {
+  static Runtime::State* state = [] {
+    auto process = new Runtime::State(&gShadowStack);
+    if (process->heap.report)
+      std::atexit([] { printStats(statsOf(processRuntime().heap)); });
+    return process;
+  }();
+  return *state;
+}
+
+Runtime::State& runtime() {
+  return tRuntime ? *tRuntime : processRuntime();
+}
 
-  for (; i < num_args; i++) {
-    IRNode* arg = va_arg(args, IRNode*);
-    if (arg->type == ASTNodeType::Decimal) {
-      all_int = false;
-      xformer.integer = arg->value;
-      acc = operation(acc, xformer.decimal, op);
-    } else if (arg->type != ASTNodeType::Integer) {
-      std::cerr << "Add received an incompatible operand type";
-      exit(1);
-    } else {
-      acc = operation(acc, arg->value, op);
+Heap& heap() { return runtime().heap; }
+
+std::map<int64_t, std::list<IRNode*>>& bindings() { return runtime().env; }
+
+void reportExit() {
+  if (tRuntime && tRuntime->heap.report)
+    printStats(statsOf(tRuntime->heap));
+}
+
+}  // namespace
+
+Runtime::Runtime() : state(new State(nullptr)) {
+  state->stack = &state->frames;
+}
+
+Runtime::~Runtime() {
+  if (state->heap.report) printStats(statsOf(state->heap));
+  delete state;
+}
+
+ShadowFrame** Runtime::shadowStack() { return state->stack; }
+
+Runtime::Scope::Scope(Runtime& runtime) : previous(tRuntime) {
+  dropCache();
+  tRuntime = runtime.state;
+}
+
+Runtime::Scope::~Scope() {
+  dropCache();
+  tRuntime = previous;
+}
+
+GCRoot::GCRoot(IRNode* node) { heap().roots.push_back(node); }
+GCRoot::~GCRoot() { heap().roots.pop_back(); }
+
+void gcCollect() noexcept {
+  auto& current = runtime();
+  auto& state = current.heap;
+  std::lock_guard<std::mutex> lock(state.mutex);
+  auto start = std::chrono::steady_clock::now();
+  flush(state);
+  std::vector<IRNode*> stack(state.roots);
+  for (auto& binding : current.env)
+    stack.insert(stack.end(), binding.second.begin(), binding.second.end());
+  for (auto frame = *current.stack; frame; frame = frame->next)
+    for (int64_t i = 0; i < frame->size; i++)
+      if (frame->slots()[i]) stack.push_back(frame->slots()[i]);
+  mark(stack, state.epoch);
+
+  auto& stats = state.stats;
+  state.free = nullptr;
+  state.epoch++;
+  tCache.free = nullptr;
+  for (auto& slab : state.slabs)
+    for (auto cell = slab.cells; cell < slab.cells + slab.top; cell++) {
+      if (cell->marked) {
+        cell->marked = false;
+        continue;
+      }
+      if (cell->used) {
+        release(&cell->node);
+        cell->used = false;
+        stats.freed++;
+        stats.live--;
+      }
+      nextFree(cell) = state.free;
+      state.free = cell;
     }
+  state.sinceCollection = 0;
+  state.threshold = std::max(state.minimum, stats.live * state.growth);
+
+  uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  stats.collections++;
+  stats.ns += pause;
+  stats.max_pause_ns = std::max(stats.max_pause_ns, pause);
+  if (state.maximum && stats.live > state.maximum) {
+    std::fprintf(stderr, "Out of memory : %llu live nodes\n",
+                 (unsigned long long)stats.live);
+    std::abort();
+  }
+}
+
+void gcSafepoint() noexcept {
+  auto& state = heap();
+  if (state.sinceCollection + tCache.allocated >= state.threshold)
+    gcCollect();
+}
+
+GCStats gcStats() { return statsOf(heap()); }
+
+IRNode* allocNode() noexcept {
+  auto& state = heap();
+  if (!tCache.free || tCache.heap != &state || tCache.epoch != state.epoch)
+    tCache.free = refill(state);
+  auto cell = tCache.free;
+  tCache.free = nextFree(cell);
+  tCache.allocated++;
+  cell->used = true;
+  cell->node = {};
+  return &cell->node;
+}
+
+char* allocList() noexcept { return (char*)new NodeList(); }
+
+void listPushFront(char* list, IRNode* node) noexcept {
+  ((NodeList*)list)->push_front(node);
+}
+
+IRNode* boxBool(bool value) noexcept {
+  return &gSingletons.bools[value].node;
+}
+
+IRNode* bigInteger(const char* digits) {
+  BigInt value;
+  BigInt::parse(digits, value);
+  return fromBigInt(value);
+}
+
+IRNode* boxInteger(int64_t value) noexcept {
+  if (value >= kSmallMin && value < kSmallMax)
+    return &gSingletons.integers[value - kSmallMin].node;
+  auto node = allocNode();
+  node->type = ASTNodeType::Integer;
+  node->value = value;
+  return node;
+}
+
+// Integers are folded exactly, in int64 until that overflows, and operands
+// with a decimal among them in double.
+IRNode* arithmetic(char op, uint32_t num_args, ...) {
+  va_list args;
+  va_start(args, num_args);
+  std::vector<IRNode*> nodes;
+  bool has_array = false;
+  bool all_int = true;
+  for (uint32_t j = 0; j < num_args; j++) {
+    auto node = va_arg(args, IRNode*);
+    nodes.push_back(node);
+    has_array |= node->type == ASTNodeType::Array;
+    all_int &= isInteger(node);
   }
   va_end(args);
+  if (has_array) {
+    std::vector<Operand> operands(num_args);
+    for (uint32_t j = 0; j < num_args; j++) {
+      if (!toOperand(nodes[j], operands[j]))
+        throw std::runtime_error("Unsuitable operand to operator");
+    }
+    NumArray result;
+    check(numarray::fold(op, operands, result));
+    return fromArray(std::move(result));
+  }
 
-  if (not all_int) {
-    auto ret = new IRNode();
+  if (!all_int) {
+    auto operation = [](double a, double b, char op) {
+      switch (op) {
+        case '+':
+          return a + b;
+        case '-':
+          return a - b;
+        case '*':
+          return a * b;
+        case '/':
+          return a / b;
+        default:
+          throw std::runtime_error("Invalid operation");
+      }
+    };
+    as xformer;
+    double acc = 0;
+    for (uint32_t i = 0; i < num_args; i++) {
+      IRNode* arg = nodes[i];
+      double x;
+      if (arg->type == ASTNodeType::Decimal) {
+        xformer.integer = arg->value;
+        x = xformer.decimal;
+      } else if (arg->type == ASTNodeType::Integer) {
+        x = arg->value;
+      } else if (arg->type == ASTNodeType::BigInteger) {
+        x = ((BigInt*)arg->value)->to_double();
+      } else {
+        throw std::runtime_error("Unsuitable operand to operator");
+      }
+      acc = i ? operation(acc, x, op) : x;
+    }
+    auto ret = allocNode();
     ret->type = ASTNodeType::Decimal;
     xformer.decimal = acc;
     ret->value = xformer.integer;
     return ret;
   }
-  auto ret = new IRNode();
-  ret->type = ASTNodeType::Integer;
-  ret->value = (uint64_t)acc;
+
+  auto first = nodes[0];
+  auto fold = first->type == ASTNodeType::BigInteger
+                  ? IntegerFold(*(BigInt*)first->value)
+                  : IntegerFold(first->value);
+  for (uint32_t i = 1; i < num_args; i++) {
+    auto arg = nodes[i];
+    check(arg->type == ASTNodeType::BigInteger
+              ? fold.apply(op, *(BigInt*)arg->value)
+              : fold.apply(op, arg->value));
+  }
+  if (fold.fits()) return boxInteger(fold.integer());
+  return fromBigInt(fold.result());
+}
+
+NodeList::NodeList(const std::vector<IRNode*>& nodes)
+    : cells(new Cells()), count(nodes.size()) {
+  cells->nodes.assign(nodes.rbegin(), nodes.rend());
+}
+
+NodeList::~NodeList() {
+  if (--cells->refs == 0) delete cells;
+}
+
+// Only for lists that don't share their elements yet.
+void NodeList::push_front(IRNode* node) {
+  cells->nodes.push_back(node);
+  count++;
+}
+
+void NodeList::reverse() {
+  std::reverse(cells->nodes.begin(), cells->nodes.begin() + count);
+}
+
+NodeList* NodeList::cons(IRNode* node) const {
+  if (count < cells->nodes.size() && cells->refs > 1) {
+    // A longer list may still see the elements past this one's.
+    auto copy = new NodeList();
+    copy->cells->nodes.reserve(count + 1);
+    copy->cells->nodes.assign(cells->nodes.begin(),
+                              cells->nodes.begin() + count);
+    copy->count = count;
+    copy->push_front(node);
+    return copy;
+  }
+  cells->nodes.resize(count);
+  cells->nodes.push_back(node);
+  return new NodeList(cells, count + 1);
+}
+
+NodeList* NodeList::cdr() const {
+  return new NodeList(cells, count ? count - 1 : 0);
+}
+
+static IRNode* fromList(NodeList* list) {
+  auto ret = allocNode();
+  ret->type = ASTNodeType::List;
+  ret->value = (int64_t)list;
   return ret;
 }
 
 IRNode* deepCopy(IRNode* node) {
-  auto ret = allocNode();
+  // Lambdas, arrays, strings and big integers can't be altered, and what their
+  // value points to belongs to the one node, so they are shared instead.
+  if (node->type == ASTNodeType::Lambda || node->type == ASTNodeType::Array ||
+      node->type == ASTNodeType::String ||
+      node->type == ASTNodeType::BigInteger)
+    return node;
   switch (node->type) {
     case ASTNodeType::Bool:
-    case ASTNodeType::Decimal:
+      return boxBool(node->value != 0);
     case ASTNodeType::Integer:
+      return boxInteger(node->value);
+    case ASTNodeType::Decimal: {
+      auto ret = allocNode();
       ret->value = node->value;
       ret->type = node->type;
       return ret;
-    case ASTNodeType::Lambda:
+    }
     case ASTNodeType::List: {
-      ret->type = node->type;
-      auto list = ((std::list<IRNode*>*)node->value);
-      auto retlist = ((std::list<IRNode*>*)allocList());
-      for (auto it = list->begin(); it != list->end(); it++) {
-        retlist->push_back(deepCopy(*it));
-      }
-      ret->value = (int64_t)retlist;
-      return ret;
+      std::vector<IRNode*> nodes;
+      for (auto child : *(NodeList*)node->value) nodes.push_back(deepCopy(child));
+      return fromList(new NodeList(nodes));
     }
-    case ASTNodeType::String:
-      // HACK Strings can't be altered. So faking a copy.
-      ret->type = node->type;
-      ret->value = node->value;
-      return ret;
-    case ASTNodeType::Symbol:;
+    default:;
   }
   throw std::runtime_error("Not implemented");
 }
@@ -223,25 +782,100 @@ IRNode* throwException() {
   return nullptr;
 }
 
+template <size_t>
+using Argument = IRNode*;
+
+template <size_t... I>
+static IRNode* callWith(void* fun, IRNode** args, std::index_sequence<I...>) {
+  return reinterpret_cast<IRNode* (*)(Argument<I>...)>(fun)(args[I]...);
+}
+
+template <size_t N>
+static IRNode* call(void* fun, IRNode** args) {
+  return callWith(fun, args, std::make_index_sequence<N>());
+}
+
+template <size_t... N>
+static constexpr auto makeCalls(std::index_sequence<N...>) {
+  return std::array<IRNode* (*)(void*, IRNode**), sizeof...(N)>{&call<N>...};
+}
+
+// Calls of compiled lambdas from the runtime, by number of arguments. Compiled
+// code makes its own calls and only comes here to report bad ones.
+static constexpr auto kCalls = makeCalls(std::make_index_sequence<9>());
+
+static int arity(const LambdaStruct* pls) {
+  return pls->memo ? pls->memo->argc : pls->argc;
+}
+
+// Lambdas are keyed by their function, as compiled lambdas have nothing else.
+static void addToKey(IRNode* node, MemoKey& key) {
+  switch (node->type) {
+    case ASTNodeType::Bool:
+      key.tag('b');
+      key.integer(node->value);
+      break;
+    case ASTNodeType::Integer:
+      key.tag('i');
+      key.integer(node->value);
+      break;
+    case ASTNodeType::BigInteger:
+      key.tag('I');
+      key.text(((BigInt*)node->value)->to_string());
+      break;
+    case ASTNodeType::Decimal:
+      key.tag('d');
+      key.integer(node->value);
+      break;
+    case ASTNodeType::Symbol:
+      key.tag('y');
+      key.integer(node->value);
+      break;
+    case ASTNodeType::String: {
+      auto str = (char*)node->value;
+      key.tag('s');
+      key.text(str, strlen(str));
+      break;
+    }
+    case ASTNodeType::List:
+      key.tag('(');
+      for (auto child : *(NodeList*)node->value) addToKey(child, key);
+      key.tag(')');
+      break;
+    case ASTNodeType::Lambda:
+      key.tag('f');
+      key.pointer(((LambdaStruct*)node->value)->fun);
+      break;
+    case ASTNodeType::Array:
+      key.tag('a');
+      key.array(*(NumArray*)node->value);
+      break;
+  }
+}
+
 IRNode* executeLambda(IRNode* lambda, int argc, ...) {
-  va_list args;
-  va_start(args, argc);
   if (lambda->type != ASTNodeType::Lambda)
     throw std::runtime_error("List head not a lambda");
   auto pls = (LambdaStruct*)lambda->value;
-  if (pls->argc != argc) throw std::runtime_error("Lambda argument mismatch");
-  // bind args
-  for (auto it = pls->arglist->begin(); it != pls->arglist->end(); it++) {
-    define(*it, va_arg(args, IRNode*), false);
-  }
-  va_end(args);
-  // call lambda body
-  auto ret = pls->fun();
-  // unbind args
-  for (auto it = pls->arglist->begin(); it != pls->arglist->end(); it++) {
-    undefine(*it);
-  }
-  return ret;
+  if (arity(pls) != argc) throw std::runtime_error("Lambda argument mismatch");
+  if (argc >= (int)kCalls.size())
+    throw std::runtime_error("Too many arguments to a lambda");
+  IRNode* args[kCalls.size()];
+  va_list list;
+  va_start(list, argc);
+  for (int i = 0; i < argc; i++) args[i] = va_arg(list, IRNode*);
+  va_end(list);
+  if (!pls->memo) return kCalls[argc](pls->fun, args);
+  MemoKey key;
+  for (int i = 0; i < argc; i++) addToKey(args[i], key);
+  IRNode* hit = nullptr;
+  if (pls->memo->results.find(key.bytes,
+                              [&hit](IRNode* result) { hit = result; }))
+    return hit;
+  GCRoot root(lambda);
+  auto result = kCalls[argc](pls->fun, args);
+  pls->memo->results.insert(key.bytes, result);
+  return result;
 }
 
 IRNode* createLambda(void* fun, int argc, ...) {
@@ -250,9 +884,9 @@ IRNode* createLambda(void* fun, int argc, ...) {
   auto node = allocNode();
   node->type = ASTNodeType::Lambda;
   auto pls = new LambdaStruct();
-  pls->fun = (IRNode * (*)()) fun;
+  pls->fun = fun;
   pls->argc = argc;
-  pls->arglist = new std::list<IRNode*>();
+  pls->arglist = new std::vector<IRNode*>();
   for (int i = 0; i < argc; i++) {
     auto sym = va_arg(args, IRNode*);
     pls->arglist->push_back(sym);
@@ -265,26 +899,19 @@ IRNode* createLambda(void* fun, int argc, ...) {
 IRNode* car(IRNode* listnode) {
   if (listnode->type != ASTNodeType::List)
     throw std::runtime_error("car expects a list node");
-  return deepCopy(((std::list<IRNode*>*)listnode->value)->front());
+  return deepCopy(((NodeList*)listnode->value)->front());
 }
 
 IRNode* cdr(IRNode* listnode) {
   if (listnode->type != ASTNodeType::List)
     throw std::runtime_error("car expects a list node");
-  auto node = deepCopy(listnode);
-  auto list = ((std::list<IRNode*>*)node->value);
-  delete list->front();
-  list->pop_front();
-  return node;
+  return fromList(((NodeList*)listnode->value)->cdr());
 }
 
 IRNode* cons(IRNode* addNode, IRNode* listnode) {
   if (listnode->type != ASTNodeType::List)
     throw std::runtime_error("car expects a list node");
-  auto node = deepCopy(listnode);
-  auto list = ((std::list<IRNode*>*)node->value);
-  list->push_front(addNode);
-  return node;
+  return fromList(((NodeList*)listnode->value)->cons(addNode));
 }
 
 void printNode(IRNode* node, char endchar) {
@@ -296,6 +923,9 @@ void printNode(IRNode* node, char endchar) {
     case ASTNodeType::Integer:
       std::cout << xformer.integer << end;
       break;
+    case ASTNodeType::BigInteger:
+      std::cout << ((BigInt*)node->value)->to_string() << end;
+      break;
     case ASTNodeType::Decimal:
       std::cout << xformer.decimal << end;
       break;
@@ -314,9 +944,228 @@ void printNode(IRNode* node, char endchar) {
     case ASTNodeType::String:
       std::cout << xformer.str << end;
       break;
+    case ASTNodeType::Array: {
+      auto array = xformer.array;
+      std::cout << "[ ";
+      for (size_t i = 0; i < array->size(); i++) {
+        if (array->decimal)
+          std::cout << array->decimals[i] << ' ';
+        else
+          std::cout << array->ints[i] << ' ';
+      }
+      std::cout << "]" << end;
+      break;
+    }
     case ASTNodeType::Lambda:
       std::cout << "<lambda=" << xformer.decimal << ">" << end;
     default:
       std::cerr << "Unsupported" << std::endl;
   }
 }
+
+IRNode* makeArray(IRNode* listnode) {
+  if (listnode->type == ASTNodeType::Array) return listnode;
+  if (listnode->type != ASTNodeType::List)
+    throw std::runtime_error("array expects a list of numbers");
+  std::vector<Number> numbers;
+  for (auto node : *(NodeList*)listnode->value) {
+    Operand operand;
+    if (!toOperand(node, operand) || operand.array)
+      throw std::runtime_error("array expects a list of numbers");
+    numbers.push_back(operand.scalar);
+  }
+  return fromArray(numarray::from_numbers(numbers));
+}
+
+IRNode* arange(IRNode* start, IRNode* end) {
+  Operand x, y;
+  if (!toOperand(start, x) || !toOperand(end, y) || x.array || y.array)
+    throw std::runtime_error("arange expects numeric arguments");
+  return fromArray(numarray::arange(x.scalar, y.scalar));
+}
+
+IRNode* aref(IRNode* array, IRNode* index) {
+  if (array->type != ASTNodeType::Array || index->type != ASTNodeType::Integer)
+    throw std::runtime_error("aref expects an array and an integer index");
+  Number element;
+  check(numarray::at(*(NumArray*)array->value, index->value, element));
+  return fromNumber(element);
+}
+
+// op is 's' for sum, '<' for min and '>' for max.
+IRNode* arrayReduce(IRNode* array, char op) {
+  std::string fun = op == 's' ? "sum" : op == '<' ? "min" : "max";
+  Number result;
+  if (auto error = numarray::reduce(op, toArray(array, fun), result))
+    throw std::runtime_error(fun + " " + error);
+  return fromNumber(result);
+}
+
+IRNode* dot(IRNode* oprnd1, IRNode* oprnd2) {
+  Number result;
+  check(numarray::dot(toArray(oprnd1, "dot"), toArray(oprnd2, "dot"), result));
+  return fromNumber(result);
+}
+
+IRNode* prefixSum(IRNode* array) {
+  NumArray result;
+  check(numarray::prefix_sum(toArray(array, "prefix-sum"), result));
+  return fromArray(std::move(result));
+}
+
+static NodeList* toList(IRNode* node, const std::string& fun) {
+  if (node->type != ASTNodeType::List)
+    throw std::runtime_error(fun + " expects argument of type list");
+  return (NodeList*)node->value;
+}
+
+IRNode* mapList(IRNode* fn, IRNode* listnode) {
+  auto list = toList(listnode, "map");
+  auto ret = new NodeList();
+  auto node = fromList(ret);
+  GCRoot root(node);
+  for (auto element : *list) ret->push_front(executeLambda(fn, 1, element));
+  ret->reverse();
+  return node;
+}
+
+IRNode* filterList(IRNode* fn, IRNode* listnode) {
+  auto list = toList(listnode, "filter");
+  auto ret = new NodeList();
+  for (auto node : *list)
+    if (evaluateCondition(executeLambda(fn, 1, node))) ret->push_front(node);
+  ret->reverse();
+  return fromList(ret);
+}
+
+// Left fold, (fn (fn init x0) x1) and so on.
+IRNode* reduceList(IRNode* fn, IRNode* init, IRNode* listnode) {
+  auto list = toList(listnode, "reduce");
+  auto acc = init;
+  for (auto node : *list) acc = executeLambda(fn, 2, acc, node);
+  return acc;
+}
+
+// Integers from start up to but excluding end, or decimals if either is one.
+IRNode* rangeList(IRNode* start, IRNode* end) {
+  Operand x, y;
+  if (!toOperand(start, x) || !toOperand(end, y) || x.array || y.array)
+    throw std::runtime_error("range expects numeric arguments");
+  auto ret = new NodeList();
+  Number number;
+  if (x.scalar.decimal || y.scalar.decimal) {
+    number.decimal = true;
+    for (number.real = x.scalar.as_double(); number.real < y.scalar.as_double();
+         number.real++)
+      ret->push_front(fromNumber(number));
+  } else {
+    for (number.integer = x.scalar.integer; number.integer < y.scalar.integer;
+         number.integer++)
+      ret->push_front(fromNumber(number));
+  }
+  ret->reverse();
+  return fromList(ret);
+}
+
+IRNode* listLength(IRNode* node) {
+  Number length;
+  if (node->type == ASTNodeType::Array)
+    length.integer = ((NumArray*)node->value)->size();
+  else
+    length.integer = toList(node, "length")->size();
+  return fromNumber(length);
+}
+
+IRNode* reverseList(IRNode* listnode) {
+  auto list = toList(listnode, "reverse");
+  auto ret = new NodeList();
+  for (auto node : *list) ret->push_front(node);
+  return fromList(ret);
+}
+
+IRNode* appendLists(uint32_t num_args, ...) {
+  va_list args;
+  va_start(args, num_args);
+  auto ret = new NodeList();
+  for (uint32_t i = 0; i < num_args; i++) {
+    for (auto node : *toList(va_arg(args, IRNode*), "append"))
+      ret->push_front(node);
+  }
+  va_end(args);
+  ret->reverse();
+  return fromList(ret);
+}
+
+// Without a comparator, numbers and strings sort in ascending order.
+// Integers compare exactly, and against decimals as doubles.
+static bool lessThan(IRNode* x, IRNode* y) {
+  if (isInteger(x) && isInteger(y))
+    return x->type == ASTNodeType::Integer && y->type == ASTNodeType::Integer
+               ? x->value < y->value
+               : compare(toBigInt(x), toBigInt(y)) < 0;
+  if ((isInteger(x) || x->type == ASTNodeType::Decimal) &&
+      (isInteger(y) || y->type == ASTNodeType::Decimal))
+    return toDouble(x) < toDouble(y);
+  if (x->type == ASTNodeType::String && y->type == ASTNodeType::String)
+    return strcmp((char*)x->value, (char*)y->value) < 0;
+  throw std::runtime_error("sort can't compare its elements");
+}
+
+// fn is null or a lambda where (fn x y) is true if x goes before y. The sort is
+// stable.
+IRNode* sortList(IRNode* listnode, IRNode* fn) {
+  auto list = toList(listnode, "sort");
+  std::vector<IRNode*> nodes(list->begin(), list->end());
+  if (fn)
+    std::stable_sort(nodes.begin(), nodes.end(), [fn](IRNode* x, IRNode* y) {
+      return evaluateCondition(executeLambda(fn, 2, x, y));
+    });
+  else
+    std::stable_sort(nodes.begin(), nodes.end(), lessThan);
+  return fromList(new NodeList(nodes));
+}
+
+IRNode* memoize(IRNode* fn, IRNode* capacity) {
+  if (fn->type != ASTNodeType::Lambda)
+    throw std::runtime_error("memo expects a lambda");
+  size_t size = kMemoCapacity;
+  if (capacity) {
+    if (capacity->type != ASTNodeType::Integer || capacity->value < 0)
+      throw std::runtime_error("memo expects a non-negative capacity");
+    size = capacity->value;
+  }
+  auto pls = (LambdaStruct*)fn->value;
+  auto copy = new LambdaStruct();
+  copy->arglist = new std::vector<IRNode*>(*pls->arglist);
+  copy->fun = pls->fun;
+  copy->argc = -1;
+  copy->memo = new LambdaMemo{arity(pls), MemoTable<IRNode*>(size)};
+  auto node = allocNode();
+  node->type = ASTNodeType::Lambda;
+  node->value = (int64_t)copy;
+  return node;
+}
+
+// ( hits misses size capacity )
+IRNode* memoStats(IRNode* fn) {
+  if (fn->type != ASTNodeType::Lambda || !((LambdaStruct*)fn->value)->memo)
+    throw std::runtime_error("memo-stats expects a memoized lambda");
+  auto stats = ((LambdaStruct*)fn->value)->memo->results.stats();
+  auto list = new NodeList();
+  for (auto count : {stats.hits, stats.misses, stats.size, stats.capacity})
+    list->push_front(boxInteger(count));
+  list->reverse();
+  return fromList(list);
+}
+
+int64_t startTimer() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// For (time expr), value is what expr evaluated to.
+IRNode* stopTimer(int64_t start, IRNode* value) {
+  std::fprintf(stderr, "time : %.3f ms\n", (startTimer() - start) / 1e6);
+  return value;
+}
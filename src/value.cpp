@@ -0,0 +1,138 @@
+#include "value.h"
+
+#include <string>
+#include <vector>
+
+#include "ast.h"
+
+thread_local constinit bool tSharedObjects = false;
+
+// Releases the tail iteratively, so that freeing a long list doesn't recurse
+// once per element.
+PairObject::~PairObject() {
+  Value tail = std::move(cdr);
+  while (tail.is_object() && tail.object()->unshared() &&
+         tail.object()->type == ASTNodeType::List) {
+    Value next = std::move(tail.as<PairObject>()->cdr);
+    tail = std::move(next);
+  }
+}
+
+
+bool truthy(const Value& value) {
+  switch (value.type()) {
+    case ASTNodeType::Bool:
+      return value.boolean();
+    case ASTNodeType::Integer:
+      return value.integer() != 0 || value.is_bigint();
+    case ASTNodeType::Decimal:
+      return value.decimal() != 0;
+    case ASTNodeType::String:
+      return !value.as<StringObject>()->value.empty();
+    case ASTNodeType::List:
+      return !value.is_empty_list();
+    case ASTNodeType::Array:
+      return value.as<ArrayObject>()->data.size() != 0;
+    case ASTNodeType::Symbol:
+    case ASTNodeType::Lambda:
+      return true;
+  }
+  return true;
+}
+
+std::string repr(const Value& value) {
+  switch (value.type()) {
+    case ASTNodeType::Bool:
+      return value.boolean() ? "#true" : "#false";
+    case ASTNodeType::Integer:
+      if (value.is_bigint()) return value.bigint().to_string();
+      return std::to_string(value.integer());
+    case ASTNodeType::Decimal:
+      return std::to_string(value.decimal());
+    case ASTNodeType::String:
+      return "\"" + value.as<StringObject>()->value + "\"";
+    case ASTNodeType::Symbol:
+      return symbol_name(value.symbol());
+    case ASTNodeType::List: {
+      std::string lr = "( ";
+      for (auto list = &value; !list->is_empty_list();
+           list = &list->as<PairObject>()->cdr) {
+        lr += repr(list->as<PairObject>()->car);
+        lr += " ";
+      }
+      lr += ")";
+      return lr;
+    }
+    case ASTNodeType::Lambda:
+      return std::string("<lambda=") +
+             std::to_string((uint64_t)value.object()) + ">";
+    case ASTNodeType::Array:
+      return array_repr(value.as<ArrayObject>()->data);
+  }
+  return "";
+}
+
+Value from_ast(NodeRef node) {
+  switch (node.type()) {
+    case ASTNodeType::Bool:
+      return make_bool(node.boolean());
+    case ASTNodeType::Integer:
+      if (node.is_bigint()) return make_integer(node.bigint());
+      return make_integer(node.integer());
+    case ASTNodeType::Decimal:
+      return make_decimal(node.decimal());
+    case ASTNodeType::String:
+      return make_string(std::string(node.string()));
+    case ASTNodeType::Symbol:
+      return Value::symbol(node.id());
+    case ASTNodeType::List: {
+      auto list = Value::empty_list();
+      for (size_t i = node.size(); i > 0; i--)
+        list = cons(from_ast(node[i - 1]), std::move(list));
+      return list;
+    }
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      return Value(node.object());
+  }
+  return Value();
+}
+
+uint32_t flatten(const Value& value, FlatAST& ast) {
+  FlatNode node{value.type()};
+  switch (value.type()) {
+    case ASTNodeType::Bool:
+      node.boolean = value.boolean();
+      break;
+    case ASTNodeType::Integer:
+      return ast.add_integer(value.bigint());
+    case ASTNodeType::Decimal:
+      node.decimal = value.decimal();
+      break;
+    case ASTNodeType::String: {
+      auto& str = value.as<StringObject>()->value;
+      node.first = ast.chars.size();
+      node.size = str.size();
+      ast.chars += str;
+      break;
+    }
+    case ASTNodeType::Symbol:
+      node.id = value.symbol();
+      break;
+    case ASTNodeType::List: {
+      std::vector<uint32_t> children;
+      for (auto list = &value; !list->is_empty_list();
+           list = &list->as<PairObject>()->cdr)
+        children.push_back(flatten(list->as<PairObject>()->car, ast));
+      auto index = ast.add(node);
+      ast.close_list(index, children, 0);
+      return index;
+    }
+    case ASTNodeType::Lambda:
+    case ASTNodeType::Array:
+      node.first = ast.objects.size();
+      ast.objects.push_back(value.object());
+      break;
+  }
+  return ast.add(node);
+}
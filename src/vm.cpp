@@ -0,0 +1,1648 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "common.h"
+#include "pool.h"
+#include "profile.h"
+
+namespace {
+
+// Parameters of the lambdas enclosing the code being compiled.
+struct Scope {
+  const Scope* parent;
+  std::vector<uint32_t> params;
+  bool captures;
+};
+
+std::shared_ptr<Chunk> compile_lambda(NodeRef arglist, NodeRef body,
+                                      const Scope* parent, const Chunk* outer);
+
+enum class Location { Global, Local, Env };
+
+struct Resolved {
+  Location where;
+  int32_t depth = 0;
+  int32_t slot = 0;
+};
+
+class ChunkCompiler {
+ public:
+  ChunkCompiler(Chunk* c, const Scope* s) : chunk(c), scope(s) {}
+  // Tail positions are the branches of an if, the last form of a progn and
+  // lambda bodies.
+  void compile(NodeRef node, bool tail = false);
+
+ private:
+  void compile_node(NodeRef node);
+  size_t emit(OpCode op, int32_t a = 0, int32_t b = 0, int32_t c = 0) {
+    chunk->code.push_back({op, a, b, c});
+    return chunk->code.size() - 1;
+  }
+  int32_t add_constant(Value value) {
+    chunk->constants.push_back(std::move(value));
+    return chunk->constants.size() - 1;
+  }
+  int32_t add_symbol(uint32_t id) {
+    for (size_t i = 0; i < chunk->symbols.size(); i++)
+      if (chunk->symbols[i] == id) return i;
+    chunk->symbols.push_back(id);
+    chunk->bindings.push_back(&chunk->globals->of(id));
+    return chunk->symbols.size() - 1;
+  }
+  // Errors the tree walker only reports when the form is evaluated are
+  // compiled into a Throw so that they keep firing at the same point.
+  void emit_error(const std::string& msg) {
+    emit(OpCode::Throw, add_constant(make_string(msg)));
+  }
+  // Returns false if the operand count is wrong, after emitting the error.
+  bool check_size(NodeRef listnode, size_t size, const std::string& msg) {
+    if (listnode.size() == size) return true;
+    emit_error(msg);
+    return false;
+  }
+  Resolved resolve(uint32_t id);
+  void compile_builtin(Builtin fun, NodeRef listnode);
+  void compile_lambda_form(NodeRef listnode);
+  void compile_def(NodeRef listnode);
+  void compile_call(NodeRef listnode);
+
+  Chunk* chunk;
+  const Scope* scope;
+};
+
+// Innermost parameter with the given name. Only lambdas that capture their
+// arguments have an Env, so only those count towards the depth.
+Resolved ChunkCompiler::resolve(uint32_t id) {
+  int32_t depth = 0;
+  for (auto s = scope; s; s = s->parent) {
+    for (int32_t slot = s->params.size() - 1; slot >= 0; slot--) {
+      if (s->params[slot] != id) continue;
+      if (s->captures) return {Location::Env, depth, slot};
+      return {Location::Local, 0, slot};
+    }
+    if (s->captures) depth++;
+  }
+  return {Location::Global};
+}
+
+void ChunkCompiler::compile(NodeRef node, bool tail) {
+  auto begin = chunk->code.size();
+  compile_node(node);
+  if (node.type() == ASTNodeType::Symbol || node.type() == ASTNodeType::List)
+    chunk->forms.push_back({static_cast<uint32_t>(begin),
+                            static_cast<uint32_t>(chunk->code.size()),
+                            node.position(), tail});
+}
+
+void ChunkCompiler::compile_node(NodeRef node) {
+  if (node.type() == ASTNodeType::Symbol) {
+    auto id = node.id();
+    if (id == kExceptionSymbol) {
+      emit_error("Exception thrown!");
+      return;
+    }
+    auto resolved = resolve(id);
+    switch (resolved.where) {
+      case Location::Global:
+        emit(OpCode::Load, add_symbol(id));
+        break;
+      case Location::Local:
+        emit(OpCode::LoadLocal, resolved.slot);
+        break;
+      case Location::Env:
+        emit(OpCode::LoadEnv, resolved.depth, resolved.slot);
+        break;
+    }
+    return;
+  }
+  if (node.type() != ASTNodeType::List) {
+    emit(OpCode::Const, add_constant(from_ast(node)));
+    return;
+  }
+  if (node.size() == 0) {
+    emit_error("Can't evaluate ()");
+    return;
+  }
+  auto head = node.front();
+  if (head.type() == ASTNodeType::Symbol && is_builtin(head.id())) {
+    compile_builtin(static_cast<Builtin>(head.id()), node);
+    return;
+  }
+  compile_call(node);
+}
+
+void ChunkCompiler::compile_builtin(Builtin fun, NodeRef listnode) {
+  auto size = listnode.size();
+  auto name = symbol_name(static_cast<uint32_t>(fun));
+
+  switch (fun) {
+    case Builtin::Add:
+    case Builtin::Subtract:
+    case Builtin::Multiply:
+    case Builtin::Divide:
+      if (size < 3) {
+        emit_error("Needs atleast 2 operands");
+        return;
+      }
+      for (size_t i = 1; i < size; i++) compile(listnode[i]);
+      emit(OpCode::Arith, name[0], size - 1);
+      return;
+
+    case Builtin::Equal:
+    case Builtin::Greater:
+      if (!check_size(listnode, 3, name + " expects two arguments")) return;
+      compile(listnode[1]);
+      compile(listnode[2]);
+      emit(fun == Builtin::Greater ? OpCode::Greater : OpCode::Equal);
+      return;
+
+    case Builtin::IsList:
+    case Builtin::IsInt:
+    case Builtin::IsBool:
+    case Builtin::IsDecimal:
+    case Builtin::IsString:
+    case Builtin::IsArray: {
+      if (!check_size(listnode, 2, name + " expects one argument")) return;
+      ASTNodeType checked = fun == Builtin::IsList      ? ASTNodeType::List
+                            : fun == Builtin::IsInt     ? ASTNodeType::Integer
+                            : fun == Builtin::IsBool    ? ASTNodeType::Bool
+                            : fun == Builtin::IsDecimal ? ASTNodeType::Decimal
+                            : fun == Builtin::IsArray   ? ASTNodeType::Array
+                                                        : ASTNodeType::String;
+      compile(listnode[1]);
+      emit(OpCode::IsType, checked);
+      return;
+    }
+
+    case Builtin::Progn:
+      if (size < 2) {
+        emit_error("progn expects atleast one element");
+        return;
+      }
+      for (size_t i = 1; i < size; i++) {
+        if (i != 1) emit(OpCode::Pop);
+        compile(listnode[i], i == size - 1);
+      }
+      return;
+
+    case Builtin::Print:
+    case Builtin::Println:
+      if (!check_size(listnode, 2, "print expects one argument")) return;
+      compile(listnode[1]);
+      emit(OpCode::Print, fun == Builtin::Println);
+      return;
+
+    case Builtin::Quote:
+      if (!check_size(listnode, 2, "quote expects one argument")) return;
+      emit(OpCode::Const, add_constant(from_ast(listnode[1])));
+      return;
+
+    case Builtin::Eval:
+      if (!check_size(listnode, 2, "eval expects one argument")) return;
+      compile(listnode[1]);
+      emit(OpCode::Eval);
+      return;
+
+    case Builtin::Exit:
+      if (size != 2 || listnode[1].type() != ASTNodeType::Integer) {
+        emit_error("exit takes one argument of type integer");
+        return;
+      }
+      compile(listnode[1]);
+      emit(OpCode::Exit);
+      return;
+
+    case Builtin::ReadStr:
+    case Builtin::Read:
+      if (!check_size(listnode, 1, "read doesn't take arguments")) return;
+      emit(fun == Builtin::Read ? OpCode::Read : OpCode::ReadStr);
+      return;
+
+    case Builtin::Car:
+    case Builtin::Cdr:
+      if (!check_size(listnode, 2, name + " expects one argument")) return;
+      compile(listnode[1]);
+      emit(fun == Builtin::Car ? OpCode::Car : OpCode::Cdr);
+      return;
+
+    case Builtin::Cons:
+      if (!check_size(listnode, 3, "cons expects two arguments")) return;
+      compile(listnode[1]);
+      compile(listnode[2]);
+      emit(OpCode::Cons);
+      return;
+
+    case Builtin::Lambda:
+      compile_lambda_form(listnode);
+      return;
+
+    case Builtin::Def:
+      compile_def(listnode);
+      return;
+
+    case Builtin::If: {
+      if (!check_size(listnode, 4, "if expects cond,body and else parts"))
+        return;
+      compile(listnode[1]);
+      auto jump_else = emit(OpCode::JumpIfFalse);
+      compile(listnode[2], true);
+      auto jump_end = emit(OpCode::Jump);
+      chunk->code[jump_else].a = chunk->code.size();
+      compile(listnode[3], true);
+      chunk->code[jump_end].a = chunk->code.size();
+      return;
+    }
+
+    case Builtin::MakeArray:
+    case Builtin::PrefixSum:
+      if (!check_size(listnode, 2, name + " expects one argument")) return;
+      compile(listnode[1]);
+      emit(fun == Builtin::MakeArray ? OpCode::MakeArray : OpCode::PrefixSum);
+      return;
+
+    case Builtin::Arange:
+    case Builtin::Aref:
+    case Builtin::Dot:
+      if (!check_size(listnode, 3, name + " expects two arguments")) return;
+      compile(listnode[1]);
+      compile(listnode[2]);
+      emit(fun == Builtin::Arange ? OpCode::Arange
+           : fun == Builtin::Aref ? OpCode::Aref
+                                  : OpCode::Dot);
+      return;
+
+    case Builtin::Sum:
+    case Builtin::Min:
+    case Builtin::Max:
+      if (!check_size(listnode, 2, name + " expects one argument")) return;
+      compile(listnode[1]);
+      emit(OpCode::Reduce, fun == Builtin::Sum   ? 's'
+                           : fun == Builtin::Min ? '<'
+                                                 : '>');
+      return;
+
+    case Builtin::Map:
+    case Builtin::Filter:
+    case Builtin::Range:
+    case Builtin::Pmap:
+    case Builtin::Pfilter:
+      if (!check_size(listnode, 3, name + " expects two arguments")) return;
+      compile(listnode[1]);
+      compile(listnode[2]);
+      emit(fun == Builtin::Map       ? OpCode::Map
+           : fun == Builtin::Filter  ? OpCode::Filter
+           : fun == Builtin::Range   ? OpCode::Range
+           : fun == Builtin::Pmap    ? OpCode::Pmap
+                                     : OpCode::Pfilter);
+      return;
+
+    case Builtin::Reduce:
+    case Builtin::Preduce:
+      if (!check_size(listnode, 4,
+                      name +
+                          " expects a function, an initial value and a list"))
+        return;
+      for (size_t i = 1; i < size; i++) compile(listnode[i]);
+      emit(fun == Builtin::Reduce ? OpCode::Fold : OpCode::Pfold);
+      return;
+
+    case Builtin::Length:
+    case Builtin::Reverse:
+      if (!check_size(listnode, 2, name + " expects one argument")) return;
+      compile(listnode[1]);
+      emit(fun == Builtin::Length ? OpCode::Length : OpCode::Reverse);
+      return;
+
+    case Builtin::Append:
+      if (size < 2) {
+        emit_error("append expects atleast one list");
+        return;
+      }
+      for (size_t i = 1; i < size; i++) compile(listnode[i]);
+      emit(OpCode::Append, size - 1);
+      return;
+
+    case Builtin::Sort:
+      if (size != 2 && size != 3) {
+        emit_error("sort expects a list and an optional comparator");
+        return;
+      }
+      for (size_t i = 1; i < size; i++) compile(listnode[i]);
+      emit(OpCode::Sort, size == 3);
+      return;
+
+    case Builtin::Time:
+      if (!check_size(listnode, 2, "time expects one argument")) return;
+      emit(OpCode::TimeStart);
+      compile(listnode[1]);
+      emit(OpCode::TimeEnd);
+      return;
+
+    case Builtin::Memo:
+      if (size != 2 && size != 3) {
+        emit_error("memo expects a lambda and an optional capacity");
+        return;
+      }
+      for (size_t i = 1; i < size; i++) compile(listnode[i]);
+      emit(OpCode::Memo, size == 3);
+      return;
+
+    case Builtin::MemoStats:
+      if (!check_size(listnode, 2, "memo-stats expects one argument")) return;
+      compile(listnode[1]);
+      emit(OpCode::MemoStats);
+      return;
+
+    case Builtin::Count:
+      break;
+  }
+  throw std::runtime_error("Unknown builtin");
+}
+
+void ChunkCompiler::compile_lambda_form(NodeRef listnode) {
+  if (!check_size(listnode, 3, "lambda syntax incorrect")) return;
+  auto arglist = listnode[1];
+  auto body = listnode[2];
+  if (arglist.type() == ASTNodeType::List) {
+    for (size_t i = 0; i < arglist.size(); i++) {
+      if (arglist[i].type() != ASTNodeType::Symbol) {
+        emit_error("lambda argument list has non-symbol");
+        return;
+      }
+    }
+  } else if (arglist.type() != ASTNodeType::Symbol) {
+    emit_error("lambda argument has non-symbol");
+    return;
+  }
+  auto code = compile_lambda(arglist, body, scope, chunk);
+  emit(chunk->dynamic_scope ? OpCode::Const : OpCode::Closure,
+       add_constant(Value(new LambdaObject(from_ast(arglist), from_ast(body),
+                                           std::move(code), nullptr))));
+}
+
+void ChunkCompiler::compile_def(NodeRef listnode) {
+  if (!check_size(listnode, 3, "def expects two arguments")) return;
+  auto sym = listnode[1];
+  if (sym.type() == ASTNodeType::List) {
+    compile(sym);
+    compile(listnode[2]);
+    emit(OpCode::DefDynamic);
+  } else if (sym.type() == ASTNodeType::Symbol) {
+    compile(listnode[2]);
+    emit(OpCode::Def, add_symbol(sym.id()));
+  } else {
+    emit_error(std::string("def expects first argument to be symbol. Found ") +
+               sym.getRepr());
+  }
+}
+
+// Lambdas called through a symbol are borrowed from wherever the symbol is
+// bound instead of being copied onto the stack.
+void ChunkCompiler::compile_call(NodeRef listnode) {
+  auto head = listnode.front();
+  Resolved resolved{Location::Global};
+  int32_t symbol = -1;
+  if (head.type() == ASTNodeType::Symbol && head.id() != kExceptionSymbol) {
+    resolved = resolve(head.id());
+    if (resolved.where == Location::Global) {
+      symbol = add_symbol(head.id());
+      emit(OpCode::Callable, symbol);
+    }
+  } else {
+    compile(head);
+  }
+  for (size_t i = 1; i < listnode.size(); i++) compile(listnode[i]);
+  int32_t argc = listnode.size() - 1;
+  if (resolved.where == Location::Local)
+    emit(OpCode::CallLocal, resolved.slot, argc);
+  else if (resolved.where == Location::Env)
+    emit(OpCode::CallEnv, resolved.depth, resolved.slot, argc);
+  else if (symbol >= 0)
+    emit(OpCode::CallGlobal, symbol, argc);
+  else
+    emit(OpCode::Call, argc);
+}
+
+// Whether evaluating node can create a closure over the current arguments.
+bool creates_closures(NodeRef node) {
+  if (node.type() != ASTNodeType::List) return false;
+  if (node.size()) {
+    if (node.front().is_symbol(Builtin::Lambda)) return true;
+    if (node.front().is_symbol(Builtin::Quote)) return false;
+  }
+  for (size_t i = 0; i < node.size(); i++)
+    if (creates_closures(node[i])) return true;
+  return false;
+}
+
+// Turns calls that are followed by a Return, directly or through the jumps
+// out of an if, into tail calls.
+void mark_tail_calls(Chunk* chunk) {
+  auto& code = chunk->code;
+  for (auto& ins : code) {
+    size_t next = &ins - code.data() + 1;
+    while (next < code.size() && code[next].op == OpCode::Jump)
+      next = code[next].a;
+    if (next >= code.size() || code[next].op != OpCode::Return) continue;
+    switch (ins.op) {
+      case OpCode::Call:
+        ins.op = OpCode::TailCall;
+        break;
+      case OpCode::CallGlobal:
+        ins.op = OpCode::TailCallGlobal;
+        break;
+      case OpCode::CallLocal:
+        ins.op = OpCode::TailCallLocal;
+        break;
+      case OpCode::CallEnv:
+        ins.op = OpCode::TailCallEnv;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+std::shared_ptr<Chunk> compile_lambda(NodeRef arglist, NodeRef body,
+                                      const Scope* parent, const Chunk* outer) {
+  auto chunk = std::make_shared<Chunk>();
+  auto globals = outer->globals;
+  auto dynamic_scope = outer->dynamic_scope;
+  chunk->globals = globals;
+  chunk->dynamic_scope = dynamic_scope;
+  chunk->source = outer->source;
+  std::vector<uint32_t> params;
+  if (arglist.type() == ASTNodeType::Symbol) {
+    chunk->single_param = true;
+    params.push_back(arglist.id());
+  } else {
+    for (size_t i = 0; i < arglist.size(); i++)
+      params.push_back(arglist[i].id());
+  }
+  chunk->arity = params.size();
+  if (dynamic_scope) {
+    for (auto id : params) chunk->params.push_back(&globals->of(id));
+    ChunkCompiler compiler(chunk.get(), nullptr);
+    compiler.compile(body, true);
+  } else {
+    chunk->captures = creates_closures(body);
+    Scope scope{parent, params, chunk->captures};
+    ChunkCompiler compiler(chunk.get(), &scope);
+    compiler.compile(body, true);
+  }
+  chunk->code.push_back({OpCode::Return});
+  mark_tail_calls(chunk.get());
+  return chunk;
+}
+
+struct CallFrame {
+  std::shared_ptr<Chunk> chunk;
+  size_t pc = 0;
+  // Stack index of the first argument, or of the first temporary when the
+  // arguments have been moved to the globals or an Env.
+  size_t base = 0;
+  std::shared_ptr<Env> env;
+  // Keeps a lambda that isn't bound to a symbol alive for the call.
+  Value callee;
+  // With dynamic scope, parameters of lambdas that tail called out of this
+  // frame and that the callee didn't rebind. They stay visible until the
+  // frame returns.
+  std::vector<std::vector<Value>*> pending;
+};
+
+// With dynamic scope, a pool worker binds arguments in binding stacks of its
+// own, which shadow the ones in the globals. The thread that started the
+// workers waits for them, so they only read the globals.
+thread_local std::unordered_map<std::vector<Value>*, std::vector<Value>>
+    tWorkerGlobals;
+
+// Where arguments bound to the symbol whose globals entry is bindings go.
+std::vector<Value>* binding_stack(std::vector<Value>* bindings) {
+  if (!pool::in_worker()) return bindings;
+  return &tWorkerGlobals[bindings];
+}
+
+void unbind_parameters(const CallFrame& frame) {
+  if (frame.chunk->dynamic_scope)
+    for (auto bindings : frame.chunk->params)
+      binding_stack(bindings)->pop_back();
+  for (auto bindings : frame.pending) binding_stack(bindings)->pop_back();
+}
+
+// Set while this thread runs calls of pmap, pfilter or preduce, on a pool
+// worker or inline.
+thread_local bool tParallelBody = false;
+
+// With lexical scope a def replaces the global binding instead of shadowing
+// it, since nothing will ever pop it.
+void define(std::vector<Value>* bindings, Value value, bool dynamic) {
+  // The calls may run on workers, and nothing would see their bindings once
+  // they're done.
+  if (tParallelBody) throw TodaluException("def can't be used in parallel");
+  if (dynamic || bindings->empty()) {
+    bindings->push_back(std::move(value));
+  } else {
+    bindings->back() = std::move(value);
+  }
+}
+
+void name_lambda(const Value& value, uint32_t id) {
+  if (value.type() != ASTNodeType::Lambda) return;
+  auto code = value.as<LambdaObject>()->code.get();
+  if (code->name == kAnonymousLambda) code->name = id;
+}
+
+// Builtin that ins implements, for the profiler. Count for instructions that
+// aren't a builtin.
+Builtin builtin_of(const Instruction& ins) {
+  switch (ins.op) {
+    case OpCode::Arith:
+      return ins.a == '+'   ? Builtin::Add
+             : ins.a == '-' ? Builtin::Subtract
+             : ins.a == '*' ? Builtin::Multiply
+                            : Builtin::Divide;
+    case OpCode::Equal:
+      return Builtin::Equal;
+    case OpCode::Greater:
+      return Builtin::Greater;
+    case OpCode::MakeArray:
+      return Builtin::MakeArray;
+    case OpCode::Arange:
+      return Builtin::Arange;
+    case OpCode::Aref:
+      return Builtin::Aref;
+    case OpCode::Reduce:
+      return ins.a == 's'   ? Builtin::Sum
+             : ins.a == '<' ? Builtin::Min
+                            : Builtin::Max;
+    case OpCode::Dot:
+      return Builtin::Dot;
+    case OpCode::PrefixSum:
+      return Builtin::PrefixSum;
+    case OpCode::Map:
+      return Builtin::Map;
+    case OpCode::Filter:
+      return Builtin::Filter;
+    case OpCode::Fold:
+      return Builtin::Reduce;
+    case OpCode::Pmap:
+      return Builtin::Pmap;
+    case OpCode::Pfilter:
+      return Builtin::Pfilter;
+    case OpCode::Pfold:
+      return Builtin::Preduce;
+    case OpCode::Range:
+      return Builtin::Range;
+    case OpCode::Length:
+      return Builtin::Length;
+    case OpCode::Reverse:
+      return Builtin::Reverse;
+    case OpCode::Append:
+      return Builtin::Append;
+    case OpCode::Sort:
+      return Builtin::Sort;
+    case OpCode::IsType:
+      return ins.a == ASTNodeType::List      ? Builtin::IsList
+             : ins.a == ASTNodeType::Integer ? Builtin::IsInt
+             : ins.a == ASTNodeType::Bool    ? Builtin::IsBool
+             : ins.a == ASTNodeType::Decimal ? Builtin::IsDecimal
+             : ins.a == ASTNodeType::String  ? Builtin::IsString
+                                             : Builtin::IsArray;
+    case OpCode::Print:
+      return ins.a ? Builtin::Println : Builtin::Print;
+    case OpCode::Eval:
+      return Builtin::Eval;
+    case OpCode::ReadStr:
+      return Builtin::ReadStr;
+    case OpCode::Read:
+      return Builtin::Read;
+    case OpCode::Car:
+      return Builtin::Car;
+    case OpCode::Cdr:
+      return Builtin::Cdr;
+    case OpCode::Cons:
+      return Builtin::Cons;
+    case OpCode::Memo:
+      return Builtin::Memo;
+    case OpCode::MemoStats:
+      return Builtin::MemoStats;
+    default:
+      return Builtin::Count;
+  }
+}
+
+LambdaObject* as_lambda(const Value& value) {
+  if (value.type() != ASTNodeType::Lambda)
+    throw TodaluException(std::string("Invalid function : ") + repr(value));
+  return value.as<LambdaObject>();
+}
+
+const Value& lookup(Chunk* chunk, int32_t index) {
+  auto bindings = chunk->bindings[index];
+  if (chunk->dynamic_scope && pool::in_worker()) {
+    auto it = tWorkerGlobals.find(bindings);
+    if (it != tWorkerGlobals.end() && !it->second.empty())
+      return it->second.back();
+  }
+  if (bindings->empty())
+    throw TodaluException(std::string("Undefined symbol : ") +
+                          symbol_name(chunk->symbols[index]));
+  return bindings->back();
+}
+
+void check(const char* error, const std::string& fun = "") {
+  if (!error) return;
+  if (fun.empty()) throw TodaluException(error);
+  throw TodaluException(fun + " " + error);
+}
+
+// Integers too wide for int64 can't be array elements.
+bool to_operand(const Value& value, Operand& operand) {
+  switch (value.type()) {
+    case ASTNodeType::Integer:
+      operand.scalar.integer = value.integer();
+      return !value.is_bigint();
+    case ASTNodeType::Decimal:
+      operand.scalar.decimal = true;
+      operand.scalar.real = value.decimal();
+      return true;
+    case ASTNodeType::Array:
+      operand.array = &value.as<ArrayObject>()->data;
+      return true;
+    default:
+      return false;
+  }
+}
+
+Value from_number(const Number& number) {
+  if (number.decimal) return make_decimal(number.real);
+  return make_integer(number.integer);
+}
+
+const NumArray& as_array(const Value& value, const std::string& fun) {
+  if (value.type() != ASTNodeType::Array)
+    throw TodaluException(fun + " expects argument of type array");
+  return value.as<ArrayObject>()->data;
+}
+
+bool is_number(const Value& value) {
+  return value.is_integer() || value.is_decimal();
+}
+
+double as_double(const Value& value) {
+  if (value.is_decimal()) return value.decimal();
+  if (value.is_bigint()) return value.bigint().to_double();
+  return (double)value.integer();
+}
+
+Value arithmetic(char op, const Value* operands, int count) {
+  for (int i = 0; i < count; i++) {
+    if (operands[i].type() != ASTNodeType::Array) continue;
+    std::vector<Operand> arrays(count);
+    for (int j = 0; j < count; j++) {
+      if (!to_operand(operands[j], arrays[j]))
+        throw TodaluException("Unsuitable operand to operator : " +
+                              repr(operands[j]));
+    }
+    NumArray result;
+    check(numarray::fold(op, arrays, result));
+    return make_array(std::move(result));
+  }
+
+  bool is_all_int = true;
+  for (int i = 0; i < count; i++) {
+    if (operands[i].is_decimal()) {
+      is_all_int = false;
+    } else if (!operands[i].is_integer()) {
+      throw TodaluException("Unsuitable operand to operator : " +
+                            repr(operands[i]));
+    }
+  }
+  if (!is_all_int) {
+    auto operation = [](double a, double b, char op) {
+      switch (op) {
+        case '+':
+          return a + b;
+        case '-':
+          return a - b;
+        case '*':
+          return a * b;
+        case '/':
+          return a / b;
+        default:
+          throw std::runtime_error("Invalid operation");
+      }
+    };
+    double acc = as_double(operands[0]);
+    for (int i = 1; i < count; i++)
+      acc = operation(acc, as_double(operands[i]), op);
+    return make_decimal(acc);
+  }
+  auto fold = operands[0].is_bigint() ? IntegerFold(operands[0].bigint())
+                                      : IntegerFold(operands[0].integer());
+  for (int i = 1; i < count; i++)
+    check(operands[i].is_bigint() ? fold.apply(op, operands[i].bigint())
+                                  : fold.apply(op, operands[i].integer()));
+  if (fold.fits()) return make_integer(fold.integer());
+  return make_integer(fold.result());
+}
+
+// Integers compare against decimals as doubles, as sort orders them.
+bool compare_scalars(const Value& oprnd1, const Value& oprnd2, OpCode op) {
+  if (oprnd1.type() != oprnd2.type()) {
+    if (!is_number(oprnd1) || !is_number(oprnd2)) return false;
+    auto x = as_double(oprnd1);
+    auto y = as_double(oprnd2);
+    return op == OpCode::Equal ? x == y : x > y;
+  }
+  if (oprnd1.is_bigint() || oprnd2.is_bigint()) {
+    auto order = compare(oprnd1.bigint(), oprnd2.bigint());
+    return op == OpCode::Equal ? order == 0 : order > 0;
+  }
+  if (oprnd1.type() == ASTNodeType::Integer) {
+    auto x = oprnd1.integer();
+    auto y = oprnd2.integer();
+    return op == OpCode::Equal ? x == y : x > y;
+  }
+  if (oprnd1.type() == ASTNodeType::Decimal) {
+    auto x = oprnd1.decimal();
+    auto y = oprnd2.decimal();
+    return op == OpCode::Equal ? x == y : x > y;
+  }
+  return false;
+}
+
+Value compare(const Value& oprnd1, const Value& oprnd2, OpCode op) {
+  if (oprnd1.type() == ASTNodeType::Array ||
+      oprnd2.type() == ASTNodeType::Array) {
+    Operand x, y;
+    if (!to_operand(oprnd1, x) || !to_operand(oprnd2, y))
+      return make_bool(false);
+    NumArray result;
+    check(numarray::elementwise(op == OpCode::Equal ? '=' : '>', x, y, result));
+    return make_array(std::move(result));
+  }
+  return make_bool(compare_scalars(oprnd1, oprnd2, op));
+}
+
+void check_list(const Value& value, const std::string& fun) {
+  if (value.type() != ASTNodeType::List)
+    throw TodaluException(fun + " expects argument of type list");
+}
+
+// Calls f with every element of list.
+template <class F>
+void for_each(const Value& list, F f) {
+  for (auto it = &list; !it->is_empty_list(); it = &it->as<PairObject>()->cdr)
+    f(it->as<PairObject>()->car);
+}
+
+size_t length(const Value& list) {
+  size_t n = 0;
+  for_each(list, [&n](const Value&) { n++; });
+  return n;
+}
+
+// List of values followed by tail.
+Value make_list(std::vector<Value>& values, Value tail = Value::empty_list()) {
+  for (size_t i = values.size(); i > 0; i--)
+    tail = cons(std::move(values[i - 1]), std::move(tail));
+  return tail;
+}
+
+Value map(const Value& fn, const Value& list) {
+  check_list(list, "map");
+  std::vector<Value> result;
+  result.reserve(length(list));
+  for_each(list,
+           [&](const Value& x) { result.push_back(call_lambda(fn, {x})); });
+  return make_list(result);
+}
+
+Value filter(const Value& fn, const Value& list) {
+  check_list(list, "filter");
+  std::vector<Value> result;
+  result.reserve(length(list));
+  for_each(list, [&](const Value& x) {
+    if (truthy(call_lambda(fn, {x}))) result.push_back(x);
+  });
+  return make_list(result);
+}
+
+// Sets tSharedObjects and tParallelBody on this thread for its lifetime, for
+// the calls of pmap, pfilter and preduce. They work on objects the other
+// threads see too, even when the pool runs them inline.
+class ParallelBody {
+ public:
+  ParallelBody() : shared(tSharedObjects), parallel(tParallelBody) {
+    tSharedObjects = true;
+    tParallelBody = true;
+  }
+  ~ParallelBody() {
+    tSharedObjects = shared;
+    tParallelBody = parallel;
+  }
+
+ private:
+  bool shared;
+  bool parallel;
+};
+
+std::vector<Value> elements(const Value& list) {
+  std::vector<Value> values;
+  values.reserve(length(list));
+  for_each(list, [&values](const Value& x) { values.push_back(x); });
+  return values;
+}
+
+// Results of fn on the elements of list, in order, computed on the pool.
+std::vector<Value> apply_parallel(const Value& fn, const Value& list,
+                                  const std::string& fun) {
+  check_list(list, fun);
+  auto values = elements(list);
+  std::vector<Value> results(values.size());
+  pool::parallel_for(values.size(), [&](size_t begin, size_t end) {
+    ParallelBody body;
+    for (auto i = begin; i < end; i++)
+      results[i] = call_lambda(fn, {values[i]});
+  });
+  return results;
+}
+
+Value parallel_map(const Value& fn, const Value& list) {
+  auto results = apply_parallel(fn, list, "pmap");
+  return make_list(results);
+}
+
+Value parallel_filter(const Value& fn, const Value& list) {
+  auto keep = apply_parallel(fn, list, "pfilter");
+  std::vector<Value> result;
+  size_t i = 0;
+  for_each(list, [&](const Value& x) {
+    if (truthy(keep[i++])) result.push_back(x);
+  });
+  return make_list(result);
+}
+
+// reduce for an associative fn. The ranges of the list the pool hands out are
+// folded starting from their first element, and those results are folded
+// into init in order.
+Value parallel_fold(const Value& fn, Value acc, const Value& list) {
+  check_list(list, "preduce");
+  auto values = elements(list);
+  // Indexed by the start of the range.
+  std::vector<Value> folds(values.size());
+  std::vector<char> folded(values.size());
+  pool::parallel_for(values.size(), [&](size_t begin, size_t end) {
+    ParallelBody body;
+    auto fold = values[begin];
+    for (auto i = begin + 1; i < end; i++)
+      fold = call_lambda(fn, {std::move(fold), values[i]});
+    folds[begin] = std::move(fold);
+    folded[begin] = true;
+  });
+  for (size_t i = 0; i < values.size(); i++)
+    if (folded[i]) acc = call_lambda(fn, {std::move(acc), std::move(folds[i])});
+  return acc;
+}
+
+// Left fold, (fn (fn init x0) x1) and so on.
+Value fold(const Value& fn, Value acc, const Value& list) {
+  check_list(list, "reduce");
+  for_each(list, [&](const Value& x) {
+    acc = call_lambda(fn, {std::move(acc), x});
+  });
+  return acc;
+}
+
+// Integers from start up to but excluding end, or decimals if either is one.
+Value range(const Value& start, const Value& end) {
+  Operand x, y;
+  if (!to_operand(start, x) || !to_operand(end, y) || x.array || y.array)
+    throw TodaluException("range expects numeric arguments");
+  std::vector<Value> result;
+  if (x.scalar.decimal || y.scalar.decimal) {
+    for (double i = x.scalar.as_double(); i < y.scalar.as_double(); i++)
+      result.push_back(make_decimal(i));
+  } else {
+    if (y.scalar.integer > x.scalar.integer)
+      result.reserve(y.scalar.integer - x.scalar.integer);
+    for (auto i = x.scalar.integer; i < y.scalar.integer; i++)
+      result.push_back(make_integer(i));
+  }
+  return make_list(result);
+}
+
+Value reverse(const Value& list) {
+  check_list(list, "reverse");
+  auto result = Value::empty_list();
+  for_each(list,
+           [&result](const Value& x) { result = cons(x, std::move(result)); });
+  return result;
+}
+
+// The last list is shared as the tail of the result.
+Value append(const Value* lists, int32_t count) {
+  for (int32_t i = 0; i < count; i++) check_list(lists[i], "append");
+  std::vector<Value> result;
+  for (int32_t i = 0; i < count - 1; i++)
+    for_each(lists[i], [&result](const Value& x) { result.push_back(x); });
+  return make_list(result, lists[count - 1]);
+}
+
+// Without a comparator, numbers and strings sort in ascending order.
+// Integers compare exactly, and against decimals as doubles.
+bool less_than(const Value& x, const Value& y) {
+  if (x.type() == ASTNodeType::Integer && y.type() == ASTNodeType::Integer)
+    return x.is_bigint() || y.is_bigint() ? compare(x.bigint(), y.bigint()) < 0
+                                          : x.integer() < y.integer();
+  if (is_number(x) && is_number(y)) return as_double(x) < as_double(y);
+  if (x.type() == ASTNodeType::String && y.type() == ASTNodeType::String)
+    return x.as<StringObject>()->value < y.as<StringObject>()->value;
+  throw TodaluException("sort can't compare " + repr(x) + " and " + repr(y));
+}
+
+// (fn x y) is true if x goes before y. The sort is stable.
+Value sort(const Value& list, const Value* fn) {
+  check_list(list, "sort");
+  std::vector<Value> values;
+  values.reserve(length(list));
+  for_each(list, [&values](const Value& x) { values.push_back(x); });
+  if (fn) {
+    std::stable_sort(values.begin(), values.end(),
+                     [fn](const Value& x, const Value& y) {
+                       return truthy(call_lambda(*fn, {x, y}));
+                     });
+  } else {
+    std::stable_sort(values.begin(), values.end(), less_than);
+  }
+  return make_list(values);
+}
+
+// Lambdas are keyed by their address, and added to lambdas.
+void add_to_key(const Value& value, MemoKey& key, std::vector<Value>& lambdas) {
+  switch (value.type()) {
+    case ASTNodeType::Bool:
+      key.tag('b');
+      key.integer(value.boolean());
+      break;
+    case ASTNodeType::Integer:
+      if (value.is_bigint()) {
+        key.tag('I');
+        key.text(value.bigint().to_string());
+      } else {
+        key.tag('i');
+        key.integer(value.integer());
+      }
+      break;
+    case ASTNodeType::Decimal:
+      key.tag('d');
+      key.decimal(value.decimal());
+      break;
+    case ASTNodeType::Symbol:
+      key.tag('y');
+      key.integer(value.symbol());
+      break;
+    case ASTNodeType::String:
+      key.tag('s');
+      key.text(value.as<StringObject>()->value);
+      break;
+    case ASTNodeType::List:
+      key.tag('(');
+      for_each(value, [&key, &lambdas](const Value& x) {
+        add_to_key(x, key, lambdas);
+      });
+      key.tag(')');
+      break;
+    case ASTNodeType::Lambda:
+      key.tag('f');
+      key.pointer(value.object());
+      lambdas.push_back(value);
+      break;
+    case ASTNodeType::Array:
+      key.tag('a');
+      key.array(value.as<ArrayObject>()->data);
+      break;
+  }
+}
+
+// Copy of fn that caches up to capacity of its results.
+Value memoize(const Value& fn, const Value* capacity) {
+  if (fn.type() != ASTNodeType::Lambda)
+    throw TodaluException("memo expects a lambda");
+  auto size = kMemoCapacity;
+  if (capacity) {
+    if (!capacity->is_integer() || capacity->is_bigint() ||
+        capacity->integer() < 0)
+      throw TodaluException("memo expects a non-negative capacity");
+    size = capacity->integer();
+  }
+  auto lambda = fn.as<LambdaObject>();
+  auto copy = new LambdaObject(lambda->arglist, lambda->body, lambda->code,
+                               lambda->env);
+  copy->memo = std::make_shared<MemoTable<MemoResult>>(size);
+  return Value(copy);
+}
+
+// ( hits misses size capacity ) of the cache of a lambda from memo.
+Value memo_stats(const Value& fn) {
+  if (fn.type() != ASTNodeType::Lambda || !fn.as<LambdaObject>()->memo)
+    throw TodaluException("memo-stats expects a memoized lambda");
+  auto stats = fn.as<LambdaObject>()->memo->stats();
+  std::vector<Value> values = {
+      make_integer((int64_t)stats.hits), make_integer((int64_t)stats.misses),
+      make_integer((int64_t)stats.size), make_integer((int64_t)stats.capacity)};
+  return make_list(values);
+}
+
+// Call of a lambda from memo that missed, whose result goes into the cache
+// when the frame at index frame returns.
+struct PendingMemo {
+  size_t frame;
+  std::shared_ptr<MemoTable<MemoResult>> memo;
+  std::string key;
+  std::vector<Value> lambdas;
+};
+
+PairObject* as_nonempty_list(const Value& value, const std::string& fun) {
+  if (value.type() != ASTNodeType::List)
+    throw TodaluException(fun + " expects argument of type list");
+  if (value.is_empty_list())
+    throw TodaluException(fun + " expects a non-empty list");
+  return value.as<PairObject>();
+}
+
+}  // namespace
+
+std::vector<Value>& Globals::of(uint32_t id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (id >= stacks.size()) stacks.resize(id + 1);
+  return stacks[id];
+}
+
+size_t Globals::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stacks.size();
+}
+
+std::shared_ptr<Chunk> compile_form(NodeRef node, Globals& globals,
+                                    bool dynamic_scope) {
+  auto chunk = std::make_shared<Chunk>();
+  chunk->globals = &globals;
+  chunk->dynamic_scope = dynamic_scope;
+  auto source = std::make_shared<FlatAST>();
+  node = source->assign(node);
+  chunk->source = source;
+  ChunkCompiler compiler(chunk.get(), nullptr);
+  compiler.compile(node);
+  chunk->code.push_back({OpCode::Return});
+  mark_tail_calls(chunk.get());
+  return chunk;
+}
+
+namespace {
+
+// Runs entry, or calls callee with args when there is no entry.
+Value execute(std::shared_ptr<Chunk> entry, const Value& callee,
+              std::vector<Value> args) {
+  std::vector<CallFrame> frames;
+  std::vector<Value> stack = std::move(args);
+  // Profiler calls in progress before this invocation, and whether the last
+  // instruction was a builtin whose call is still open.
+  auto profile_mark = gProfiling ? profile::depth() : 0;
+  bool profiling_builtin = false;
+  // Started by TimeStart, innermost last.
+  std::vector<profile::Timer> timers;
+  // Innermost last, at most one per frame.
+  std::vector<PendingMemo> memos;
+  auto pop = [&stack]() {
+    auto value = std::move(stack.back());
+    stack.pop_back();
+    return value;
+  };
+  auto check_arity = [](LambdaObject* lambda, int32_t argc) {
+    auto code = lambda->code.get();
+    if ((code->single_param && argc != 1) ||
+        (!code->single_param && (size_t)argc != code->arity))
+      throw TodaluException("lambda argument count mismatch");
+  };
+  // Pushes the frame for a call whose argc arguments are on top of the stack.
+  // Returns false if the lambda is from memo and had the result cached, which
+  // then replaces the arguments instead.
+  auto enter = [&frames, &stack, &memos, &check_arity](LambdaObject* lambda,
+                                                       int32_t argc) {
+    check_arity(lambda, argc);
+    if (lambda->memo) {
+      auto first = stack.end() - argc;
+      MemoKey key;
+      std::vector<Value> lambdas;
+      for (auto it = first; it != stack.end(); it++)
+        add_to_key(*it, key, lambdas);
+      Value hit;
+      if (lambda->memo->find(key.bytes, [&hit](const MemoResult& result) {
+            hit = result.value;
+          })) {
+        stack.erase(first, stack.end());
+        stack.push_back(std::move(hit));
+        return false;
+      }
+      memos.push_back({frames.size(), lambda->memo, std::move(key.bytes),
+                       std::move(lambdas)});
+    }
+    auto code = lambda->code.get();
+    if (gProfiling) profile::enter(code->name);
+    auto first = stack.size() - argc;
+    if (code->dynamic_scope) {
+      for (int32_t i = 0; i < argc; i++)
+        binding_stack(code->params[i])->push_back(std::move(stack[first + i]));
+      stack.resize(first);
+      frames.push_back({lambda->code, 0, first});
+    } else if (code->captures) {
+      auto env = std::make_shared<Env>(lambda->env);
+      env->slots.assign(std::make_move_iterator(stack.begin() + first),
+                        std::make_move_iterator(stack.end()));
+      stack.resize(first);
+      frames.push_back({lambda->code, 0, first, std::move(env)});
+    } else {
+      frames.push_back({lambda->code, 0, first, lambda->env});
+    }
+    return true;
+  };
+  // Replaces the current frame with one for callee, so that tail recursion
+  // runs in constant space. With dynamic scope the parameters of the current
+  // frame are dropped where the callee binds the same symbol, and otherwise
+  // kept bound until the frame returns.
+  auto tail_enter = [&frames, &stack, &check_arity, &enter, profile_mark](
+                        Value callee, int32_t argc) {
+    auto lambda = callee.as<LambdaObject>();
+    // The cache needs the result, so memoized calls don't replace the frame.
+    // A pending result of the current frame is the callee's result either
+    // way.
+    if (lambda->memo) {
+      if (enter(lambda, argc)) frames.back().callee = std::move(callee);
+      return;
+    }
+    check_arity(lambda, argc);
+    auto code = lambda->code.get();
+    if (gProfiling) {
+      // Only the entry chunk isn't a profiled call.
+      if (profile::depth() > profile_mark) profile::leave();
+      profile::enter(code->name);
+    }
+    auto& frame = frames.back();
+    if (frame.chunk->dynamic_scope || !frame.pending.empty()) {
+      std::vector<std::vector<Value>*> rebound(code->params);
+      std::vector<std::vector<Value>*> pending;
+      auto release = [&rebound, &pending](std::vector<Value>* bindings) {
+        auto it = std::find(rebound.begin(), rebound.end(), bindings);
+        if (it == rebound.end()) {
+          pending.push_back(bindings);
+        } else {
+          binding_stack(bindings)->pop_back();
+          rebound.erase(it);
+        }
+      };
+      if (frame.chunk->dynamic_scope)
+        for (auto bindings : frame.chunk->params) release(bindings);
+      for (auto bindings : frame.pending) release(bindings);
+      frame.pending = std::move(pending);
+    }
+    auto first = stack.size() - argc;
+    if (code->dynamic_scope) {
+      for (int32_t i = 0; i < argc; i++)
+        binding_stack(code->params[i])->push_back(std::move(stack[first + i]));
+      stack.resize(frame.base);
+      frame.env = nullptr;
+    } else if (code->captures) {
+      auto env = std::make_shared<Env>(lambda->env);
+      env->slots.assign(std::make_move_iterator(stack.begin() + first),
+                        std::make_move_iterator(stack.end()));
+      stack.resize(frame.base);
+      frame.env = std::move(env);
+    } else {
+      for (int32_t i = 0; i < argc; i++)
+        stack[frame.base + i] = std::move(stack[first + i]);
+      stack.resize(frame.base + argc);
+      frame.env = lambda->env;
+    }
+    frame.chunk = lambda->code;
+    frame.pc = 0;
+    frame.callee = std::move(callee);
+  };
+  if (entry) {
+    frames.push_back({entry});
+  } else if (enter(as_lambda(callee), stack.size())) {
+    frames.back().callee = callee;
+  } else {
+    return std::move(stack.back());
+  }
+  try {
+    while (true) {
+      auto frame = &frames.back();
+      auto chunk = frame->chunk.get();
+      const Instruction ins = chunk->code[frame->pc++];
+      if (gProfiling) {
+        if (profiling_builtin) profile::leave();
+        auto builtin = builtin_of(ins);
+        profiling_builtin = builtin != Builtin::Count;
+        if (profiling_builtin) profile::enter(static_cast<uint32_t>(builtin));
+      }
+      switch (ins.op) {
+        case OpCode::Const:
+          stack.push_back(chunk->constants[ins.a]);
+          break;
+        case OpCode::Closure: {
+          auto templ = chunk->constants[ins.a].as<LambdaObject>();
+          stack.push_back(Value(new LambdaObject(templ->arglist, templ->body,
+                                                 templ->code, frame->env)));
+          break;
+        }
+        case OpCode::Load:
+          stack.push_back(lookup(chunk, ins.a));
+          break;
+        case OpCode::LoadLocal:
+          stack.push_back(stack[frame->base + ins.a]);
+          break;
+        case OpCode::LoadEnv: {
+          auto env = frame->env.get();
+          for (int32_t i = 0; i < ins.a; i++) env = env->parent.get();
+          stack.push_back(env->slots[ins.b]);
+          break;
+        }
+        case OpCode::Def:
+          define(chunk->bindings[ins.a], stack.back(), chunk->dynamic_scope);
+          name_lambda(stack.back(), chunk->symbols[ins.a]);
+          break;
+        case OpCode::DefDynamic: {
+          auto value = pop();
+          auto sym = pop();
+          if (sym.type() != ASTNodeType::Symbol)
+            throw TodaluException(
+                std::string("def expects first argument to be symbol. Found ") +
+                repr(sym));
+          define(&chunk->globals->of(sym.symbol()), value,
+                 chunk->dynamic_scope);
+          name_lambda(value, sym.symbol());
+          stack.push_back(std::move(value));
+          break;
+        }
+        case OpCode::Pop:
+          stack.pop_back();
+          break;
+        case OpCode::Jump:
+          frame->pc = ins.a;
+          break;
+        case OpCode::JumpIfFalse:
+          if (!truthy(pop())) frame->pc = ins.a;
+          break;
+        case OpCode::Callable:
+          as_lambda(lookup(chunk, ins.a));
+          break;
+        case OpCode::Call: {
+          // Take the callee from below its arguments, it is kept alive by the
+          // frame until the call returns.
+          auto position = stack.end() - ins.a - 1;
+          auto lambda = as_lambda(*position);
+          Value callee = std::move(*position);
+          stack.erase(position);
+          if (enter(lambda, ins.a)) frames.back().callee = std::move(callee);
+          break;
+        }
+        case OpCode::CallGlobal:
+          enter(as_lambda(lookup(chunk, ins.a)), ins.b);
+          break;
+        case OpCode::CallLocal:
+          enter(as_lambda(stack[frame->base + ins.a]), ins.b);
+          break;
+        case OpCode::CallEnv: {
+          auto env = frame->env.get();
+          for (int32_t i = 0; i < ins.a; i++) env = env->parent.get();
+          enter(as_lambda(env->slots[ins.b]), ins.c);
+          break;
+        }
+        case OpCode::TailCall: {
+          auto position = stack.end() - ins.a - 1;
+          as_lambda(*position);
+          Value callee = std::move(*position);
+          stack.erase(position);
+          tail_enter(std::move(callee), ins.a);
+          break;
+        }
+        case OpCode::TailCallGlobal: {
+          auto& callee = lookup(chunk, ins.a);
+          as_lambda(callee);
+          tail_enter(callee, ins.b);
+          break;
+        }
+        case OpCode::TailCallLocal: {
+          auto& callee = stack[frame->base + ins.a];
+          as_lambda(callee);
+          tail_enter(callee, ins.b);
+          break;
+        }
+        case OpCode::TailCallEnv: {
+          auto env = frame->env.get();
+          for (int32_t i = 0; i < ins.a; i++) env = env->parent.get();
+          as_lambda(env->slots[ins.b]);
+          tail_enter(env->slots[ins.b], ins.c);
+          break;
+        }
+        case OpCode::Map:
+        case OpCode::Filter: {
+          auto list = pop();
+          auto fn = pop();
+          stack.push_back(ins.op == OpCode::Map ? map(fn, list)
+                                                : filter(fn, list));
+          break;
+        }
+        case OpCode::Fold:
+        case OpCode::Pfold: {
+          auto list = pop();
+          auto init = pop();
+          auto fn = pop();
+          stack.push_back(ins.op == OpCode::Fold
+                              ? fold(fn, std::move(init), list)
+                              : parallel_fold(fn, std::move(init), list));
+          break;
+        }
+        case OpCode::Pmap:
+        case OpCode::Pfilter: {
+          auto list = pop();
+          auto fn = pop();
+          stack.push_back(ins.op == OpCode::Pmap ? parallel_map(fn, list)
+                                                 : parallel_filter(fn, list));
+          break;
+        }
+        case OpCode::Range: {
+          auto end = pop();
+          auto start = pop();
+          stack.push_back(range(start, end));
+          break;
+        }
+        case OpCode::Length: {
+          auto oprnd = pop();
+          if (oprnd.type() == ASTNodeType::Array) {
+            stack.push_back(make_integer(oprnd.as<ArrayObject>()->data.size()));
+          } else {
+            check_list(oprnd, "length");
+            stack.push_back(make_integer(length(oprnd)));
+          }
+          break;
+        }
+        case OpCode::Reverse: {
+          auto oprnd = pop();
+          stack.push_back(reverse(oprnd));
+          break;
+        }
+        case OpCode::Append: {
+          auto first = stack.size() - ins.a;
+          auto result = append(&stack[first], ins.a);
+          stack.resize(first);
+          stack.push_back(std::move(result));
+          break;
+        }
+        case OpCode::Sort: {
+          Value fn;
+          if (ins.a) fn = pop();
+          auto list = pop();
+          stack.push_back(sort(list, ins.a ? &fn : nullptr));
+          break;
+        }
+        case OpCode::Arith: {
+          auto first = stack.size() - ins.b;
+          auto result = arithmetic(ins.a, &stack[first], ins.b);
+          stack.resize(first);
+          stack.push_back(std::move(result));
+          break;
+        }
+        case OpCode::Equal:
+        case OpCode::Greater: {
+          auto oprnd2 = pop();
+          auto oprnd1 = pop();
+          stack.push_back(compare(oprnd1, oprnd2, ins.op));
+          break;
+        }
+        case OpCode::MakeArray: {
+          auto oprnd = pop();
+          if (oprnd.type() == ASTNodeType::Array) {
+            stack.push_back(std::move(oprnd));
+            break;
+          }
+          if (oprnd.type() != ASTNodeType::List)
+            throw TodaluException("array expects a list of numbers");
+          std::vector<Number> numbers;
+          for (auto list = &oprnd; !list->is_empty_list();
+               list = &list->as<PairObject>()->cdr) {
+            Operand operand;
+            if (!to_operand(list->as<PairObject>()->car, operand) ||
+                operand.array)
+              throw TodaluException("array expects a list of numbers");
+            numbers.push_back(operand.scalar);
+          }
+          stack.push_back(make_array(numarray::from_numbers(numbers)));
+          break;
+        }
+        case OpCode::Arange: {
+          auto end = pop();
+          auto start = pop();
+          Operand x, y;
+          if (!to_operand(start, x) || !to_operand(end, y) || x.array ||
+              y.array)
+            throw TodaluException("arange expects numeric arguments");
+          stack.push_back(make_array(numarray::arange(x.scalar, y.scalar)));
+          break;
+        }
+        case OpCode::Aref: {
+          auto index = pop();
+          auto array = pop();
+          if (array.type() != ASTNodeType::Array || !index.is_integer())
+            throw TodaluException("aref expects an array and an integer index");
+          Number element;
+          check(numarray::at(array.as<ArrayObject>()->data,
+                             index.is_bigint() ? -1 : index.integer(),
+                             element));
+          stack.push_back(from_number(element));
+          break;
+        }
+        case OpCode::Reduce: {
+          auto oprnd = pop();
+          auto fun = ins.a == 's' ? "sum" : ins.a == '<' ? "min" : "max";
+          Number result;
+          check(numarray::reduce(ins.a, as_array(oprnd, fun), result), fun);
+          stack.push_back(from_number(result));
+          break;
+        }
+        case OpCode::Dot: {
+          auto oprnd2 = pop();
+          auto oprnd1 = pop();
+          Number result;
+          check(numarray::dot(as_array(oprnd1, "dot"), as_array(oprnd2, "dot"),
+                              result));
+          stack.push_back(from_number(result));
+          break;
+        }
+        case OpCode::PrefixSum: {
+          auto oprnd = pop();
+          NumArray result;
+          check(numarray::prefix_sum(as_array(oprnd, "prefix-sum"), result));
+          stack.push_back(make_array(std::move(result)));
+          break;
+        }
+        case OpCode::IsType: {
+          auto oprnd = pop();
+          stack.push_back(make_bool(oprnd.type() == ins.a));
+          break;
+        }
+        case OpCode::Print: {
+          auto& oprnd = stack.back();
+          if (oprnd.type() == ASTNodeType::String) {
+            std::cout << oprnd.as<StringObject>()->value;
+          } else {
+            std::cout << repr(oprnd);
+          }
+          if (ins.a) std::cout << "\n";
+          break;
+        }
+        case OpCode::Eval: {
+          auto oprnd = pop();
+          FlatAST form;
+          form.roots.push_back(flatten(oprnd, form));
+          stack.push_back(run_chunk(compile_form(
+              form.root(0), *chunk->globals, chunk->dynamic_scope)));
+          break;
+        }
+        case OpCode::Exit:
+          exit(pop().integer());
+        case OpCode::ReadStr: {
+          std::string s;
+          std::getline(std::cin, s);
+          stack.push_back(make_string(s));
+          break;
+        }
+        case OpCode::Read: {
+          std::string s;
+          std::getline(std::cin, s);
+          FlatAST form;
+          read_forms(s, form);
+          if (form.size() != 1)
+            throw TodaluException("Contains more than one node at the base");
+          stack.push_back(from_ast(form.root(0)));
+          break;
+        }
+        case OpCode::Car: {
+          auto oprnd = pop();
+          stack.push_back(as_nonempty_list(oprnd, "car")->car);
+          break;
+        }
+        case OpCode::Cdr: {
+          auto tail = as_nonempty_list(stack.back(), "cdr")->cdr;
+          stack.back() = std::move(tail);
+          break;
+        }
+        case OpCode::Cons: {
+          if (stack.back().type() != ASTNodeType::List)
+            throw TodaluException("cons expects second argument of type list");
+          auto list = pop();
+          stack.back() = cons(std::move(stack.back()), std::move(list));
+          break;
+        }
+        case OpCode::Throw:
+          throw TodaluException(
+              chunk->constants[ins.a].as<StringObject>()->value);
+        case OpCode::TimeStart:
+          timers.emplace_back();
+          break;
+        case OpCode::TimeEnd:
+          timers.back().report();
+          timers.pop_back();
+          break;
+        case OpCode::Memo: {
+          Value capacity;
+          if (ins.a) capacity = pop();
+          auto fn = pop();
+          stack.push_back(memoize(fn, ins.a ? &capacity : nullptr));
+          break;
+        }
+        case OpCode::MemoStats: {
+          auto fn = pop();
+          stack.push_back(memo_stats(fn));
+          break;
+        }
+        case OpCode::Return: {
+          auto result = pop();
+          unbind_parameters(*frame);
+          if (!memos.empty() && memos.back().frame == frames.size() - 1) {
+            auto& pending = memos.back();
+            pending.memo->insert(pending.key,
+                                 {result, std::move(pending.lambdas)});
+            memos.pop_back();
+          }
+          if (frames.size() == 1) {
+            if (gProfiling) profile::unwind(profile_mark);
+            return result;
+          }
+          if (gProfiling) profile::leave();
+          stack.resize(frame->base);
+          stack.push_back(std::move(result));
+          frames.pop_back();
+          break;
+        }
+      }
+    }
+  } catch (...) {
+    if (gProfiling) profile::unwind(profile_mark);
+    stack.clear();
+    // Names the forms being evaluated, innermost first, as the tree walker
+    // does. It names where each of its evaluations started and where it
+    // stopped, that is every form out of tail position and every form around
+    // one whose tail position it was in. Memoized calls and calls from
+    // builtins evaluate the lambda body out of tail position.
+    bool stopped = true;
+    auto report = [&stopped](const Chunk& chunk, const Chunk::Form& form,
+                             bool tail) {
+      if (!tail || stopped)
+        std::cerr << "Error encountered while operating on : " +
+                         NodeRef(chunk.source.get(), form.node).getRepr()
+                  << std::endl;
+      stopped = !tail;
+    };
+    for (size_t i = frames.size(); i-- > 0;) {
+      auto& frame = frames[i];
+      auto& forms = frame.chunk->forms;
+      bool body_tail =
+          (entry || i) && std::none_of(memos.begin(), memos.end(),
+                                       [i](const PendingMemo& memo) {
+                                         return memo.frame == i;
+                                       });
+      for (auto& form : forms)
+        if (form.begin < frame.pc && frame.pc <= form.end)
+          report(*frame.chunk, form,
+                 form.tail && (&form != &forms.back() || body_tail));
+    }
+    // The form the entry chunk was compiled from, when a tail call replaced it.
+    if (entry && !frames.empty() && frames.front().chunk != entry)
+      report(*entry, entry->forms.back(), false);
+    while (!frames.empty()) {
+      unbind_parameters(frames.back());
+      frames.pop_back();
+    }
+    throw;
+  }
+}
+
+}  // namespace
+
+Value run_chunk(std::shared_ptr<Chunk> entry) {
+  return execute(std::move(entry), Value(), {});
+}
+
+Value call_lambda(const Value& fn, std::vector<Value> args) {
+  return execute(nullptr, fn, std::move(args));
+}